@@ -0,0 +1,215 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * vmstat-like monitor for a running umap application.  The application must
+ * have been started with UMAP_STATS_SOCKET set; umapstat periodically polls
+ * that socket and prints per-region rates.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+typedef std::map<std::string, std::string> Record;
+
+struct Sample {
+  Record              header;
+  std::vector<Record> regions;
+};
+
+static void usage(const char* pname)
+{
+  std::cerr
+    << "Usage: " << pname << " [-i seconds] [-c count] socket_path\n\n"
+    << " -i seconds  - Delay between updates, default: 1\n"
+    << " -c count    - Number of updates, default: unlimited\n\n"
+    << " socket_path is the UMAP_STATS_SOCKET of the running application\n";
+  exit(1);
+}
+
+static bool fetch(const char* path, std::string& out)
+{
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if ( fd == -1 )
+    return false;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  if ( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ) {
+    close(fd);
+    return false;
+  }
+
+  char buf[4096];
+  ssize_t n;
+
+  out.clear();
+  while ( (n = read(fd, buf, sizeof(buf))) > 0 )
+    out.append(buf, n);
+
+  close(fd);
+  return n == 0;
+}
+
+static Sample parse(const std::string& text)
+{
+  Sample s;
+  std::istringstream lines(text);
+  std::string line;
+
+  while ( std::getline(lines, line) ) {
+    std::istringstream words(line);
+    std::string kind, kv;
+    Record r;
+
+    words >> kind;
+    while ( words >> kv ) {
+      auto eq = kv.find('=');
+      if ( eq != std::string::npos )
+        r[kv.substr(0, eq)] = kv.substr(eq + 1);
+    }
+
+    if ( kind == "umap" )
+      s.header = r;
+    else if ( kind == "region" )
+      s.regions.push_back(r);
+  }
+  return s;
+}
+
+static uint64_t value(const Record& r, const char* key)
+{
+  auto it = r.find(key);
+  return it == r.end() ? 0 : strtoull(it->second.c_str(), nullptr, 0);
+}
+
+static const Record* find_region(const Sample& s, const std::string& addr)
+{
+  for ( auto& r : s.regions ) {
+    auto it = r.find("addr");
+    if ( it != r.end() && it->second == addr )
+      return &r;
+  }
+  return nullptr;
+}
+
+static void print_header()
+{
+  printf("%-16s %10s %10s %9s %9s %9s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n",
+      "region", "size(MB)", "resident", "flt/s", "wflt/s", "fill/s",
+      "evict/s", "wb/s", "rdMB/s", "wrMB/s", "stall/s", "shoot/s",
+      "dlat(us)", "plat(us)", "cncl/s");
+}
+
+static void print_sample(const Sample& cur, const Sample* prev)
+{
+  double secs = 0.0;
+
+  if ( prev != nullptr )
+    secs = (value(cur.header, "time_ns") - value(prev->header, "time_ns")) / 1e9;
+
+  for ( auto& r : cur.regions ) {
+    const Record* p = (prev != nullptr && secs > 0.0) ? find_region(*prev, r.at("addr")) : nullptr;
+
+    //
+    // Without a previous sample of the region the rates are averages since
+    // the region was created, which is what vmstat prints on its first line.
+    //
+    auto rate = [&](const char* key, double scale) -> double {
+      uint64_t v = value(r, key);
+      if ( p == nullptr )
+        return v / scale;
+      return (v - value(*p, key)) / scale / secs;
+    };
+
+    //
+    // Average time a fill of the demand or the prefetch lane took, from
+    // the fault or request to the pages being present
+    //
+    auto latency = [&](const char* count_key, const char* ns_key) -> double {
+      uint64_t n = value(r, count_key) - (p ? value(*p, count_key) : 0);
+      uint64_t ns = value(r, ns_key) - (p ? value(*p, ns_key) : 0);
+      return n ? ns / 1000.0 / n : 0.0;
+    };
+
+    printf("%-16s %10.1f %10llu %9.0f %9.0f %9.0f %9.0f %9.0f %9.1f %9.1f %9.0f %9.0f %9.1f %9.1f %9.0f\n",
+        r.at("addr").c_str(),
+        value(r, "size") / 1048576.0,
+        (unsigned long long)value(r, "resident_pages"),
+        rate("faults", 1.0), rate("write_faults", 1.0), rate("fills", 1.0),
+        rate("evictions", 1.0), rate("write_backs", 1.0),
+        rate("bytes_read", 1048576.0), rate("bytes_written", 1048576.0),
+        rate("stalls", 1.0), rate("shootdowns", 1.0),
+        latency("demand_fills", "demand_fill_ns"),
+        latency("prefetch_fills", "prefetch_fill_ns"),
+        rate("prefetch_cancelled", 1.0));
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+  unsigned int interval = 1;
+  long count = -1;
+  int c;
+
+  while ( (c = getopt(argc, argv, "i:c:h")) != -1 ) {
+    switch (c) {
+      case 'i': interval = strtoul(optarg, nullptr, 0); break;
+      case 'c': count = strtol(optarg, nullptr, 0); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if ( optind != argc - 1 )
+    usage(argv[0]);
+
+  const char* path = argv[optind];
+  Sample prev;
+  bool have_prev = false;
+
+  for ( long i = 0; count < 0 || i < count; ++i ) {
+    std::string text;
+
+    if ( i != 0 )
+      sleep(interval);
+
+    if ( ! fetch(path, text) ) {
+      if ( have_prev )
+        return 0;     // Application has gone away
+      std::cerr << "Unable to read statistics from " << path << ": "
+                << strerror(errno) << "\n";
+      return 1;
+    }
+
+    Sample cur = parse(text);
+
+    if ( i % 20 == 0 )
+      print_header();
+
+    print_sample(cur, have_prev ? &prev : nullptr);
+    prev = cur;
+    have_prev = true;
+  }
+  return 0;
+}
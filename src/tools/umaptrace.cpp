@@ -0,0 +1,247 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Convert a umap event trace (see UMAP_TRACE_FILE and umap_trace_dump()) into
+ * the Chrome trace event JSON format understood by chrome://tracing and
+ * https://ui.perfetto.dev.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+
+#include "umap/util/Trace.hpp"
+
+using namespace Umap::trace;
+
+struct ThreadTrace {
+  ThreadHeader        hdr;
+  std::vector<Record> records;
+};
+
+struct EventSummary {
+  EventSummary() : count(0), total_ns(0), max_ns(0) {}
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+
+static void usage(const char* pname)
+{
+  std::cerr
+    << "Usage: " << pname << " [-o output.json] [-s] trace_file\n\n"
+    << " -o output.json   - Write JSON to this file instead of stdout\n"
+    << " -s               - Print a per-event duration summary instead of JSON\n";
+  exit(1);
+}
+
+static bool read_trace(const char* fname, FileHeader& fh, std::vector<ThreadTrace>& threads)
+{
+  std::ifstream in(fname, std::ios::in | std::ios::binary);
+
+  if ( !in ) {
+    std::cerr << "Unable to open " << fname << "\n";
+    return false;
+  }
+
+  in.read((char*)&fh, sizeof(fh));
+  if ( !in || memcmp(fh.magic, TRACE_MAGIC, sizeof(fh.magic)) != 0 ) {
+    std::cerr << fname << " is not a umap trace file\n";
+    return false;
+  }
+
+  threads.resize(fh.num_threads);
+  for ( auto& t : threads ) {
+    in.read((char*)&t.hdr, sizeof(t.hdr));
+    t.records.resize(t.hdr.num_records);
+    if ( t.hdr.num_records )
+      in.read((char*)&t.records[0], t.hdr.num_records * sizeof(Record));
+
+    if ( !in ) {
+      std::cerr << fname << " is truncated\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+static const char* event_name(uint16_t ev)
+{
+  return ev < Num_Events ? EventName[ev] : "unknown";
+}
+
+static std::string json_string(const char* s)
+{
+  std::string rval;
+
+  for ( ; *s; ++s ) {
+    if ( *s == '"' || *s == '\\' )
+      rval += '\\';
+    if ( (unsigned char)*s >= 0x20 )
+      rval += *s;
+  }
+  return rval;
+}
+
+static void write_json(std::ostream& os, const FileHeader& fh, const std::vector<ThreadTrace>& threads)
+{
+  uint64_t t0 = UINT64_MAX;
+
+  for ( auto& t : threads )
+    if ( ! t.records.empty() && t.records[0].ts_ns < t0 )
+      t0 = t.records[0].ts_ns;
+
+  os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+
+  bool first = true;
+  char buf[256];
+
+  for ( auto& t : threads ) {
+    char name[sizeof(t.hdr.name) + 1] = { 0 };
+    memcpy(name, t.hdr.name, sizeof(t.hdr.name));
+
+    os << (first ? "" : ",\n")
+       << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << fh.pid
+       << ",\"tid\":" << t.hdr.tid
+       << ",\"args\":{\"name\":\"" << json_string(name) << "\"}}";
+    first = false;
+
+    //
+    // A wrapped ring may begin part way through a BEGIN/END pair.  Drop any
+    // END that has no matching BEGIN so that the viewer does not mis-nest.
+    //
+    int depth = 0;
+    for ( auto& r : t.records ) {
+      const char* ph;
+
+      switch ( r.phase ) {
+        default:
+        case INSTANT: ph = "i"; break;
+        case BEGIN:   ph = "B"; ++depth; break;
+        case END:
+          if ( depth == 0 )
+            continue;
+          ph = "E";
+          --depth;
+          break;
+      }
+
+      snprintf(buf, sizeof(buf),
+          ",\n{\"name\":\"%s\",\"cat\":\"umap\",\"ph\":\"%s\",\"ts\":%.3f,"
+          "\"pid\":%u,\"tid\":%u%s,\"args\":{\"addr\":\"0x%llx\"}}",
+          event_name(r.event), ph, (double)(r.ts_ns - t0) / 1000.0,
+          fh.pid, t.hdr.tid, r.phase == INSTANT ? ",\"s\":\"t\"" : "",
+          (unsigned long long)r.addr);
+      os << buf;
+    }
+  }
+  os << "\n]}\n";
+}
+
+static void write_summary(std::ostream& os, const std::vector<ThreadTrace>& threads)
+{
+  std::vector<EventSummary> summary(Num_Events);
+  uint64_t dropped = 0;
+
+  for ( auto& t : threads ) {
+    std::vector<uint64_t> begin_ts(Num_Events, 0);
+    std::vector<int> open(Num_Events, 0);
+
+    dropped += t.hdr.dropped;
+
+    for ( auto& r : t.records ) {
+      if ( r.event >= Num_Events )
+        continue;
+
+      switch ( r.phase ) {
+        case INSTANT:
+          summary[r.event].count++;
+          break;
+        case BEGIN:
+          begin_ts[r.event] = r.ts_ns;
+          open[r.event] = 1;
+          break;
+        case END:
+          if ( open[r.event] ) {
+            uint64_t d = r.ts_ns - begin_ts[r.event];
+            summary[r.event].count++;
+            summary[r.event].total_ns += d;
+            if ( d > summary[r.event].max_ns )
+              summary[r.event].max_ns = d;
+            open[r.event] = 0;
+          }
+          break;
+      }
+    }
+  }
+
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%-14s %12s %14s %12s %12s\n",
+      "event", "count", "total(us)", "avg(us)", "max(us)");
+  os << buf;
+
+  for ( int i = 0; i < Num_Events; ++i ) {
+    const EventSummary& s = summary[i];
+    if ( s.count == 0 )
+      continue;
+
+    snprintf(buf, sizeof(buf), "%-14s %12llu %14.1f %12.2f %12.2f\n",
+        EventName[i], (unsigned long long)s.count, s.total_ns / 1000.0,
+        s.total_ns / 1000.0 / s.count, s.max_ns / 1000.0);
+    os << buf;
+  }
+
+  if ( dropped )
+    os << dropped << " records were overwritten (see UMAP_TRACE_EVENTS)\n";
+}
+
+int main(int argc, char** argv)
+{
+  const char* outname = nullptr;
+  bool summary = false;
+  int c;
+
+  while ( (c = getopt(argc, argv, "o:sh")) != -1 ) {
+    switch (c) {
+      case 'o': outname = optarg; break;
+      case 's': summary = true; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if ( optind != argc - 1 )
+    usage(argv[0]);
+
+  FileHeader fh;
+  std::vector<ThreadTrace> threads;
+
+  if ( ! read_trace(argv[optind], fh, threads) )
+    return 1;
+
+  std::ofstream of;
+  if ( outname != nullptr ) {
+    of.open(outname);
+    if ( !of ) {
+      std::cerr << "Unable to create " << outname << "\n";
+      return 1;
+    }
+  }
+  std::ostream& os = (outname != nullptr) ? of : std::cout;
+
+  if ( summary )
+    write_summary(os, threads);
+  else
+    write_json(os, fh, threads);
+
+  return 0;
+}
@@ -5,25 +5,55 @@
 // SPDX-License-Identifier: LGPL-2.1-only
 //////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>      // std::min
+#include <chrono>
 #include <pthread.h>
+#include <sys/mman.h>     // PROT_WRITE
+#include <unordered_set>
+#include <vector>
 
 #include "umap/Buffer.hpp"
 #include "umap/config.h"
 #include "umap/FillWorkers.hpp"
 #include "umap/PageDescriptor.hpp"
 #include "umap/RegionManager.hpp"
+#include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
 
 namespace Umap {
+//
+// Largest run of faulted pages handed to a fill worker at once
+//
+static const uint64_t max_fill_run_bytes = 1024 * 1024;
+
 //
 // Called after data has been placed into the page
 //
 void Buffer::mark_page_as_present(PageDescriptor* pd)
 {
+  mark_pages_as_present(&pd, 1);
+}
+
+//
+// With UMAP_DIRTY_SCAN, pages of writable regions are written to without
+// a fault, so any of them may be dirty until the evictors scan them.
+//
+void Buffer::mark_pages_as_present(PageDescriptor** pds, uint64_t npages, bool demand_fill)
+{
+  bool dirty_scan = m_rm.get_uffd_h()->dirty_scan();
+
   lock();
 
-  pd->set_state_present();
+  for ( uint64_t i = 0; i < npages; ++i ) {
+    if ( dirty_scan && (pds[i]->region->prot() & PROT_WRITE) )
+      pds[i]->dirty = true;
+    pds[i]->set_state_present();
+  }
+
+  if ( demand_fill )
+    --m_demand_fills;
 
   if ( m_waits_for_state_change )
     pthread_cond_broadcast( &m_state_change_cond );
@@ -31,114 +61,337 @@ void Buffer::mark_page_as_present(PageDescriptor* pd)
   unlock();
 }
 
+void Buffer::wait_for_demand_fills( void )
+{
+  lock();
+
+  while ( m_demand_fills ) {
+    ++m_waits_for_state_change;
+    pthread_cond_wait(&m_state_change_cond, &m_mutex);
+    --m_waits_for_state_change;
+  }
+
+  unlock();
+}
+
 //
 // Called after page has been flushed to store and page is no longer present
 //
 void Buffer::mark_page_as_free( PageDescriptor* pd )
+{
+  mark_pages_as_free(&pd, 1);
+}
+
+//
+// We only put a page descriptor back onto the free list if it isn't
+// deferred.  Note: It will be marked as deferred when the page is part of a
+// Region that has been unmapped.  It will become undeferred later when the
+// eviction manager takes it off the end of the end of the buffer.
+//
+void Buffer::mark_pages_as_free( PageDescriptor** pds, uint64_t npages )
 {
   lock();
 
-  UMAP_LOG(Debug, "Removing page: " << pd);
-  pd->region->erase_page_descriptor(pd);
+  for ( uint64_t i = 0; i < npages; ++i ) {
+    auto pd = pds[i];
 
-  m_present_pages.erase(pd->page);
+    UMAP_LOG(Debug, "Removing page: " << pd);
+    ++pd->region->stats().evictions;
+    pd->region->erase_page_descriptor(pd);
 
-  pd->set_state_free();
-  pd->spurious_count = 0;
+    m_present_pages.erase(pd->page);
 
-  //
-  // We only put the page descriptor back onto the free list if it isn't
-  // deferred.  Note: It will be marked as deferred when the page is part of a
-  // Region that has been unmapped.  It will become undeferred later when the
-  // eviction manager takes it off the end of the end of the buffer.
-  //
-  if ( ! pd->deferred )
-    release_page_descriptor(pd);
+    pd->set_state_free();
+    pd->spurious_count = 0;
+    m_used_bytes -= pd->size;
+
+    if ( ! pd->deferred )
+      release_page_descriptor(pd);
+
+    pd->page = nullptr;
+  }
+
+  if ( m_waits_for_avail_pd )
+    pthread_cond_broadcast(&m_avail_pd_cond);
 
   if ( m_waits_for_state_change )
     pthread_cond_broadcast( &m_state_change_cond );
 
-  pd->page = nullptr;
-
   unlock();
 }
 
 void Buffer::release_page_descriptor( PageDescriptor* pd )
 {
-    m_free_pages.push_back(pd);
+  m_free_pages.push_back(pd);
+}
+
+void Buffer::add_page_descriptors( uint64_t num_pages )
+{
+  PageDescriptor* array = (PageDescriptor *)calloc(num_pages, sizeof(PageDescriptor));
+
+  if ( array == nullptr )
+    UMAP_ERROR("Failed to allocate " << num_pages*sizeof(PageDescriptor)
+        << " bytes for buffer page descriptors");
+
+  m_arrays.push_back(array);
+  m_num_descriptors += num_pages;
+
+  for ( uint64_t i = 0; i < num_pages; ++i )
+    release_page_descriptor(&array[i]);
+}
+
+void Buffer::update_water_marks( void )
+{
+  m_evict_low_water = apply_int_percentage(m_rm.get_evict_low_water_threshold(), m_max_bytes);
+  m_evict_high_water = apply_int_percentage(m_rm.get_evict_high_water_threshold(), m_max_bytes);
+
+  //
+  // apply_int_percentage() takes 0 to mean all of it, but no reserve
+  // beyond the room above the high water mark is meant here
+  //
+  uint64_t reserve = m_rm.get_evict_reserve() ? apply_int_percentage(m_rm.get_evict_reserve(), m_max_bytes) : 0;
+
+  m_min_reserve = std::max(reserve, m_max_bytes - m_evict_high_water);
+  m_max_reserve = std::max(m_min_reserve, m_max_bytes / 2);
+  m_reserve = std::min(std::max(m_reserve, m_min_reserve), m_max_reserve);
+}
+
+//
+// The water marks in effect, lowered as far as it takes to keep the reserve
+// free.  The distance between them stays the same.
+//
+uint64_t Buffer::high_water( void )
+{
+  return std::min(m_evict_high_water, m_max_bytes - m_reserve);
+}
+
+uint64_t Buffer::low_water( void )
+{
+  uint64_t band = m_evict_high_water > m_evict_low_water ? m_evict_high_water - m_evict_low_water : 0;
+  uint64_t high = high_water();
 
-    if ( m_waits_for_avail_pd )
-      pthread_cond_broadcast(&m_avail_pd_cond);
+  return high > band ? high - band : 0;
 }
 
 //
-// Called from Evict Manager to begin eviction process on oldest present
-// page
+// Wake the Evict Manager unless it is already on its way
 //
-PageDescriptor* Buffer::evict_oldest_page()
+void Buffer::kick_evict_manager( void )
 {
-  PageDescriptor* pd = nullptr;
+  if ( m_evict_pending )
+    return;
 
+  WorkItem w;
+
+  m_evict_pending = true;
+  w.type = Umap::WorkItem::WorkType::THRESHOLD;
+  w.page_desc = nullptr;
+  m_rm.get_evict_manager()->send_work(w);
+}
+
+void Buffer::eviction_done( void )
+{
   lock();
 
-  while ( m_busy_pages.size() != 0 ) {
-    pd = m_busy_pages.back();
+  m_evict_pending = false;
 
-    // Deferred means that this page was previously evicted as part of an
-    // uunmap of a Region.  This means that this page descriptor points to a
-    // page that has already been given back to the system so all we need to
-    // do is take it off of the busy list and release the descriptor.
-    //
-    if ( pd->deferred ) {
-      UMAP_LOG(Debug, "Deferred Page: " << pd);
+  //
+  // Nobody waited for room since the last time, so a smaller reserve may
+  // do.  Give back a little at a time.
+  //
+  if ( ! m_stalled && m_reserve > m_min_reserve )
+    m_reserve = std::max(m_min_reserve, m_reserve - std::max(m_max_bytes / 256, (uint64_t)1));
+  m_stalled = false;
+
+  //
+  // Pages may have come in, or a larger page may have been waited for,
+  // after the Evict Manager last looked
+  //
+  if ( m_busy_pages.bytes() >= high_water() || (m_bytes_wanted != 0 && ! low_threshold_reached()) )
+    kick_evict_manager();
+
+  unlock();
+}
+
+//
+// Change the maximum number of pages the buffer may hold while regions are
+// active.  Growing makes room for new pages immediately.  Shrinking has the
+// eviction manager evict pages until the pages in the buffer fit, and the
+// caller waits until they do.
+//
+void Buffer::resize( uint64_t max_pages )
+{
+  if ( max_pages == 0 )
+    UMAP_ERROR("Buffer size must be at least one page");
+
+  lock();
+
+  uint64_t old_size = m_size;
+  m_size = max_pages;
+  m_max_bytes = max_pages * m_rm.get_umap_page_size();
+  update_water_marks();
+
+  if ( m_waits_for_avail_pd )
+    pthread_cond_broadcast(&m_avail_pd_cond);
+
+  if ( m_used_bytes > m_max_bytes ) {
+    kick_evict_manager();
+
+    while ( m_used_bytes > m_max_bytes && m_size == max_pages ) {
+      ++m_stats.waits;
+      ++m_waits_for_state_change;
+      pthread_cond_wait(&m_state_change_cond, &m_mutex);
+      --m_waits_for_state_change;
+    }
+  }
+
+  UMAP_LOG(Debug, "Buffer resized from " << old_size << " to " << m_size
+      << " pages: " << this);
+
+  unlock();
+}
+
+//
+// Called from the Evict Manager to take a batch of the oldest present pages
+//
+uint64_t Buffer::evict_oldest_pages( PageDescriptor** pds, uint64_t max, bool all )
+{
+  uint64_t n = 0;
+
+  lock();
+
+  while ( 1 ) {
+    bool in_transit = false;
+    PageDescriptor* prev;
+
+    for ( auto pd = m_busy_pages.back(); pd != nullptr && n < max; pd = prev ) {
+      prev = pd->busy_prev;
+
+      if ( ! all && low_threshold_reached() )
+        break;
 
       //
-      // Make sure that the page has truly been flushed.
+      // Deferred means that this page was evicted as part of an uunmap of
+      // its Region and only its descriptor is left to release, once the
+      // eviction is done.
       //
-      wait_for_page_state(pd, PageDescriptor::State::FREE);
-
-      m_busy_pages.pop_back();
-      m_stats.pages_deleted++;
+      if ( pd->deferred ) {
+        if ( pd->state == PageDescriptor::State::FREE ) {
+          UMAP_LOG(Debug, "Deferred Page: " << pd);
+          m_busy_pages.erase(pd);
+          m_stats.pages_deleted++;
+          release_page_descriptor(pd);
+        }
+        continue;
+      }
 
       //
-      // Jump to the next page descriptor
+      // Being filled or updated; it stays for a later pass.
       //
-      release_page_descriptor(pd);
-      pd = nullptr;
-    }
-    else {
+      if ( pd->state != PageDescriptor::State::PRESENT ) {
+        in_transit = true;
+        continue;
+      }
+
       UMAP_LOG(Debug, "Normal Page: " << pd);
-      wait_for_page_state(pd, PageDescriptor::State::PRESENT);
-      m_busy_pages.pop_back();
+      m_busy_pages.erase(pd);
       m_stats.pages_deleted++;
       pd->set_state_leaving();
-      break;
+      pds[n++] = pd;
     }
+
+    if ( n != 0 )
+      break;
+
+    //
+    // Nothing could be taken.  Wait only when every candidate is in
+    // transit, or, to evict everything, for pages that are leaving.
+    //
+    if ( all ? m_present_pages.empty() : (low_threshold_reached() || ! in_transit) )
+      break;
+
+    ++m_stats.waits;
+    ++m_waits_for_state_change;
+    pthread_cond_wait(&m_state_change_cond, &m_mutex);
+    --m_waits_for_state_change;
   }
 
   unlock();
-  return pd;
+  return n;
 }
 
-  void Buffer::flush_dirty_pages()
-  {
-    lock();
+//
+// Write back the dirty pages in the buffer.  The pages are marked as being
+// updated while they are written, which keeps the evictors and
+// drop_pages() off them, and the lock is not held while waiting for the
+// writes, which need it to finish.  Each page is written at most once, so
+// that pages written to again meanwhile do not keep this going.
+//
+void Buffer::flush_dirty_pages()
+{
+  std::unordered_set<PageDescriptor*> flushed;
+  std::vector<PageDescriptor*> pages;
+
+  lock();
+
+  while ( 1 ) {
+    bool in_transit = false;
+
+    pages.clear();
 
-    for (auto it = m_busy_pages.begin(); it != m_busy_pages.end(); it++) {
-      
-      if ( (*it)->dirty ) {
-	PageDescriptor* pd = *it;
-	UMAP_LOG(Debug, "schedule Dirty Page: " << pd);
-	wait_for_page_state(pd, PageDescriptor::State::PRESENT);
-	m_rm.get_evict_manager()->schedule_flush(pd);
+    for (auto pd = m_busy_pages.front(); pd != nullptr; pd = pd->busy_next) {
+      if ( ! pd->dirty || pd->deferred || flushed.count(pd) )
+        continue;
+
+      if ( pd->state != PageDescriptor::State::PRESENT ) {
+        in_transit = true;
+        continue;
       }
+
+      UMAP_LOG(Debug, "schedule Dirty Page: " << pd);
+      pd->set_state_updating();
+      flushed.insert(pd);
+      pages.push_back(pd);
+    }
+
+    //
+    // Dirty pages the Evict Manager has taken are off the busy list, and
+    // are written back on their way out.  Those writes are waited for too.
+    //
+    if ( pages.empty() && ! in_transit ) {
+      for ( auto& pp : m_present_pages ) {
+        auto pd = pp.second;
+
+        if ( pd->dirty && ! pd->deferred && pd->state == PageDescriptor::State::LEAVING ) {
+          in_transit = true;
+          break;
+        }
+      }
+    }
+
+    if ( pages.empty() ) {
+      if ( ! in_transit )
+        break;
+
+      ++m_stats.waits;
+      ++m_waits_for_state_change;
+      pthread_cond_wait(&m_state_change_cond, &m_mutex);
+      --m_waits_for_state_change;
+      continue;
     }
 
-    m_rm.get_evict_manager()->WaitAll();
-    
     unlock();
+
+    m_rm.get_evict_manager()->schedule_evictions(&pages[0], pages.size(), WorkItem::WorkType::FLUSH);
+
+    m_rm.get_evict_manager()->WaitAll();
+
+    lock();
   }
-  
+
+  unlock();
+}
+
 //
 // Called from uunmap by the unmapping thread of the application
 //
@@ -148,14 +401,33 @@ PageDescriptor* Buffer::evict_oldest_page()
 void Buffer::evict_region(RegionDescriptor* rd)
 {
   if (m_rm.get_num_active_regions() > 1) {
+    std::vector<PageDescriptor*> victims;
+
     lock();
     while ( rd->count() ) {
-      auto pd = rd->get_next_page_descriptor();
-      pd->deferred = true;
-      wait_for_page_state(pd, PageDescriptor::State::PRESENT);
-      pd->set_state_leaving();
-      m_rm.get_evict_manager()->schedule_eviction(pd);
-      wait_for_page_state(pd, PageDescriptor::State::FREE);
+      //
+      // Pages being filled or updated, or already on their way out, are
+      // waited for; the region's page set shrinks as they leave.
+      //
+      victims.clear();
+
+      for ( auto pd : rd->page_descriptors() ) {
+        if ( pd->state == PageDescriptor::State::PRESENT ) {
+          pd->deferred = true;
+          pd->set_state_leaving();
+          victims.push_back(pd);
+        }
+      }
+
+      if ( victims.size() ) {
+        m_rm.get_evict_manager()->schedule_evictions(&victims[0], victims.size(), WorkItem::WorkType::EVICT);
+        continue;
+      }
+
+      ++m_stats.waits;
+      ++m_waits_for_state_change;
+      pthread_cond_wait(&m_state_change_cond, &m_mutex);
+      --m_waits_for_state_change;
     }
     unlock();
   }
@@ -166,42 +438,113 @@ void Buffer::evict_region(RegionDescriptor* rd)
 
 bool Buffer::low_threshold_reached( void )
 {
-  return m_busy_pages.size() <= m_evict_low_water;
+  return m_busy_pages.bytes() + m_bytes_wanted <= low_water();
+}
+
+//
+// Pages larger than the buffer are let in when the buffer is empty
+//
+bool Buffer::have_room( uint64_t page_size )
+{
+  return m_used_bytes == 0 || m_used_bytes + page_size <= m_max_bytes;
 }
 
-void Buffer::process_page_event(char* paddr, bool iswrite, RegionDescriptor* rd)
+void Buffer::process_page_event(char* paddr, bool iswrite, RegionDescriptor* rd, int node)
 {
-  WorkItem work;
-  work.type = Umap::WorkItem::WorkType::NONE;
+  FaultEvent event = { paddr, iswrite };
+
+  process_page_events(&event, 1, rd, node);
+}
+
+void Buffer::process_page_events(const FaultEvent* events, uint64_t nevents, RegionDescriptor* rd, int node)
+{
+  auto fill_workers = m_rm.get_fill_workers_h(node);
+  uint64_t page_size = rd->page_size();
+  uint64_t max_run = std::max((uint64_t)1, max_fill_run_bytes / page_size);
+  uint64_t max_gap = m_rm.get_fill_merge_gap() * page_size;
+  PageDescriptor* run = nullptr;
+  PageDescriptor* run_tail = nullptr;
+  bool added = false;
+
+  auto send_run = [&]() {
+    if ( run != nullptr ) {
+      WorkItem work = { .page_desc = run, .type = Umap::WorkItem::WorkType::NONE };
+
+      run->fill_queued = std::chrono::steady_clock::now();
+      ++m_demand_fills;
+      m_rm.get_uffd_h()->fill_queued();
+      fill_workers->send_work(work);
+      run = run_tail = nullptr;
+    }
+  };
 
   lock();
-  auto pd = page_already_present(paddr);
 
-  if ( pd != nullptr ) {  // Page is already present
-    if (iswrite && pd->dirty == false) {
-      work.page_desc = pd;
-      pd->dirty = true;
-      pd->set_state_updating();
-      UMAP_LOG(Debug, "PRE: " << pd << " From: " << this);
+  for ( uint64_t e = 0; e < nevents; ++e ) {
+    char* paddr = events[e].paddr;
+    bool iswrite = events[e].iswrite;
+    PageDescriptor* pd;
+    uint64_t stalled_ns = 0;
+
+    //
+    // Waiting for a free page descriptor drops the lock, and a prefetch may
+    // bring the page in meanwhile, so look for it again once there is one.
+    // The pages of the run so far are sent first: they may be all there is
+    // in the buffer, and nothing can be evicted before it is filled.
+    //
+    while (1) {
+      pd = page_already_present(paddr);
+
+      if ( pd != nullptr || have_room(page_size) )
+        break;
+
+      send_run();
+      stalled_ns += wait_for_free_page_descriptor(paddr, page_size);
     }
-    else {
-      static int hiwat = 0;
 
-      pd->spurious_count++;
-      if (pd->spurious_count > hiwat) {
-        hiwat = pd->spurious_count;
-        UMAP_LOG(Debug, "New Spurious cound high water mark: " << hiwat);
+    //
+    // The faults of a region being unmapped are left alone, as its pages
+    // may have been evicted already, even while we waited above.  The
+    // faulting threads are woken when the region is unregistered.
+    //
+    if ( rd->unmapping() )
+      break;
+
+    if ( stalled_ns )
+      rd->stats().record_stall(stalled_ns);
+
+    if ( pd != nullptr ) {  // Page is already present
+      if (iswrite && pd->dirty == false) {
+        WorkItem work = { .page_desc = pd, .type = Umap::WorkItem::WorkType::NONE };
+
+        pd->dirty = true;
+        pd->batch_next = nullptr;
+        pd->fill_queued = std::chrono::steady_clock::now();
+        pd->set_state_updating();
+        UMAP_LOG(Debug, "PRE: " << pd << " From: " << this);
+        ++m_demand_fills;
+        m_rm.get_uffd_h()->fill_queued();
+        fill_workers->send_work(work);
       }
+      else {
+        static int hiwat = 0;
+
+        pd->spurious_count++;
+        if (pd->spurious_count > hiwat) {
+          hiwat = pd->spurious_count;
+          UMAP_LOG(Debug, "New Spurious cound high water mark: " << hiwat);
+        }
 
-      UMAP_LOG(Debug, "SPU: " << pd << " From: " << this);
-      unlock();
-      return;
+        UMAP_LOG(Debug, "SPU: " << pd << " From: " << this);
+      }
+      continue;
     }
-  }
-  else {                  // This page has not been brought in yet
+
+    // This page has not been brought in yet
+    added = true;
     pd = get_page_descriptor(paddr, rd);
     pd->data_present = false;
-    work.page_desc = pd;
+    pd->batch_next = nullptr;
 
     rd->insert_page_descriptor(pd);
     m_present_pages[pd->page] = pd;
@@ -210,21 +553,144 @@ void Buffer::process_page_event(char* paddr, bool iswrite, RegionDescriptor* rd)
       pd->dirty = true;
 
     UMAP_LOG(Debug, "NEW: " << pd << " From: " << this);
+
+    //
+    // A run is read with one call, so it may not span more than max_run
+    // pages, gaps included.  Its pages must all be write protected or all
+    // not.
+    //
+    if (   run != nullptr && run_tail->dirty == pd->dirty && pd->page > run_tail->page
+        && (uint64_t)(pd->page - run_tail->page) <= page_size + max_gap
+        && (uint64_t)(pd->page + page_size - run->page) <= max_run * page_size ) {
+      run_tail->batch_next = pd;
+      run_tail = pd;
+    }
+    else {
+      send_run();
+      run = run_tail = pd;
+    }
   }
 
-  m_rm.get_fill_workers_h()->send_work(work);
+  send_run();
 
   //
   // Kick the eviction daemon if the high water mark has been reached
   //
-  if ( m_busy_pages.size() == m_evict_high_water ) {
-    WorkItem w;
+  if ( added && m_busy_pages.bytes() >= high_water() )
+    kick_evict_manager();
+
+  unlock();
+}
+
+uint64_t Buffer::claim_pages(RegionDescriptor* rd, char* start, uint64_t npages, PageDescriptor** pds)
+{
+  uint64_t page_size = rd->page_size();
+  uint64_t claimed = 0;
+  uint64_t i;
+
+  lock();
+
+  for ( i = 0; i < npages; ++i ) {
+    char* paddr = start + i * page_size;
+
+    //
+    // The pages we hold cannot be evicted until we have filled them, so
+    // only wait for a free descriptor while holding none.  Waiting drops
+    // the lock, and the page may be faulted in meanwhile.
+    //
+    while (   ! have_room(page_size) && claimed == 0
+           && m_present_pages.find(paddr) == m_present_pages.end() )
+      wait_for_free_page_descriptor(paddr, page_size);
+
+    if ( m_present_pages.find(paddr) != m_present_pages.end() ) {
+      pds[i] = nullptr;
+      continue;
+    }
+
+    if ( ! have_room(page_size) )
+      break;
+
+    auto pd = get_page_descriptor(paddr, rd);
+    pd->data_present = false;
+    rd->insert_page_descriptor(pd);
+    m_present_pages[pd->page] = pd;
+    pds[i] = pd;
+    ++claimed;
+
+    if ( m_busy_pages.bytes() >= high_water() )
+      kick_evict_manager();
+  }
+
+  unlock();
+  return i;
+}
+
+void Buffer::drop_pages(RegionDescriptor* rd, char* start, uint64_t npages, bool wait)
+{
+  uint64_t page_size = rd->page_size();
+  char* end = start + npages * page_size;
+  std::vector<char*> pages;
+
+  lock();
+
+  //
+  // A range of a large sparse region may have far more pages than the
+  // buffer holds, so look at the pages in the buffer instead.
+  //
+  if ( npages > m_present_pages.size() ) {
+    for ( auto& pp : m_present_pages )
+      if ( pp.first >= start && pp.first < end && pp.second->region == rd )
+        pages.push_back(pp.first);
+  }
+  else {
+    for ( uint64_t i = 0; i < npages; ++i )
+      pages.push_back(start + i * page_size);
+  }
+
+  std::vector<PageDescriptor*> victims;
+
+  for ( auto paddr : pages ) {
+    while (1) {
+      auto pp = m_present_pages.find(paddr);
+
+      if ( pp == m_present_pages.end() )
+        break;
 
-    w.type = Umap::WorkItem::WorkType::THRESHOLD;
-    w.page_desc = nullptr;
-    m_rm.get_evict_manager()->send_work(w);
+      auto pd = pp->second;
+
+      if ( pd->region != rd || pd->deferred || pd->state == PageDescriptor::State::LEAVING )
+        break;
+
+      if ( pd->state == PageDescriptor::State::PRESENT ) {
+        m_busy_pages.erase(pd);
+        m_stats.pages_deleted++;
+        pd->set_state_leaving();
+        victims.push_back(pd);
+        break;
+      }
+
+      if ( ! wait )
+        break;
+
+      //
+      // Hand over what has been taken so far before waiting, as the page
+      // waited for may be a write fault that waits for room.
+      //
+      if ( victims.size() ) {
+        m_rm.get_evict_manager()->schedule_evictions(&victims[0], victims.size(), WorkItem::WorkType::EVICT);
+        victims.clear();
+      }
+
+      ++m_stats.waits;
+      ++m_waits_for_state_change;
+      pthread_cond_wait(&m_state_change_cond, &m_mutex);
+      --m_waits_for_state_change;
+    }
   }
 
+  if ( victims.size() )
+    m_rm.get_evict_manager()->schedule_evictions(&victims[0], victims.size(), WorkItem::WorkType::EVICT);
+
   unlock();
 }
 
@@ -259,19 +725,66 @@ PageDescriptor* Buffer::page_already_present( char* page_addr )
   }
 }
 
-PageDescriptor* Buffer::get_page_descriptor(char* vaddr, RegionDescriptor* rd)
+//
+// Returns how long we waited, in nanoseconds
+//
+uint64_t Buffer::wait_for_free_page_descriptor(char* vaddr, uint64_t page_size)
 {
-  while ( m_free_pages.size() == 0 )  {
+  if ( have_room(page_size) )
+    return 0;
+
+  UMAP_TRACE_BEGIN(BUFFER_STALL, vaddr);
+  auto start = std::chrono::steady_clock::now();
+
+  //
+  // The reserve was not enough to keep up with the pages coming in
+  //
+  if ( ! m_stalled ) {
+    m_stalled = true;
+    m_reserve = std::min(m_max_reserve, m_reserve + std::max(page_size, m_max_bytes / 64));
+  }
+
+  //
+  // With pages of different sizes the buffer may be full without having
+  // reached its high water mark, and a large page may need more room than
+  // evicting down to the low water mark makes.  Have the eviction manager
+  // make room for the largest page anyone is waiting for.
+  //
+  if ( page_size > m_bytes_wanted ) {
+    m_bytes_wanted = page_size;
+    kick_evict_manager();
+  }
+
+  while ( ! have_room(page_size) )  {
     ++m_waits_for_avail_pd;
     m_stats.not_avail++;
 
     ++m_stats.waits;
-    ++m_waits_for_state_change;
     pthread_cond_wait(&m_avail_pd_cond, &m_mutex);
 
     --m_waits_for_avail_pd;
   }
 
+  if ( m_waits_for_avail_pd == 0 )
+    m_bytes_wanted = 0;
+
+  UMAP_TRACE_END(BUFFER_STALL, vaddr);
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+PageDescriptor* Buffer::get_page_descriptor(char* vaddr, RegionDescriptor* rd)
+{
+  wait_for_free_page_descriptor(vaddr, rd->page_size());
+
+  //
+  // With regions of smaller pages than the default, more descriptors may
+  // be needed than the buffer started with
+  //
+  if ( m_free_pages.size() == 0 )
+    add_page_descriptors(m_num_descriptors);
+
   PageDescriptor* rval;
 
   rval = m_free_pages.back();
@@ -283,7 +796,9 @@ PageDescriptor* Buffer::get_page_descriptor(char* vaddr, RegionDescriptor* rd)
   rval->deferred = false;
   rval->set_state_filling();
   rval->spurious_count = 0;
+  rval->size = rd->page_size();
 
+  m_used_bytes += rval->size;
   m_stats.pages_inserted++;
   m_busy_pages.push_front(rval);
 
@@ -326,42 +841,27 @@ void Buffer::unlock()
   pthread_mutex_unlock(&m_mutex);
 }
 
-void Buffer::wait_for_page_state( PageDescriptor* pd, PageDescriptor::State st)
-{
-  UMAP_LOG(Debug, "Waiting for state: " << st << ", " << pd);
-
-  while ( pd->state != st ) {
-    ++m_stats.waits;
-    ++m_waits_for_state_change;
-
-    ++m_stats.waits;
-    ++m_waits_for_state_change;
-    pthread_cond_wait(&m_state_change_cond, &m_mutex);
-
-    --m_waits_for_state_change;
-  }
-}
-
 Buffer::Buffer( void )
   :     m_rm(RegionManager::getInstance())
       , m_size(m_rm.get_max_pages_in_buffer())
+      , m_max_bytes(m_size * m_rm.get_umap_page_size())
+      , m_used_bytes(0)
+      , m_bytes_wanted(0)
+      , m_num_descriptors(0)
+      , m_reserve(0)
+      , m_stalled(false)
+      , m_evict_pending(false)
+      , m_demand_fills(0)
       , m_waits_for_avail_pd(0)
       , m_waits_for_state_change(0)
 {
-  m_array = (PageDescriptor *)calloc(m_size, sizeof(PageDescriptor));
-  if ( m_array == nullptr )
-    UMAP_ERROR("Failed to allocate " << m_size*sizeof(PageDescriptor)
-        << " bytes for buffer page descriptors");
-
-  for ( int i = 0; i < m_size; ++i )
-    m_free_pages.push_back(&m_array[i]);
+  add_page_descriptors(m_size);
 
   pthread_mutex_init(&m_mutex, NULL);
   pthread_cond_init(&m_avail_pd_cond, NULL);
   pthread_cond_init(&m_state_change_cond, NULL);
 
-  m_evict_low_water = apply_int_percentage(m_rm.get_evict_low_water_threshold(), m_size);
-  m_evict_high_water = apply_int_percentage(m_rm.get_evict_high_water_threshold(), m_size);
+  update_water_marks();
 }
 
 Buffer::~Buffer( void ) {
@@ -373,7 +873,9 @@ Buffer::~Buffer( void ) {
   pthread_cond_destroy(&m_avail_pd_cond);
   pthread_cond_destroy(&m_state_change_cond);
   pthread_mutex_destroy(&m_mutex);
-  free(m_array);
+
+  for ( auto array : m_arrays )
+    free(array);
 }
 
 std::ostream& operator<<(std::ostream& os, const Umap::Buffer* b)
@@ -384,6 +886,8 @@ std::ostream& operator<<(std::ostream& os, const Umap::Buffer* b)
       << ", m_present_pages.size(): " << std::setw(2) << b->m_present_pages.size()
       << ", m_free_pages.size(): " << std::setw(2) << b->m_free_pages.size()
       << ", m_busy_pages.size(): " << std::setw(2) << b->m_busy_pages.size()
+      << ", m_used_bytes: " << b->m_used_bytes
+      << ", m_max_bytes: " << b->m_max_bytes
       << " }"
       ;
   }
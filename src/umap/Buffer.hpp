@@ -10,7 +10,6 @@
 #include <pthread.h>
 #include <unordered_map>
 #include <vector>
-#include <deque>
 
 #include "umap/RegionDescriptor.hpp"
 #include "umap/PageDescriptor.hpp"
@@ -37,29 +36,101 @@ namespace Umap {
     public:
       void mark_page_as_present(PageDescriptor* pd);
       void mark_page_as_free( PageDescriptor* pd );
+      void mark_pages_as_free( PageDescriptor** pds, uint64_t npages );
 
       bool low_threshold_reached( void );
 
-      PageDescriptor* evict_oldest_page( void );
-      void process_page_event(char* paddr, bool iswrite, RegionDescriptor* rd);
+      //
+      // Called by the Evict Manager once it is done evicting
+      //
+      void eviction_done( void );
+
+      //
+      // Take up to max of the oldest present pages off the busy list under
+      // a single lock and mark them as leaving.  Pages still being filled
+      // or updated are passed over rather than waited for.  Unless all is
+      // set, stops once the buffer is down to its low water mark.  Returns
+      // the number of pages taken, and 0 once there is nothing (all: no
+      // page at all) left to evict.
+      //
+      uint64_t evict_oldest_pages( PageDescriptor** pds, uint64_t max, bool all );
+      void process_page_event(char* paddr, bool iswrite, RegionDescriptor* rd, int node = -1);
+
+      //
+      // Faults on pages of rd, sorted by address, handled under a single
+      // lock.  Pages brought in for adjacent faults, or for faults no more
+      // than UMAP_FILL_MERGE_GAP pages apart, are handed to one fill worker
+      // together, linked through batch_next, so that it can read them with
+      // one call.
+      //
+      struct FaultEvent {
+        char* paddr;
+        bool  iswrite;
+      };
+
+      void process_page_events(const FaultEvent* events, uint64_t nevents, RegionDescriptor* rd, int node = -1);
+
+      //
+      // Take descriptors for up to npages consecutive pages from start
+      // under a single lock, for the caller to fill itself.  Pages that
+      // are already in the buffer get a nullptr.  Stops early rather than
+      // wait for a free descriptor while holding others; returns the number
+      // of pages handled.
+      //
+      uint64_t claim_pages(RegionDescriptor* rd, char* start, uint64_t npages, PageDescriptor** pds);
+
+      //
+      // demand_fill is set by the fill workers once they are done with the
+      // work item of a fault, whether it filled pages or not
+      //
+      void mark_pages_as_present(PageDescriptor** pds, uint64_t npages, bool demand_fill = false);
+
+      //
+      // Speculative fills wait here until no fault is waiting to be filled
+      //
+      void wait_for_demand_fills( void );
+
+      //
+      // Evict whichever of the npages pages from start are in the buffer.
+      // With wait, pages being filled or updated are evicted once that is
+      // done; otherwise they are left alone.
+      //
+      void drop_pages(RegionDescriptor* rd, char* start, uint64_t npages, bool wait);
       void evict_region(RegionDescriptor* rd);
       void flush_dirty_pages();
+      void resize( uint64_t max_pages );
     
       explicit Buffer( void );
       ~Buffer( void );
 
     private:
       RegionManager& m_rm;
-      uint64_t m_size;          // Maximum pages this buffer may have
-      PageDescriptor* m_array;
+      uint64_t m_size;          // Maximum pages of the default page size
+      uint64_t m_max_bytes;     // ... in bytes, shared by pages of all sizes
+      uint64_t m_used_bytes;    // Bytes of pages not yet freed
+      uint64_t m_bytes_wanted;  // Largest page waited for, see low_threshold_reached()
+      uint64_t m_num_descriptors;
+      std::vector<PageDescriptor*> m_arrays;  // Page descriptor allocations
 
       std::unordered_map<char*, PageDescriptor*> m_present_pages;
 
       std::vector<PageDescriptor*> m_free_pages;
-      std::deque<PageDescriptor*> m_busy_pages;
-
-      uint64_t m_evict_low_water;   // % to evict too
-      uint64_t m_evict_high_water;  // % to start evicting
+      PageList m_busy_pages;
+
+      uint64_t m_evict_low_water;   // Bytes to evict to
+      uint64_t m_evict_high_water;  // Bytes to start evicting at
+
+      //
+      // Bytes the Evict Manager keeps free for new pages.  The reserve
+      // grows whenever a fault has to wait for room and shrinks back toward
+      // its minimum while none do.
+      //
+      uint64_t m_reserve;
+      uint64_t m_min_reserve;
+      uint64_t m_max_reserve;
+      bool     m_stalled;         // A fault waited since the last eviction
+      bool     m_evict_pending;   // The Evict Manager has been kicked
+      uint64_t m_demand_fills;    // Fault work items the fill workers have not finished
 
       pthread_mutex_t m_mutex;
 
@@ -72,14 +143,20 @@ namespace Umap {
       BufferStats m_stats;
 
       void release_page_descriptor( PageDescriptor* pd );
+      void add_page_descriptors( uint64_t num_pages );
+      void update_water_marks( void );
 
       PageDescriptor* page_already_present( char* page_addr );
       PageDescriptor* get_page_descriptor( char* page_addr, RegionDescriptor* rd );
+      uint64_t wait_for_free_page_descriptor( char* page_addr, uint64_t page_size );
+      bool have_room( uint64_t page_size );
+      uint64_t high_water( void );
+      uint64_t low_water( void );
+      void kick_evict_manager( void );
       uint64_t apply_int_percentage( int percentage, uint64_t item );
 
       void lock();
       void unlock();
-      void wait_for_page_state( PageDescriptor* pd, PageDescriptor::State st);
   };
 
   std::ostream& operator<<(std::ostream& os, const Umap::BufferStats& stats);
@@ -5,6 +5,9 @@
 // SPDX-License-Identifier: LGPL-2.1-only
 //////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>            // std::sort
+#include <vector>
+
 #include "umap/Buffer.hpp"
 #include "umap/EvictManager.hpp"
 #include "umap/EvictWorkers.hpp"
@@ -12,51 +15,101 @@
 #include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
 #include "umap/store/Store.hpp"
 
 namespace Umap {
 
+//
+// Victims taken from the buffer per lock acquisition, and the most pages
+// handed to one evictor at a time
+//
+static const uint64_t victims_per_scan = 256;
+static const uint64_t pages_per_batch = 32;
+
+static bool by_address( const PageDescriptor* a, const PageDescriptor* b )
+{
+  return a->region != b->region ? a->region < b->region : a->page < b->page;
+}
+
+//
+// Clean victims have nothing to write back, so rather than handing them to
+// an evictor they are unmapped right here, a run of adjacent pages at a
+// time.  Only dirty victims go to the evictors.
+//
 void EvictManager::EvictMgr( void ) {
+  std::vector<PageDescriptor*> victims(victims_per_scan);
+  std::vector<PageDescriptor*> dirty;
+  std::vector<PageDescriptor*> clean;
+
   while ( 1 ) {
     auto w = get_work();
 
     if ( w.type == Umap::WorkItem::WorkType::EXIT )
       break;    // Time to leave
 
+    UMAP_TRACE_BEGIN(EVICT_SCAN, nullptr);
     while ( ! m_buffer->low_threshold_reached() ) {
-      WorkItem work;
-      work.type = Umap::WorkItem::WorkType::EVICT;
-      work.page_desc = m_buffer->evict_oldest_page(); // Could block
+      uint64_t n = m_buffer->evict_oldest_pages(&victims[0], victims_per_scan, false);
 
-      if ( work.page_desc == nullptr )
+      if ( n == 0 )
         break;
 
-      UMAP_LOG(Debug, m_buffer << ", " << work.page_desc);
+      dirty.clear();
+      clean.clear();
+
+      for ( uint64_t i = 0; i < n; ++i )
+        (victims[i]->dirty ? dirty : clean).push_back(victims[i]);
+
+      UMAP_LOG(Debug, m_buffer << ", " << dirty.size() << " dirty, " << clean.size() << " clean victims");
 
-      m_evict_workers->send_work(work);
+      if ( dirty.size() )
+        schedule_evictions(&dirty[0], dirty.size(), Umap::WorkItem::WorkType::EVICT);
+
+      if ( clean.size() ) {
+        std::sort(clean.begin(), clean.end(), by_address);
+        m_evict_workers->unmap_pages(&clean[0], clean.size());
+        m_buffer->mark_pages_as_free(&clean[0], clean.size());
+      }
     }
+    m_buffer->eviction_done();
+    UMAP_TRACE_END(EVICT_SCAN, nullptr);
   }
 }
+
 void EvictManager::WaitAll( void )
 {
   UMAP_LOG(Debug, "Entered");
   m_evict_workers->wait_for_idle();
   UMAP_LOG(Debug, "Done");
 }
-  
+
+//
+// Clean pages are simply forgotten, and dirty ones are written back by the
+// evictors without being unmapped.  evict_oldest_pages() only runs dry once
+// the pages taken by the Evict Manager or by drop_pages() have left too.
+//
 void EvictManager::EvictAll( void )
 {
+  std::vector<PageDescriptor*> victims(victims_per_scan);
+  std::vector<PageDescriptor*> dirty;
+  std::vector<PageDescriptor*> clean;
+
   UMAP_LOG(Debug, "Entered");
 
-  for (auto pd = m_buffer->evict_oldest_page(); pd != nullptr; pd = m_buffer->evict_oldest_page()) {
-    UMAP_LOG(Debug, "evicting: " << pd);
-    if (pd->dirty) {
-      WorkItem work = { .page_desc = pd, .type = Umap::WorkItem::WorkType::FAST_EVICT };
-      m_evict_workers->send_work(work);
-    }
-    else {
-      m_buffer->mark_page_as_free(pd);
-    }
+  while ( uint64_t n = m_buffer->evict_oldest_pages(&victims[0], victims_per_scan, true) ) {
+    dirty.clear();
+    clean.clear();
+
+    for ( uint64_t i = 0; i < n; ++i )
+      (victims[i]->dirty ? dirty : clean).push_back(victims[i]);
+
+    UMAP_LOG(Debug, "evicting: " << dirty.size() << " dirty, " << clean.size() << " clean");
+
+    if ( dirty.size() )
+      schedule_evictions(&dirty[0], dirty.size(), Umap::WorkItem::WorkType::FAST_EVICT);
+    if ( clean.size() )
+      m_buffer->mark_pages_as_free(&clean[0], clean.size());
   }
 
   m_evict_workers->wait_for_idle();
@@ -64,17 +117,35 @@ void EvictManager::EvictAll( void )
   UMAP_LOG(Debug, "Done");
 }
 
-void EvictManager::schedule_eviction(PageDescriptor* pd)
+//
+// Victims are sorted by region and address and handed out in batches, so
+// that an evictor sees neighboring pages together.
+//
+void EvictManager::schedule_evictions(PageDescriptor** pds, uint64_t npages, WorkItem::WorkType type)
 {
-  WorkItem work = { .page_desc = pd, .type = Umap::WorkItem::WorkType::EVICT };
+  std::sort(pds, pds + npages, by_address);
 
-  m_evict_workers->send_work(work);
+  for ( uint64_t i = 0; i < npages; ) {
+    uint64_t j = i + 1;
+
+    while ( j < npages && j - i < pages_per_batch && pds[j]->region == pds[i]->region )
+      ++j;
+
+    for ( uint64_t k = i; k < j; ++k )
+      pds[k]->batch_next = k + 1 < j ? pds[k + 1] : nullptr;
+
+    WorkItem work = { .page_desc = pds[i], .type = type };
+
+    m_evict_workers->send_work(work);
+    i = j;
+  }
 }
 
-void EvictManager::schedule_flush(PageDescriptor* pd)
+void EvictManager::schedule_eviction(PageDescriptor* pd)
 {
-  WorkItem work = { .page_desc = pd, .type = Umap::WorkItem::WorkType::FLUSH };
+  WorkItem work = { .page_desc = pd, .type = Umap::WorkItem::WorkType::EVICT };
 
+  pd->batch_next = nullptr;
   m_evict_workers->send_work(work);
 }
 
@@ -84,6 +155,7 @@ EvictManager::EvictManager( void ) :
 {
   m_evict_workers = new EvictWorkers(  RegionManager::getInstance().get_num_evictors()
                                      , m_buffer, RegionManager::getInstance().get_uffd_h());
+  set_cpus(RegionManager::getInstance().get_evict_manager_cpus());
   start_thread_pool();
 }
 
@@ -22,7 +22,7 @@ namespace Umap {
       EvictManager( void );
       ~EvictManager( void );
       void schedule_eviction(PageDescriptor* pd);
-      void schedule_flush(PageDescriptor* pd);
+      void schedule_evictions(PageDescriptor** pds, uint64_t npages, WorkItem::WorkType type);
       void EvictAll( void );
       void WaitAll( void );
 
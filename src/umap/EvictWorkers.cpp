@@ -4,9 +4,14 @@
 //
 // SPDX-License-Identifier: LGPL-2.1-only
 //////////////////////////////////////////////////////////////////////////////
+#include <algorithm>            // std::max
+#include <chrono>
 #include <errno.h>
+#include <fcntl.h>              // fallocate()
+#include <stdlib.h>             // posix_memalign()
 #include <string.h>
 #include <sys/mman.h>
+#include <vector>
 
 #include "umap/Buffer.hpp"
 #include "umap/EvictWorkers.hpp"
@@ -14,11 +19,235 @@
 #include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
 
 namespace Umap {
+namespace {
+  //
+  // Most bytes of adjacent pages copied and moved out at once with
+  // UMAP_DIRTY_SCAN, or a single larger page
+  //
+  const uint64_t max_scan_bytes = 1024 * 1024;
+}
+
+//
+// pds are adjacent dirty pages of one region, written to the store together
+// from data, which holds the contents of the first.
+//
+void EvictWorkers::write_back( PageDescriptor** pds, uint64_t npages, char* data )
+{
+  auto rd = pds[0]->region;
+  char* start = pds[0]->page;
+  uint64_t len = 0;
+
+  for ( uint64_t i = 0; i < npages; ++i )
+    len += pds[i]->size;
+
+  UMAP_TRACE_BEGIN(WRITE_BACK, start);
+  auto begin = std::chrono::steady_clock::now();
+  ssize_t nwritten = rd->store()->write_to_store(data, rd->store_length(start, len), rd->store_offset(start));
+  if (nwritten == -1)
+    UMAP_ERROR("write_to_store failed: "
+        << errno << " (" << strerror(errno) << ")");
+  record_latency(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - begin).count() / npages);
+  UMAP_TRACE_END(WRITE_BACK, start);
+
+  rd->stats().write_backs += npages;
+  rd->stats().bytes_written += nwritten;
+
+  for ( uint64_t i = 0; i < npages; ++i )
+    pds[i]->dirty = false;
+}
+
+//
+// pds are sorted by region and address.  Each run of adjacent pages of a
+// region is unmapped with one call.
+//
+void EvictWorkers::unmap_pages( PageDescriptor** pds, uint64_t npages )
+{
+  for ( uint64_t i = 0; i < npages; ) {
+    auto rd = pds[i]->region;
+    char* start = pds[i]->page;
+    char* end = start + pds[i]->size;
+    uint64_t j = i + 1;
+
+    while ( j < npages && pds[j]->region == rd && pds[j]->page == end )
+      end += pds[j++]->size;
+
+    UMAP_TRACE_BEGIN(UNMAP, start);
+
+    //
+    // Dropping the mapping of a shmem page would leave the page in the
+    // memfd, so punch it out of the memfd instead; that unmaps it too.
+    // Pages shared with other processes are punched out by the last
+    // process to drop them.
+    //
+    if ( rd->shmem() && ! rd->shared() ) {
+      if (fallocate(rd->memfd(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    rd->store_offset(start), end - start) == -1)
+        UMAP_ERROR("fallocate failed: " << errno << " (" << strerror(errno) << ")");
+    }
+    else if (madvise(start, end - start, MADV_DONTNEED) == -1) {
+      UMAP_ERROR("madvise failed: " << errno << " (" << strerror(errno) << ")");
+    }
+
+    if ( rd->shared() ) {
+      for ( uint64_t k = i; k < j; ++k )
+        rd->shared()->release(rd->store_offset(pds[k]->page) / pds[k]->size);
+    }
+
+    UMAP_TRACE_END(UNMAP, start);
+    ++rd->stats().shootdowns;
+    i = j;
+  }
+}
+
+void EvictWorkers::grow_staging( Staging& staging, uint64_t size )
+{
+  if ( size <= staging.size )
+    return;
+
+  free(staging.snapshot);
+  if ( staging.pages != nullptr )
+    munmap(staging.pages, staging.size);
+
+  if (posix_memalign((void**)&staging.snapshot, RegionManager::getInstance().get_system_page_size(), size))
+    UMAP_ERROR("posix_memalign failed to allocated " << size << " bytes of memory");
+
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if ( p == MAP_FAILED )
+    UMAP_ERROR("mmap of staging pages failed: " << strerror(errno));
+
+  // A huge page would have to be split on every move
+  madvise(p, size, MADV_NOHUGEPAGE);
+
+  staging.pages = (char*)p;
+  staging.size = size;
+  m_uffd->register_staging(staging.pages, staging.size);
+}
+
+//
+// With UMAP_DIRTY_SCAN, the pages of pds may have been written to without
+// a fault, and may be written to while we look.  A page to be evicted is
+// copied, then write protected again, which tells whether it was written
+// since the last time, and then moved out of the region (or unmapped from a
+// shmem region, leaving it in the memfd).  From then on a write faults as
+// on any missing page.  A page written to between the scan and the move no
+// longer matches its copy.  Flushed pages stay, and are only scanned.
+//
+void EvictWorkers::scan_pages( PageDescriptor** pds, uint64_t npages, WorkItem::WorkType type, Staging& staging )
+{
+  static bool warned = false;
+  auto rd = pds[0]->region;
+  uint64_t page_size = rd->page_size();
+  uint64_t max_run = std::max((uint64_t)1, max_scan_bytes / page_size);
+  bool evict = (type == Umap::WorkItem::WorkType::EVICT);
+  std::vector<bool> written;
+
+  for ( uint64_t i = 0; i < npages; ) {
+    uint64_t n = 1;
+
+    while ( i + n < npages && n < max_run && pds[i + n]->page == pds[i + n - 1]->page + page_size )
+      ++n;
+
+    char* start = pds[i]->page;
+    uint64_t len = n * page_size;
+    uint64_t moved = 0;
+    char* data = start;
+
+    if ( evict ) {
+      grow_staging(staging, len);
+      memcpy(staging.snapshot, start, len);
+    }
+
+    m_uffd->scan_written(start, len, page_size, written);
+    ++rd->stats().shootdowns;
+
+    if ( evict ) {
+      UMAP_TRACE_BEGIN(UNMAP, start);
+      if ( rd->shmem() ) {
+        if (madvise(start, len, MADV_DONTNEED) == -1)
+          UMAP_ERROR("madvise failed: " << errno << " (" << strerror(errno) << ")");
+        data = rd->alias(start);
+        moved = len;
+      }
+      else {
+        moved = m_uffd->move_out_pages(start, staging.pages, len);
+        data = staging.pages;
+
+        //
+        // The kernel does not move pages that are shared, e.g. after a
+        // fork.  What it left is written back from where it is.
+        //
+        if ( moved < len && ! warned ) {
+          warned = true;
+          UMAP_LOG(Warning, "Pages could not be moved out of the region; "
+              "writes during their eviction may be lost");
+        }
+      }
+      UMAP_TRACE_END(UNMAP, start);
+      ++rd->stats().shootdowns;
+
+      for ( uint64_t k = 0; k < n; ++k ) {
+        uint64_t off = k * page_size;
+        const char* page = off < moved ? data + off : start + off;
+
+        if ( ! written[k] && memcmp(page, staging.snapshot + off, page_size) != 0 )
+          written[k] = true;
+      }
+    }
+
+    for ( uint64_t k = 0; k < n; ) {
+      if ( ! written[k] ) {
+        pds[i + k]->dirty = false;
+        ++k;
+        continue;
+      }
+
+      uint64_t m = k + 1;
+      uint64_t off = k * page_size;
+
+      //
+      // A run written from staging must not reach into what was left
+      // behind in the region
+      //
+      while ( m < n && written[m] && (off >= moved) == (m * page_size >= moved) )
+        ++m;
+
+      write_back(&pds[i + k], m - k, off < moved ? data + off : start + off);
+      k = m;
+    }
+
+    if ( evict ) {
+      if ( rd->shmem() ) {
+        if (fallocate(rd->memfd(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      rd->store_offset(start), len) == -1)
+          UMAP_ERROR("fallocate failed: " << errno << " (" << strerror(errno) << ")");
+      }
+      else {
+        if ( moved > 0 && madvise(staging.pages, moved, MADV_DONTNEED) == -1 )
+          UMAP_ERROR("madvise failed: " << errno << " (" << strerror(errno) << ")");
+        if ( moved < len && madvise(start + moved, len - moved, MADV_DONTNEED) == -1 )
+          UMAP_ERROR("madvise failed: " << errno << " (" << strerror(errno) << ")");
+      }
+    }
+
+    i += n;
+  }
+}
+
+//
+// A work item is a batch of pages linked through batch_next, all of one
+// region and in address order.  Each run of adjacent dirty pages is write
+// protected and written back with one call, and the whole batch is
+// unmapped by runs and freed at once.
+//
 void EvictWorkers::EvictWorker( void )
 {
-  uint64_t page_size = RegionManager::getInstance().get_umap_page_size();
+  std::vector<PageDescriptor*> batch;
+  Staging staging = { nullptr, nullptr, 0 };
 
   while ( 1 ) {
     auto w = get_work();
@@ -28,38 +257,65 @@ void EvictWorkers::EvictWorker( void )
     if ( w.type == Umap::WorkItem::WorkType::EXIT )
       break;    // Time to leave
 
-    auto pd = w.page_desc;
+    batch.clear();
 
-    if ( pd->dirty ) {
-      auto store = pd->region->store();
-      auto offset = pd->region->store_offset(pd->page);
+    for ( auto pd = w.page_desc; pd != nullptr; pd = pd->batch_next )
+      batch.push_back(pd);
 
-      m_uffd->enable_write_protect(pd->page);
+    UMAP_TRACE_BEGIN(EVICT, batch[0]->page);
 
-      if (store->write_to_store(pd->page, page_size, offset) == -1)
-        UMAP_ERROR("write_to_store failed: "
-            << errno << " (" << strerror(errno) << ")");
-
-      pd->dirty = false;
+    if ( m_uffd->dirty_scan() && (batch[0]->region->prot() & PROT_WRITE) ) {
+      scan_pages(&batch[0], batch.size(), w.type, staging);
     }
+    else {
+      for ( uint64_t i = 0; i < batch.size(); ) {
+        if ( ! batch[i]->dirty ) {
+          ++i;
+          continue;
+        }
 
-    if (w.type == Umap::WorkItem::WorkType::FLUSH)
-      continue;
-    
-    if (w.type != Umap::WorkItem::WorkType::FAST_EVICT) {
-      if (madvise(pd->page, page_size, MADV_DONTNEED) == -1)
-        UMAP_ERROR("madvise failed: " << errno << " (" << strerror(errno) << ")");
+        uint64_t j = i + 1;
+
+        while (   j < batch.size() && batch[j]->dirty
+               && batch[j]->page == batch[j - 1]->page + batch[j - 1]->size )
+          ++j;
+
+        char* start = batch[i]->page;
+
+        m_uffd->enable_write_protect(start, batch[j - 1]->page + batch[j - 1]->size - start);
+        ++batch[i]->region->stats().shootdowns;
+        write_back(&batch[i], j - i, start);
+        i = j;
+      }
+
+      if (w.type == Umap::WorkItem::WorkType::EVICT)
+        unmap_pages(&batch[0], batch.size());
     }
 
-    UMAP_LOG(Debug, "Removing page: " << w.page_desc);
-    m_buffer->mark_page_as_free(w.page_desc);
+    UMAP_TRACE_END(EVICT, batch[0]->page);
+
+    //
+    // Flushed pages stay, and may be evicted or written to again
+    //
+    if (w.type == Umap::WorkItem::WorkType::FLUSH)
+      m_buffer->mark_pages_as_present(&batch[0], batch.size());
+    else
+      m_buffer->mark_pages_as_free(&batch[0], batch.size());
   }
+
+  free(staging.snapshot);
+  if ( staging.pages != nullptr )
+    munmap(staging.pages, staging.size);
 }
 
 EvictWorkers::EvictWorkers(uint64_t num_evictors, Buffer* buffer, Uffd* uffd)
   :   WorkerPool("Evict Workers", num_evictors), m_buffer(buffer)
     , m_uffd(uffd)
 {
+  auto& rm = RegionManager::getInstance();
+
+  set_cpus(rm.get_evictor_cpus());
+  set_elastic(rm.get_min_evictors(), num_evictors, rm.get_pool_idle_timeout());
   start_thread_pool();
 }
 
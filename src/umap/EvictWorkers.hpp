@@ -21,11 +21,30 @@ namespace Umap {
       EvictWorkers(uint64_t num_evictors, Buffer* buffer, Uffd* uffd);
       ~EvictWorkers( void );
 
+      //
+      // Unmaps pages that need not be written back, sorted by region and
+      // address, on the calling thread
+      //
+      void unmap_pages( PageDescriptor** pds, uint64_t npages );
+
     private:
+      //
+      // An evictor's copies of the pages it is evicting with
+      // UMAP_DIRTY_SCAN, and the mapping they are moved out to
+      //
+      struct Staging {
+        char*    snapshot;
+        char*    pages;
+        uint64_t size;
+      };
+
       Buffer* m_buffer;
       Uffd* m_uffd;
 
       void EvictWorker( void );
+      void write_back( PageDescriptor** pds, uint64_t npages, char* data );
+      void scan_pages( PageDescriptor** pds, uint64_t npages, WorkItem::WorkType type, Staging& staging );
+      void grow_staging( Staging& staging, uint64_t size );
       void ThreadEntry( void );
   };
 } // end of namespace Umap
@@ -6,27 +6,47 @@
 //////////////////////////////////////////////////////////////////////////////
 #include "umap/config.h"
 
+#include <algorithm>            // std::min
+#include <chrono>
 #include <cstdint>              // calloc
+#include <vector>
 #include <errno.h>
 #include <string.h>             // strerror()
+#include <sys/mman.h>           // mmap()
+#include <sys/uio.h>            // iovec
 #include <unistd.h>
 
 #include "umap/Buffer.hpp"
 #include "umap/FillWorkers.hpp"
 #include "umap/RegionManager.hpp"
+#include "umap/Prefetcher.hpp"
 #include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
 #include "umap/store/Store.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Numa.hpp"
+#include "umap/util/Trace.hpp"
 
 namespace Umap {
-  void FillWorkers::FillWorker( void ) {
+  //
+  // Moving a page in saves copying it, but the staging page it leaves
+  // behind must be faulted in (and zeroed) again before the next read and
+  // the move flushes the TLB.  With small pages that is slower than just
+  // copying.
+  //
+  static const uint64_t min_move_page_size = 64 * 1024;
+
+  //
+  // The copy-in buffer of a fill worker, large enough for a run of size
+  // bytes.  It is touched right away so that it is backed by memory local
+  // to the cpus the thread may run on.
+  //
+  static char* alloc_copyin_buf( uint64_t size, bool touch )
+  {
     char* copyin_buf;
-    uint64_t page_size = RegionManager::getInstance().get_umap_page_size();
-    uint64_t read_ahead = RegionManager::getInstance().get_read_ahead();
-    std::size_t sz = 2 * page_size;
+    std::size_t sz = 2 * size;
 
-    if (posix_memalign((void**)&copyin_buf, page_size, sz)) {
+    if (posix_memalign((void**)&copyin_buf, RegionManager::getInstance().get_system_page_size(), sz)) {
       UMAP_ERROR("posix_memalign failed to allocated "
           << sz << " bytes of memory");
     }
@@ -36,6 +56,88 @@ namespace Umap {
           << sz << " bytes of memory");
     }
 
+    if ( touch )
+      memset(copyin_buf, 0, sz);
+
+    return copyin_buf;
+  }
+
+  //
+  // When the kernel can move pages into the region with UFFDIO_MOVE, we
+  // read into a private staging page and move it into place, saving the
+  // copy of the page that UFFDIO_COPY would make.  The staging page is
+  // left empty by the move and the next read faults in a fresh one.
+  //
+  static char* map_staging_page( uint64_t page_size )
+  {
+    void* p = mmap(nullptr, page_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if ( p == MAP_FAILED )
+      UMAP_ERROR("mmap of staging page failed: " << strerror(errno));
+
+    // A huge page would have to be split on every move
+    madvise(p, page_size, MADV_NOHUGEPAGE);
+    return (char*)p;
+  }
+
+  //
+  // Read the pages from page on into the buffers of iov, which are as long
+  // as the pages, with one call to the store.  What lies past the end of
+  // the region or of the file reads as zeros.
+  //
+  void FillWorkers::read_pages( RegionDescriptor* rd, char* page, std::vector<struct iovec>& iov, uint64_t offset )
+  {
+    uint64_t len = iov.size() * rd->page_size();
+    uint64_t want = rd->store_length(page, len);
+    uint64_t cut = want;
+
+    for ( auto& v : iov ) {
+      v.iov_len = std::min(v.iov_len, cut);
+      cut -= v.iov_len;
+    }
+
+    UMAP_TRACE_BEGIN(STORE_READ, page);
+    auto start = std::chrono::steady_clock::now();
+    ssize_t nread = rd->store()->read_from_store_v(&iov[0], iov.size(), offset);
+    if (nread == -1)
+      UMAP_ERROR("read_from_store failed");
+
+    uint64_t page_size = rd->page_size();
+    uint64_t done = nread;
+
+    for ( auto& v : iov ) {
+      uint64_t got = std::min(done, page_size);
+
+      if ( got < page_size )
+        memset((char*)v.iov_base + got, 0, page_size - got);
+      done -= got;
+    }
+    record_latency(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start).count() / iov.size());
+    UMAP_TRACE_END(STORE_READ, page);
+
+    rd->stats().bytes_read += nread;
+  }
+
+  void FillWorkers::FillWorker( void ) {
+    //
+    // Both buffers are sized for the default page size to begin with and
+    // grown when a region with larger pages comes along.
+    //
+    uint64_t buf_size = RegionManager::getInstance().get_umap_page_size();
+    char* copyin_buf = alloc_copyin_buf(buf_size, m_node >= 0);
+    uint64_t staging_size = 0;
+    char* staging = nullptr;
+
+    if ( m_uffd->have_move() && buf_size >= min_move_page_size ) {
+      staging_size = buf_size;
+      staging = map_staging_page(staging_size);
+    }
+
+    std::vector<PageDescriptor*> run;
+    std::vector<struct iovec> iov;
+
     while ( 1 ) {
       auto w = get_work();
 
@@ -44,28 +146,153 @@ namespace Umap {
       if (w.type == Umap::WorkItem::WorkType::EXIT)
         break;    // Time to leave
 
+      //
+      // A work item is a run of pages of one region linked through
+      // batch_next, in address order and perhaps with gaps of up to
+      // UMAP_FILL_MERGE_GAP pages between them, or a single page being
+      // written to
+      //
+      auto rd = w.page_desc->region;
+      char* page = w.page_desc->page;
+      uint64_t page_size = rd->page_size();
+      bool filled = false;
+
+      run.clear();
+      for ( auto pd = w.page_desc; pd != nullptr; pd = pd->batch_next )
+        run.push_back(pd);
+
+      uint64_t npages = run.size();
+      char* last_page = run[npages - 1]->page;
+      uint64_t span = last_page + page_size - page;
+      auto queued = w.page_desc->fill_queued;
+
+      UMAP_TRACE_BEGIN(FILL, page);
+
       if ( w.page_desc->dirty && w.page_desc->data_present ) {
-        m_uffd->disable_write_protect(w.page_desc->page);
+        m_uffd->fill_read_done();
+        m_uffd->disable_write_protect(w.page_desc->page, page_size);
       }
       else {
-        uint64_t offset = w.page_desc->region->store_offset(w.page_desc->page);
+        uint64_t offset = rd->store_offset(page);
+        bool write_protect = ! w.page_desc->dirty;
+
+        //
+        // Pages of shmem regions are read straight into the memfd through
+        // its alias mapping, so there is nothing to copy or move.  The
+        // kernel only moves pages between writable mappings, and cannot
+        // write protect them as it moves them, so pages that are to be
+        // write protected are copied with UFFDIO_COPY_MODE_WP instead.
+        //
+        bool shmem = rd->shmem();
+        bool use_move = (   ! shmem && ! write_protect && m_uffd->have_move()
+                         && page_size >= min_move_page_size && (rd->prot() & PROT_WRITE) );
+
+        //
+        // The pages in the gaps of a run are read along with it and thrown
+        // away.  A shmem region may have them present, so they are read
+        // into copyin_buf rather than through the alias.
+        //
+        uint64_t need = shmem ? (span > npages * page_size ? page_size : 0) : span;
 
-        if (w.page_desc->region->store()->read_from_store(copyin_buf, page_size, offset) == -1)
-          UMAP_ERROR("read_from_store failed");
+        if ( ! use_move && need > buf_size ) {
+          free(copyin_buf);
+          buf_size = need;
+          copyin_buf = alloc_copyin_buf(buf_size, m_node >= 0);
+        }
 
-        if ( ! w.page_desc->dirty ) {
-          m_uffd->copy_in_page_and_write_protect(copyin_buf, w.page_desc->page);
+        if ( use_move && span > staging_size ) {
+          if ( staging != nullptr )
+            munmap(staging, staging_size);
+          staging_size = span;
+          staging = map_staging_page(staging_size);
+        }
+
+        char* buf = shmem ? rd->alias(page) : use_move ? staging : copyin_buf;
+
+        //
+        // Another process may have read the pages of a shared region
+        // already, so each is read, if at all, on its own
+        //
+        auto shared = rd->shared();
+
+        if ( shared != nullptr ) {
+          for ( uint64_t i = 0; i < npages; ++i ) {
+            uint64_t page_offset = rd->store_offset(run[i]->page);
+
+            if ( shared->acquire(page_offset / page_size) ) {
+              iov.assign(1, iovec{ buf + (run[i]->page - page), page_size });
+              read_pages(rd, run[i]->page, iov, page_offset);
+              shared->filled(page_offset / page_size);
+              ++rd->stats().fills;
+            }
+          }
         }
         else {
-          m_uffd->copy_in_page(copyin_buf, w.page_desc->page);
+          //
+          // One read for the whole run, each page to its place in buf
+          //
+          iov.clear();
+          for ( uint64_t i = 0; i < npages; ++i ) {
+            for ( char* p = i ? run[i - 1]->page + page_size : page; p < run[i]->page; p += page_size )
+              iov.push_back(iovec{ shmem ? copyin_buf : buf + (p - page), page_size });
+            iov.push_back(iovec{ buf + (run[i]->page - page), page_size });
+          }
+
+          read_pages(rd, page, iov, offset);
+          rd->stats().fills += npages;
+        }
+        m_uffd->fill_read_done();
+
+        //
+        // One ioctl for each stretch of adjacent pages
+        //
+        for ( uint64_t i = 0, j; i < npages; i = j ) {
+          for ( j = i + 1; j < npages && run[j]->page == run[j - 1]->page + page_size; ++j )
+            ;
+
+          char* sub = run[i]->page;
+          uint64_t sub_len = (j - i) * page_size;
+
+          if ( shmem ) {
+            m_uffd->continue_pages(sub, sub_len, write_protect);
+          }
+          else if ( use_move && m_uffd->move_in_page(buf + (sub - page), sub, sub_len) ) {
+            // Pages are in place
+          }
+          else {
+            m_uffd->copy_in_pages(buf + (sub - page), sub, sub_len, write_protect);
+          }
         }
-        w.page_desc->data_present = true;
+
+        for ( auto pd : run )
+          pd->data_present = true;
+        filled = true;
       }
 
-      m_buffer->mark_page_as_present(w.page_desc);
+      ++rd->stats().demand_fills;
+      rd->stats().demand_fill_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                      std::chrono::steady_clock::now() - queued).count();
+
+      //
+      // Until its pages are marked present the region cannot be unmapped,
+      // so read ahead, and touch rd, only before that
+      //
+      auto prefetcher = RegionManager::getInstance().get_prefetcher_h();
+
+      if ( filled && prefetcher != nullptr )
+        prefetcher->read_ahead(rd, last_page);
+
+      //
+      // The page descriptors may be reused as soon as the pages are present
+      //
+      m_buffer->mark_pages_as_present(&run[0], npages, true);
+      UMAP_TRACE_END(FILL, page);
     }
 
     free(copyin_buf);
+
+    if ( staging != nullptr )
+      munmap(staging, staging_size);
   }
 
   void FillWorkers::ThreadEntry( void ) {
@@ -77,7 +304,27 @@ namespace Umap {
       , m_uffd(RegionManager::getInstance().get_uffd_h())
       , m_buffer(RegionManager::getInstance().get_buffer_h())
       , m_read_ahead(RegionManager::getInstance().get_read_ahead())
+      , m_node(-1)
+  {
+    auto& rm = RegionManager::getInstance();
+
+    set_cpus(rm.get_filler_cpus());
+    set_elastic(rm.get_min_fillers(), rm.get_num_fillers(), rm.get_pool_idle_timeout());
+    start_thread_pool();
+  }
+
+  FillWorkers::FillWorkers( int node, uint64_t num_fillers, const std::vector<int>& cpus )
+    :   WorkerPool("Fill Workers " + std::to_string(node), num_fillers)
+      , m_uffd(RegionManager::getInstance().get_uffd_h())
+      , m_buffer(RegionManager::getInstance().get_buffer_h())
+      , m_read_ahead(RegionManager::getInstance().get_read_ahead())
+      , m_node(node)
   {
+    auto& rm = RegionManager::getInstance();
+    uint64_t min_fillers = rm.get_min_fillers() / numa::num_nodes();
+
+    set_cpus(cpus);
+    set_elastic(min_fillers, num_fillers, rm.get_pool_idle_timeout());
     start_thread_pool();
   }
 
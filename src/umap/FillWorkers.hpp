@@ -7,6 +7,10 @@
 #ifndef _UMAP_FillWorkers_HPP
 #define _UMAP_FillWorkers_HPP
 
+#include <vector>
+
+#include <sys/uio.h>
+
 #include "umap/Buffer.hpp"
 #include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
@@ -18,15 +22,23 @@ namespace Umap {
   class FillWorkers : public WorkerPool {
     public:
       FillWorkers( void );
+
+      //
+      // A pool serving faults from one NUMA node.  Its threads only run on
+      // cpus of that node, so the pages they copy in are allocated there.
+      //
+      FillWorkers( int node, uint64_t num_fillers, const std::vector<int>& cpus );
       ~FillWorkers( void );
 
     private:
       Uffd*    m_uffd;
       Buffer*  m_buffer;
       uint64_t m_read_ahead;
+      int      m_node;
 
       void FillWorker( void );
       void ThreadEntry( void );
+      void read_pages( RegionDescriptor* rd, char* page, std::vector<struct iovec>& iov, uint64_t offset );
   };
 } // end of namespace Umap
 #endif // _UMAP_FillWorker_HPP
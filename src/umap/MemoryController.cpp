@@ -0,0 +1,397 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <cstdint>
+#include <cstdlib>              // strtoull(), strtod()
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>               // poll()
+#include <string.h>             // strerror()
+#include <unistd.h>
+
+#include "umap/config.h"
+#include "umap/RegionManager.hpp"
+#include "umap/MemoryController.hpp"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+
+//
+// Ask for a notification when tasks stall on memory for more than 150ms in
+// any 2 second window.  Unprivileged triggers require a window that is a
+// multiple of 2 seconds.
+//
+static const char* psi_trigger = "some 150000 2000000";
+
+//
+// Split into the mount point of the unified hierarchy and our path within
+// it, so that callers can walk up to the root.
+//
+static bool cgroup_v2_dirs( std::string& mount_point, std::string& path )
+{
+  std::string line;
+
+  //
+  // Find where the unified hierarchy is mounted; on hybrid systems this is
+  // not necessarily /sys/fs/cgroup.
+  //
+  mount_point.clear();
+  std::ifstream mountinfo("/proc/self/mountinfo");
+  while ( std::getline(mountinfo, line) ) {
+    auto sep = line.find(" - ");
+
+    if ( sep == std::string::npos || line.compare(sep + 3, 8, "cgroup2 ") != 0 )
+      continue;
+
+    std::istringstream fields(line);
+    std::string id, parent, dev, root;
+    fields >> id >> parent >> dev >> root >> mount_point;
+    break;
+  }
+
+  if ( mount_point.empty() )
+    return false;
+
+  std::ifstream cgroup("/proc/self/cgroup");
+  while ( std::getline(cgroup, line) ) {
+    if ( line.compare(0, 3, "0::") == 0 ) {
+      path = line.substr(3);
+      if ( path == "/" )
+        path.clear();
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string
+cgroup_v2_path( void )
+{
+  std::string mount_point, path;
+
+  if ( ! cgroup_v2_dirs(mount_point, path) )
+    return "";
+  return mount_point + path;
+}
+
+static bool read_u64( const std::string& fname, uint64_t& val )
+{
+  std::ifstream f(fname);
+  std::string token;
+
+  if ( !(f >> token) || token == "max" )
+    return false;
+
+  val = strtoull(token.c_str(), nullptr, 10);
+  return true;
+}
+
+bool
+read_cgroup_limit( uint64_t& limit )
+{
+  std::string mount_point, path;
+  bool have_limit = false;
+
+  if ( ! cgroup_v2_dirs(mount_point, path) )
+    return false;
+
+  for ( std::string p = path; ; p.erase(p.find_last_of('/')) ) {
+    uint64_t l;
+
+    if ( read_u64(mount_point + p + "/memory.max", l) && ( ! have_limit || l < limit ) ) {
+      limit = l;
+      have_limit = true;
+    }
+
+    if ( p.empty() )
+      break;
+  }
+  return have_limit;
+}
+
+//
+// Parse the "some avg10=" value out of a PSI file
+//
+static bool read_pressure( const std::string& fname, double& pressure )
+{
+  std::ifstream f(fname);
+  std::string token;
+
+  while ( f >> token ) {
+    if ( token == "some" && f >> token && token.compare(0, 6, "avg10=") == 0 ) {
+      pressure = strtod(token.c_str() + 6, nullptr);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+read_memory_status( MemoryStatus& ms )
+{
+  std::string mount_point, path;
+  bool have_v2 = cgroup_v2_dirs(mount_point, path);
+
+  ms.have_cgroup = false;
+  ms.have_pressure = false;
+  ms.pressure = 0.0;
+
+  //
+  // A limit may be imposed by any ancestor, so walk up the hierarchy and use
+  // the level with the least room left.
+  //
+  if ( have_v2 ) {
+    uint64_t least_room = 0;
+
+    for ( std::string p = path; ; p.erase(p.find_last_of('/')) ) {
+      std::string dir = mount_point + p;
+      uint64_t limit, usage;
+
+      if ( read_u64(dir + "/memory.max", limit) && read_u64(dir + "/memory.current", usage) ) {
+        uint64_t room = usage < limit ? limit - usage : 0;
+
+        if ( ! ms.have_cgroup || room < least_room ) {
+          ms.limit = limit;
+          ms.usage = usage;
+          ms.have_cgroup = true;
+          least_room = room;
+        }
+      }
+
+      if ( p.empty() )
+        break;
+    }
+
+    ms.have_pressure = read_pressure(mount_point + path + "/memory.pressure", ms.pressure);
+  }
+
+  if ( ! ms.have_pressure )
+    ms.have_pressure = read_pressure("/proc/pressure/memory", ms.pressure);
+
+  if ( ms.have_cgroup )
+    return true;
+
+  //
+  // No cgroup limit: treat the machine as the container
+  //
+  uint64_t total_kb = 0, avail_kb = 0;
+  std::ifstream meminfo("/proc/meminfo");
+  std::string token;
+
+  while ( meminfo >> token ) {
+    if ( token == "MemTotal:" )
+      meminfo >> total_kb;
+    else if ( token == "MemAvailable:" )
+      meminfo >> avail_kb;
+    meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+
+  if ( total_kb == 0 )
+    return false;
+
+  ms.limit = total_kb * 1024;
+  ms.usage = (total_kb - (avail_kb < total_kb ? avail_kb : total_kb)) * 1024;
+  return true;
+}
+
+void
+MemoryController::open_pressure_trigger( void )
+{
+  std::string cg = cgroup_v2_path();
+  std::string fname = cg.empty() ? "" : cg + "/memory.pressure";
+
+  m_trigger_fd = -1;
+
+  for ( int i = 0; i < 2 && m_trigger_fd == -1; ++i, fname = "/proc/pressure/memory" ) {
+    if ( fname.empty() )
+      continue;
+
+    int fd = open(fname.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if ( fd == -1 )
+      continue;
+
+    if ( write(fd, psi_trigger, strlen(psi_trigger) + 1) < 0 ) {
+      UMAP_LOG(Debug, "Unable to set PSI trigger on " << fname << ": " << strerror(errno));
+      close(fd);
+      continue;
+    }
+
+    UMAP_LOG(Debug, "Watching memory pressure on " << fname);
+    m_trigger_fd = fd;
+  }
+}
+
+//
+// Never shrink below 5% of the configured size
+//
+uint64_t
+MemoryController::min_buffer_pages( uint64_t max_pages )
+{
+  const uint64_t min_percent = 5;
+  uint64_t pages = max_pages / 100 * min_percent;
+
+  if ( pages < 16 )
+    pages = max_pages < 16 ? max_pages : 16;
+  return pages;
+}
+
+//
+// Shrink multiplicatively and grow additively, much like TCP congestion
+// control: when memory is short we want to get out of the way quickly, and
+// when it frees up we approach the cap slowly so as not to oscillate.
+//
+uint64_t
+MemoryController::target_pages( const MemoryStatus& ms, uint64_t cur_pages,
+                                uint64_t min_pages, uint64_t max_pages )
+{
+  uint64_t headroom = ms.limit / 100 * m_headroom_percent;
+  uint64_t want = ms.usage + headroom;
+  uint64_t target = cur_pages;
+
+  if ( ms.have_pressure && ms.pressure >= (double)m_pressure_threshold ) {
+    target = cur_pages - cur_pages / 4;
+  }
+  else if ( want > ms.limit ) {
+    uint64_t deficit = (want - ms.limit + m_page_size - 1) / m_page_size;
+    uint64_t step = cur_pages / 8;
+
+    target = cur_pages - (deficit > step ? (deficit < cur_pages ? deficit : cur_pages) : step);
+  }
+  else if ( ! ms.have_pressure || ms.pressure < (double)m_pressure_threshold / 2 ) {
+    //
+    // Only grow into half of the slack at a time, since the pages we add will
+    // themselves show up in the usage once they are filled.
+    //
+    uint64_t slack = (ms.limit - want) / m_page_size / 2;
+    uint64_t step = max_pages / 16 ? max_pages / 16 : 1;
+
+    target = cur_pages + (slack < step ? slack : step);
+  }
+
+  if ( target < min_pages )
+    target = min_pages;
+  if ( target > max_pages )
+    target = max_pages;
+  return target;
+}
+
+void
+MemoryController::adjust( void )
+{
+  MemoryStatus ms;
+
+  if ( ! read_memory_status(ms) )
+    return;
+
+  //
+  // The application may change the maximum at any time, resizing the buffer
+  // to it.  We only ever resize within it.
+  //
+  uint64_t max = m_rm.get_max_pages_in_buffer();
+  uint64_t min = min_buffer_pages(max);
+  uint64_t cur = m_rm.get_buffer_pages();
+  uint64_t target = target_pages(ms, cur, min, max);
+  uint64_t diff = target > cur ? target - cur : cur - target;
+
+  //
+  // Ignore small changes so that noise in the usage does not keep the
+  // evictors busy resizing.
+  //
+  if ( diff == 0 || (diff < cur / 32 && target != min && target != max) )
+    return;
+
+  UMAP_LOG(Info, "Memory limit: " << ms.limit << " usage: " << ms.usage
+      << " pressure: " << ms.pressure << "%, resizing buffer from "
+      << cur << " to " << target << " pages");
+
+  m_rm.resize_buffer(target);
+}
+
+void
+MemoryController::monitor( void )
+{
+  struct pollfd pollfd[2] = {
+      { .fd = m_pipe[0], .events = POLLIN }
+    , { .fd = m_trigger_fd, .events = POLLPRI }
+  };
+  int nfds = m_trigger_fd == -1 ? 1 : 2;
+
+  //
+  // As with the Uffd manager, our work queue is only used as a sentinel for
+  // when it is time to leave.
+  //
+  while ( wq_is_empty() ) {
+    int rval = poll(&pollfd[0], nfds, (int)m_interval_ms);
+
+    if ( rval == -1 ) {
+      if ( errno == EINTR )
+        continue;
+      UMAP_ERROR("poll failed: " << strerror(errno));
+    }
+
+    if ( pollfd[0].revents & POLLIN )
+      break;
+
+    if ( nfds == 2 && (pollfd[1].revents & POLLERR) ) {
+      UMAP_LOG(Info, "PSI trigger went away, polling only");
+      nfds = 1;
+    }
+
+    adjust();
+  }
+  UMAP_LOG(Debug, "Good bye");
+}
+
+void
+MemoryController::ThreadEntry( void )
+{
+  monitor();
+}
+
+MemoryController::MemoryController( void )
+  :   WorkerPool("Memory Monitor", 1)
+    , m_rm(RegionManager::getInstance())
+    , m_page_size(m_rm.get_umap_page_size())
+    , m_interval_ms(m_rm.get_memory_controller_interval())
+    , m_pressure_threshold(m_rm.get_memory_pressure_threshold())
+    , m_headroom_percent(m_rm.get_memory_headroom())
+{
+  uint64_t max = m_rm.get_max_pages_in_buffer();
+
+  open_pressure_trigger();
+
+  if (pipe2(m_pipe, O_CLOEXEC) < 0)
+    UMAP_ERROR("memory controller pipe failed: " << strerror(errno));
+
+  UMAP_LOG(Info, "Memory controller: buffer between " << min_buffer_pages(max)
+      << " and " << max << " pages, checking every "
+      << m_interval_ms << "ms"
+      << (m_trigger_fd == -1 ? "" : " or on memory pressure"));
+
+  set_cpus(m_rm.get_service_cpus());
+  start_thread_pool();
+}
+
+MemoryController::~MemoryController( void )
+{
+  char bye[5] = "bye";
+
+  write(m_pipe[1], bye, 3);
+
+  stop_thread_pool();
+
+  if ( m_trigger_fd != -1 )
+    close(m_trigger_fd);
+  close(m_pipe[0]);
+  close(m_pipe[1]);
+}
+} // end of namespace Umap
@@ -0,0 +1,75 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_MemoryController_HPP
+#define _UMAP_MemoryController_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "umap/WorkerPool.hpp"
+
+namespace Umap {
+  class RegionManager;
+
+  struct MemoryStatus {
+    uint64_t limit;           // Bytes we may use in total
+    uint64_t usage;           // Bytes currently in use against that limit
+    double   pressure;        // PSI "some" avg10, in percent
+    bool     have_cgroup;     // limit/usage came from a cgroup v2 limit
+    bool     have_pressure;
+  };
+
+  //
+  // Returns the cgroup v2 directory of this process, or an empty string if
+  // there is no cgroup v2 hierarchy mounted.
+  //
+  std::string cgroup_v2_path( void );
+
+  //
+  // Set limit to the smallest memory.max of our cgroup v2 and its ancestors.
+  // Returns false if none of them imposes a limit.
+  //
+  bool read_cgroup_limit( uint64_t& limit );
+
+  //
+  // Fill in ms from the cgroup v2 memory controller if it imposes a limit,
+  // otherwise from /proc/meminfo.  Returns false if neither was readable.
+  //
+  bool read_memory_status( MemoryStatus& ms );
+
+  //
+  // Adjusts the size of the Buffer (and therefore its eviction water marks)
+  // as the memory available to the process changes.  The buffer is shrunk
+  // when PSI memory pressure rises or usage closes in on the cgroup limit,
+  // and grown back towards its configured size when memory frees up.  The
+  // configured size is read on every check, so that it follows
+  // umapcfg_set_max_pages_in_buffer().
+  //
+  class MemoryController : public WorkerPool {
+    public:
+      MemoryController( void );
+      ~MemoryController( void );
+
+    private:
+      RegionManager& m_rm;
+      uint64_t       m_page_size;
+      uint64_t       m_interval_ms;
+      uint64_t       m_pressure_threshold;  // PSI some avg10 percent
+      uint64_t       m_headroom_percent;  // Of the limit to leave unused
+      int            m_trigger_fd;        // PSI trigger, or -1
+      int            m_pipe[2];
+
+      void open_pressure_trigger( void );
+      static uint64_t min_buffer_pages( uint64_t max_pages );
+      uint64_t target_pages( const MemoryStatus& ms, uint64_t cur_pages,
+                             uint64_t min_pages, uint64_t max_pages );
+      void adjust( void );
+      void monitor( void );
+      void ThreadEntry( void );
+  };
+} // end of namespace Umap
+#endif // _UMAP_MemoryController_HPP
@@ -7,6 +7,8 @@
 #ifndef _UMAP_PageDescriptor_HPP
 #define _UMAP_PageDescriptor_HPP
 
+#include <chrono>
+#include <cstdint>
 #include <iostream>
 #include <string>
 
@@ -22,6 +24,11 @@ namespace Umap {
     bool              deferred;
     bool              data_present;
     int               spurious_count;
+    uint64_t          size;           // Bytes, the page size of the region
+    PageDescriptor*   busy_prev;      // Links of the buffer's busy list
+    PageDescriptor*   busy_next;
+    PageDescriptor*   batch_next;     // Next page of the same eviction or fill work item
+    std::chrono::steady_clock::time_point fill_queued;  // When the fault was handed to a fill worker
 
     std::string print_state( void ) const;
     void set_state_free( void );
@@ -31,6 +38,56 @@ namespace Umap {
     void set_state_leaving( void );
   };
 
+  //
+  // List of page descriptors linked through the descriptors themselves, so
+  // that one can be taken out of the middle without searching for it.
+  //
+  class PageList {
+    public:
+      PageList( void ) : m_head(nullptr), m_tail(nullptr), m_size(0), m_bytes(0) {}
+
+      uint64_t        size( void ) const  { return m_size; }
+      uint64_t        bytes( void ) const { return m_bytes; }
+      PageDescriptor* front( void ) const { return m_head; }
+      PageDescriptor* back( void ) const  { return m_tail; }
+
+      void push_front( PageDescriptor* pd ) {
+        pd->busy_prev = nullptr;
+        pd->busy_next = m_head;
+        if ( m_head )
+          m_head->busy_prev = pd;
+        else
+          m_tail = pd;
+        m_head = pd;
+        ++m_size;
+        m_bytes += pd->size;
+      }
+
+      void erase( PageDescriptor* pd ) {
+        if ( pd->busy_prev )
+          pd->busy_prev->busy_next = pd->busy_next;
+        else
+          m_head = pd->busy_next;
+
+        if ( pd->busy_next )
+          pd->busy_next->busy_prev = pd->busy_prev;
+        else
+          m_tail = pd->busy_prev;
+
+        pd->busy_prev = pd->busy_next = nullptr;
+        --m_size;
+        m_bytes -= pd->size;
+      }
+
+      void pop_back( void ) { erase(m_tail); }
+
+    private:
+      PageDescriptor* m_head;
+      PageDescriptor* m_tail;
+      uint64_t        m_size;
+      uint64_t        m_bytes;
+  };
+
   std::ostream& operator<<(std::ostream& os, const Umap::PageDescriptor::State st);
   std::ostream& operator<<(std::ostream& os, const Umap::PageDescriptor* pd);
 } // end of namespace Umap
@@ -0,0 +1,446 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include "umap/config.h"
+
+#include <algorithm>            // std::min
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>              // posix_memalign()
+#include <string.h>             // memset()
+#include <vector>
+
+#include "umap/Buffer.hpp"
+#include "umap/RegionDescriptor.hpp"
+#include "umap/RegionManager.hpp"
+#include "umap/Prefetcher.hpp"
+#include "umap/Uffd.hpp"
+#include "umap/WorkerPool.hpp"
+#include "umap/store/Store.hpp"
+#include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
+
+//
+// Opaque to C; complete once all of its chunks have been prefetched
+//
+struct umap_prefetch_request {
+  std::mutex              mutex;
+  std::condition_variable done;
+  uint64_t                pending;
+  bool                    detached;
+};
+
+namespace Umap {
+  //
+  // Largest read issued for a run of adjacent pages
+  //
+  static const uint64_t max_run_bytes = 1024 * 1024;
+
+  static uint64_t max_run_pages( uint64_t page_size )
+  {
+    return std::max((uint64_t)1, max_run_bytes / page_size);
+  }
+
+  //
+  // Cut the pages of rd from p to end into chunks of req
+  //
+  void
+  Prefetcher::add_chunks( umap_prefetch_handle req, RegionDescriptor* rd, char* p, char* end, std::vector<Chunk>& chunks )
+  {
+    uint64_t page_size = rd->page_size();
+    uint64_t max_run = max_run_pages(page_size);
+    auto now = std::chrono::steady_clock::now();
+
+    while ( p < end ) {
+      uint64_t npages = std::min((uint64_t)(end - p) / page_size, max_run);
+
+      chunks.push_back(Chunk{req, rd, p, npages, 0, now});
+      p += npages * page_size;
+    }
+  }
+
+  //
+  // Queue the chunks of req, but none of a region that is being unmapped
+  //
+  umap_prefetch_handle
+  Prefetcher::queue_chunks( umap_prefetch_handle req, std::vector<Chunk>& chunks, bool detached )
+  {
+    uint64_t queued = 0;
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+
+      for ( auto& c : chunks ) {
+        if ( c.rd->unmapping() ) {
+          c.rd->stats().prefetch_cancelled += c.npages;
+          continue;
+        }
+        chunks[queued++] = c;
+      }
+      chunks.resize(queued);
+
+      req->pending = queued;
+      req->detached = detached;
+
+      if ( detached && queued == 0 ) {
+        delete req;
+        return nullptr;
+      }
+
+      for ( auto& c : chunks ) {
+        m_queued_bytes += c.npages * c.rd->page_size();
+        c.queued_bytes = m_queued_bytes;
+        m_chunks.push_back(c);
+      }
+    }
+
+    WorkItem w = { .page_desc = nullptr, .type = Umap::WorkItem::WorkType::PREFETCH };
+
+    for ( uint64_t i = 0; i < queued; ++i )
+      send_work(w);
+
+    return detached ? nullptr : req;
+  }
+
+  umap_prefetch_handle
+  Prefetcher::submit( const umap_prefetch_range* ranges, int nranges, bool detached )
+  {
+    auto req = new umap_prefetch_request;
+    std::vector<Chunk> chunks;
+
+    for ( int i = 0; i < nranges; ++i ) {
+      char* p = (char*)ranges[i].addr;
+      char* last = p + ranges[i].length;
+
+      //
+      // One region lookup per region the range touches, not per page
+      //
+      while ( p < last ) {
+        auto rd = m_rm._containing_region(p);
+
+        if ( rd == nullptr )
+          break;
+
+        uint64_t page_size = rd->page_size();
+        char* end = std::min((char*)(((uint64_t)last + page_size - 1) & ~(page_size - 1)), rd->end());
+
+        p = (char*)((uint64_t)p & ~(page_size - 1));
+        add_chunks(req, rd, p, end, chunks);
+        p = end;
+      }
+    }
+
+    return queue_chunks(req, chunks, detached);
+  }
+
+  void
+  Prefetcher::read_ahead( RegionDescriptor* rd, char* page )
+  {
+    uint64_t page_size = rd->page_size();
+    uint64_t index = (page - rd->start()) / page_size;
+    uint64_t advice_start;
+    uint64_t window;
+    int advice = rd->advice(index, &advice_start);
+
+    switch ( advice ) {
+      case UMAP_ADV_RANDOM:
+        return;
+
+      case UMAP_ADV_SEQUENTIAL:
+        window = std::max(m_rm.get_read_ahead(), max_run_pages(page_size));
+        break;
+
+      default:
+        if ( ! m_buffer->low_threshold_reached() )
+          return;
+        window = m_rm.get_read_ahead();
+        break;
+    }
+
+    //
+    // Never ask for more than a quarter of the buffer at once
+    //
+    window = std::min(window, m_rm.get_buffer_pages() * m_rm.get_umap_page_size() / page_size / 4);
+
+    if ( window == 0 )
+      return;
+
+    //
+    // Leave a page in the middle of the window out so that the fault on it
+    // starts reading the next window while the rest of this one is used.
+    //
+    uint64_t num_pages = rd->size() / page_size;
+    uint64_t first = index + 1;
+    uint64_t marker = first + window / 2;
+    uint64_t last = std::min(first + window, num_pages);
+    std::vector<Chunk> chunks;
+
+    if ( window < 2 )
+      marker = last;
+
+    //
+    // The region is ours for as long as the page being filled is, so there
+    // is no need to look it up, or to take the RegionManager lock
+    //
+    auto req = new umap_prefetch_request;
+
+    if ( first < std::min(marker, last) )
+      add_chunks(req, rd, rd->start() + first * page_size, rd->start() + std::min(marker, last) * page_size, chunks);
+    if ( marker + 1 < last )
+      add_chunks(req, rd, rd->start() + (marker + 1) * page_size, rd->start() + last * page_size, chunks);
+    queue_chunks(req, chunks, true);
+
+    //
+    // A sequential scan will not come back for the pages it has passed, so
+    // make room for the pages ahead of it instead of the least recently
+    // filled ones.
+    //
+    if ( advice == UMAP_ADV_SEQUENTIAL && index >= window ) {
+      uint64_t hi = index - window;
+      uint64_t lo = std::max(advice_start, hi >= window ? hi - window : 0);
+
+      if ( lo < hi )
+        m_buffer->drop_pages(rd, rd->start() + lo * page_size, hi - lo, false);
+    }
+  }
+
+  void
+  Prefetcher::cancel_region( RegionDescriptor* rd )
+  {
+    std::unique_lock<std::mutex> guard(m_mutex);
+
+    for ( auto it = m_chunks.begin(); it != m_chunks.end(); ) {
+      if ( it->rd != rd ) {
+        ++it;
+        continue;
+      }
+
+      //
+      // The PREFETCH work item sent for the chunk stays queued, and the
+      // worker that takes it finds one chunk fewer
+      //
+      rd->stats().prefetch_cancelled += it->npages;
+      complete(it->req);
+      it = m_chunks.erase(it);
+    }
+
+    while ( std::find(m_running.begin(), m_running.end(), rd) != m_running.end() )
+      m_chunk_done.wait(guard);
+  }
+
+  void
+  Prefetcher::complete( umap_prefetch_handle req )
+  {
+    bool done;
+    {
+      std::lock_guard<std::mutex> guard(req->mutex);
+      done = --req->pending == 0;
+      if ( done )
+        req->done.notify_all();
+    }
+
+    if ( done && req->detached )
+      delete req;
+  }
+
+  bool
+  Prefetcher::test( umap_prefetch_handle req )
+  {
+    std::lock_guard<std::mutex> guard(req->mutex);
+    return req->pending == 0;
+  }
+
+  void
+  Prefetcher::wait( umap_prefetch_handle req )
+  {
+    {
+      std::unique_lock<std::mutex> guard(req->mutex);
+
+      while ( req->pending )
+        req->done.wait(guard);
+    }
+    delete req;
+  }
+
+  void
+  Prefetcher::fill_run( RegionDescriptor* rd, PageDescriptor** pds, uint64_t npages, char* buf )
+  {
+    uint64_t page_size = rd->page_size();
+    char* start = pds[0]->page;
+    uint64_t len = npages * page_size;
+    uint64_t offset = rd->store_offset(start);
+    auto shared = rd->shared();
+
+    UMAP_TRACE_BEGIN(FILL, start);
+
+    if ( shared != nullptr ) {
+      //
+      // Other processes may have read some of these pages already
+      //
+      for ( uint64_t i = 0; i < npages; ++i ) {
+        uint64_t page_offset = offset + i * page_size;
+
+        if ( shared->acquire(page_offset / page_size) ) {
+          char* dst = rd->alias(pds[i]->page);
+          ssize_t nread = rd->store()->read_from_store(dst, rd->store_length(pds[i]->page, page_size), page_offset);
+          if (nread == -1)
+            UMAP_ERROR("read_from_store failed");
+
+          if ( (uint64_t)nread < page_size )
+            memset(dst + nread, 0, page_size - nread);
+
+          shared->filled(page_offset / page_size);
+          ++rd->stats().fills;
+          rd->stats().bytes_read += nread;
+        }
+        m_uffd->continue_pages(pds[i]->page, page_size, true);
+      }
+    }
+    else {
+      char* dst = rd->shmem() ? rd->alias(start) : buf;
+
+      UMAP_TRACE_BEGIN(STORE_READ, start);
+      ssize_t nread = rd->store()->read_from_store(dst, rd->store_length(start, len), offset);
+      if (nread == -1)
+        UMAP_ERROR("read_from_store failed");
+      UMAP_TRACE_END(STORE_READ, start);
+
+      // Past the end of the region or of the file
+      if ( (uint64_t)nread < len )
+        memset(dst + nread, 0, len - nread);
+
+      rd->stats().fills += npages;
+      rd->stats().bytes_read += nread;
+
+      if ( rd->shmem() )
+        m_uffd->continue_pages(start, len, true);
+      else
+        m_uffd->copy_in_pages(buf, start, len, true);
+    }
+
+    for ( uint64_t i = 0; i < npages; ++i )
+      pds[i]->data_present = true;
+
+    m_buffer->mark_pages_as_present(pds, npages);
+    UMAP_TRACE_END(FILL, start);
+  }
+
+  void
+  Prefetcher::prefetch_chunk( const Chunk& chunk, char* buf )
+  {
+    std::vector<PageDescriptor*> pds(chunk.npages);
+    char* p = chunk.start;
+    uint64_t left = chunk.npages;
+
+    while ( left ) {
+      m_buffer->wait_for_demand_fills();
+
+      uint64_t n = m_buffer->claim_pages(chunk.rd, p, left, &pds[0]);
+
+      for ( uint64_t i = 0; i < n; ) {
+        if ( pds[i] == nullptr ) {
+          ++i;
+          continue;
+        }
+
+        uint64_t j = i + 1;
+        while ( j < n && pds[j] != nullptr )
+          ++j;
+
+        fill_run(chunk.rd, &pds[i], j - i, buf);
+        i = j;
+      }
+
+      p += n * chunk.rd->page_size();
+      left -= n;
+    }
+  }
+
+  void
+  Prefetcher::PrefetchWorker( void )
+  {
+    char* buf = nullptr;
+    uint64_t buf_size = 0;
+
+    while ( 1 ) {
+      auto w = get_work();
+
+      if ( w.type == Umap::WorkItem::WorkType::EXIT )
+        break;    // Time to leave
+
+      Chunk chunk;
+      bool stale;
+      {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        // The chunk was cancelled along with its region
+        if ( m_chunks.empty() )
+          continue;
+
+        chunk = m_chunks.front();
+        m_chunks.pop_front();
+        m_running.push_back(chunk.rd);
+        stale = m_queued_bytes - chunk.queued_bytes
+                  > m_rm.get_buffer_pages() * m_rm.get_umap_page_size();
+      }
+
+      //
+      // Runs are up to max_run_bytes long, or a single page if larger
+      //
+      uint64_t need = chunk.npages * chunk.rd->page_size();
+
+      if ( need > buf_size ) {
+        free(buf);
+        buf_size = std::max(need, max_run_bytes);
+        if (posix_memalign((void**)&buf, m_rm.get_system_page_size(), buf_size))
+          UMAP_ERROR("posix_memalign failed to allocated "
+              << buf_size << " bytes of memory");
+      }
+
+      if ( stale ) {
+        chunk.rd->stats().prefetch_cancelled += chunk.npages;
+      }
+      else {
+        prefetch_chunk(chunk, buf);
+
+        ++chunk.rd->stats().prefetch_fills;
+        chunk.rd->stats().prefetch_fill_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                std::chrono::steady_clock::now() - chunk.submitted).count();
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_running.erase(std::find(m_running.begin(), m_running.end(), chunk.rd));
+        m_chunk_done.notify_all();
+      }
+
+      complete(chunk.req);
+    }
+
+    free(buf);
+  }
+
+  void
+  Prefetcher::ThreadEntry( void )
+  {
+    PrefetchWorker();
+  }
+
+  Prefetcher::Prefetcher( void )
+    :   WorkerPool("Prefetchers", RegionManager::getInstance().get_num_prefetchers())
+      , m_rm(RegionManager::getInstance())
+      , m_buffer(m_rm.get_buffer_h())
+      , m_uffd(m_rm.get_uffd_h())
+      , m_queued_bytes(0)
+  {
+    set_cpus(m_rm.get_filler_cpus());
+    start_thread_pool();
+  }
+
+  Prefetcher::~Prefetcher( void )
+  {
+    stop_thread_pool();
+  }
+} // end of namespace Umap
@@ -0,0 +1,96 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_Prefetcher_HPP
+#define _UMAP_Prefetcher_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "umap/WorkerPool.hpp"
+#include "umap/umap.h"
+
+namespace Umap {
+  class Buffer;
+  class RegionDescriptor;
+  class RegionManager;
+  class Uffd;
+
+  //
+  // Fills pages ahead of use on behalf of umap_prefetch_async().  Ranges
+  // are cut into chunks of up to 1MiB (or a single larger page) that the
+  // prefetch threads take in turn.  The pages of a chunk that are not in
+  // the buffer yet are claimed together, read from the store with one read
+  // per run of adjacent pages, and placed with one ioctl per run.
+  //
+  // Faults come first: no pages are claimed while the fill workers have
+  // faults to fill.  A chunk with more than a buffer's worth of prefetch
+  // requested after it is dropped, as its pages would be evicted again
+  // by the later ones before they were used.
+  //
+  class Prefetcher : public WorkerPool {
+    public:
+      Prefetcher( void );
+      ~Prefetcher( void );
+
+      //
+      // A detached request is freed once it completes and must not be
+      // tested or waited for; submit() then returns nullptr.  The caller
+      // holds the RegionManager lock, so that the regions the ranges fall
+      // in stay mapped until their chunks are queued.
+      //
+      umap_prefetch_handle submit( const umap_prefetch_range* ranges, int nranges, bool detached = false );
+      bool test( umap_prefetch_handle req );
+      void wait( umap_prefetch_handle req );   // Also frees req
+
+      //
+      // Called once page of rd has been filled for a fault.  Reads ahead
+      // as the advice for the page asks, and for UMAP_ADV_SEQUENTIAL evicts
+      // the pages well behind it.
+      //
+      void read_ahead( RegionDescriptor* rd, char* page );
+
+      //
+      // Called once rd is marked as being unmapped, before its pages are
+      // evicted.  Drops the chunks of rd still queued, completing their
+      // requests, and waits for those being prefetched.  No more are
+      // queued for rd from then on.
+      //
+      void cancel_region( RegionDescriptor* rd );
+
+    private:
+      struct Chunk {
+        umap_prefetch_handle req;
+        RegionDescriptor*    rd;
+        char*                start;
+        uint64_t             npages;
+        uint64_t             queued_bytes;  // m_queued_bytes once it was queued
+        std::chrono::steady_clock::time_point submitted;
+      };
+
+      RegionManager&    m_rm;
+      Buffer*           m_buffer;
+      Uffd*             m_uffd;
+      std::mutex        m_mutex;
+      std::deque<Chunk> m_chunks;
+      uint64_t          m_queued_bytes;   // Of all chunks ever queued
+      std::vector<RegionDescriptor*> m_running;   // Regions of chunks being prefetched
+      std::condition_variable        m_chunk_done;
+
+      void add_chunks( umap_prefetch_handle req, RegionDescriptor* rd, char* p, char* end, std::vector<Chunk>& chunks );
+      umap_prefetch_handle queue_chunks( umap_prefetch_handle req, std::vector<Chunk>& chunks, bool detached );
+      void complete( umap_prefetch_handle req );
+      void PrefetchWorker( void );
+      void ThreadEntry( void );
+      void prefetch_chunk( const Chunk& chunk, char* buf );
+      void fill_run( RegionDescriptor* rd, PageDescriptor** pds, uint64_t npages, char* buf );
+  };
+} // end of namespace Umap
+#endif // _UMAP_Prefetcher_HPP
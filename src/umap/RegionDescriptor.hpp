@@ -7,27 +7,108 @@
 #ifndef _UMAP_RegionDescriptor_HPP
 #define _UMAP_RegionDescriptor_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <map>
+#include <mutex>
 #include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <unordered_set>
 
 #include "umap/PageDescriptor.hpp"
+#include "umap/SharedPages.hpp"
+#include "umap/umap.h"
 #include "umap/store/Store.hpp"
 #include "umap/util/Macros.hpp"
 
 namespace Umap {
+  //
+  // Counters are updated by the fault, fill, and evict threads without
+  // holding any lock and may be read at any time.
+  //
+  struct RegionStats {
+    RegionStats() :   faults(0), write_faults(0), fills(0), evictions(0)
+                    , write_backs(0), bytes_read(0), bytes_written(0)
+                    , resident_pages(0), stalls(0), stall_ns(0), shootdowns(0)
+                    , demand_fills(0), demand_fill_ns(0), prefetch_fills(0)
+                    , prefetch_fill_ns(0), prefetch_cancelled(0)
+    {
+      for ( int i = 0; i < UMAP_STALL_BUCKETS; ++i )
+        stall_hist[i] = 0;
+    };
+
+    //
+    // A fault waited ns nanoseconds for room in the buffer
+    //
+    void record_stall( uint64_t ns ) {
+      uint64_t us = ns / 1000;
+      int bucket = 0;
+
+      while ( us > 1 && bucket < UMAP_STALL_BUCKETS - 1 ) {
+        us >>= 1;
+        ++bucket;
+      }
+
+      ++stalls;
+      stall_ns += ns;
+      ++stall_hist[bucket];
+    }
+
+    std::atomic<uint64_t> faults;
+    std::atomic<uint64_t> write_faults;
+    std::atomic<uint64_t> fills;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> write_backs;
+    std::atomic<uint64_t> bytes_read;
+    std::atomic<uint64_t> bytes_written;
+    std::atomic<uint64_t> resident_pages;
+    std::atomic<uint64_t> stalls;
+    std::atomic<uint64_t> stall_ns;
+    std::atomic<uint64_t> stall_hist[UMAP_STALL_BUCKETS];
+    std::atomic<uint64_t> shootdowns;
+    std::atomic<uint64_t> demand_fills;
+    std::atomic<uint64_t> demand_fill_ns;
+    std::atomic<uint64_t> prefetch_fills;
+    std::atomic<uint64_t> prefetch_fill_ns;
+    std::atomic<uint64_t> prefetch_cancelled;
+  };
+
   class RegionDescriptor {
     public:
       RegionDescriptor(   char* umap_region, uint64_t umap_size
                         , char* mmap_region, uint64_t mmap_size
-                        , Store* store )
+                        , Store* store, int prot, uint64_t page_size
+                        , uint64_t data_size )
         : m_umap_region(umap_region), m_umap_region_size(umap_size)
+        , m_page_size(page_size), m_data_size(data_size)
         , m_mmap_region(mmap_region), m_mmap_region_size(mmap_size)
-        , m_store(store) {}
+        , m_store(store), m_numa_node(-1), m_prot(prot)
+        , m_memfd(-1), m_alias(nullptr), m_shared(nullptr)
+        , m_unmapping(false), m_advising(0), m_have_advice(false) {}
+
+      ~RegionDescriptor( void ) {
+        //
+        // Truncating the memfd frees whatever pages are still in it and
+        // unmaps them from the region.  Pages shared with other processes
+        // are only unmapped here and left for the last of them to free.
+        //
+        if ( m_shared != nullptr ) {
+          madvise(m_umap_region, m_umap_region_size, MADV_DONTNEED);
+          delete m_shared;
+        }
+        else if ( m_memfd != -1 ) {
+          (void) ftruncate(m_memfd, 0);
+        }
 
-      ~RegionDescriptor( void ) {}
+        if ( m_memfd != -1 ) {
+          munmap(m_alias, m_umap_region_size);
+          close(m_memfd);
+        }
+      }
 
       inline uint64_t store_offset( char* addr ) {
         assert("Invalid address for calculating offset" && addr >= start() && addr < end());
@@ -35,40 +116,146 @@ namespace Umap {
       }
 
       inline uint64_t size( void )     { return m_umap_region_size;         }
+      inline uint64_t page_size( void ) { return m_page_size;               }
+
+      //
+      // The region is a whole number of pages, but only the length it was
+      // mapped with is backed by the store.  The rest of the last page
+      // reads as zeros and is never written back.  Returns how many of the
+      // len bytes at addr are backed.
+      //
+      inline uint64_t store_length( char* addr, uint64_t len ) {
+        uint64_t offset = store_offset(addr);
+
+        return offset >= m_data_size ? 0 : std::min(len, m_data_size - offset);
+      }
       inline Store*   store( void )    { return m_store;                    }
       inline char*    start( void )    { return m_umap_region;              }
       inline char*    end( void )      { return start() + size();           }
       inline uint64_t count( void )    { return m_active_pages.size();      }
+      inline RegionStats& stats( void ) { return m_stats;                   }
+      inline int      numa_node( void ) { return m_numa_node;               }
+      inline int      prot( void )     { return m_prot;                     }
+      inline void     set_numa_node( int node ) { m_numa_node = node;       }
+
+      //
+      // A shmem region is a shared mapping of a memfd.  Fill workers write
+      // pages through a second mapping of the memfd, the alias, and then
+      // map them into the region with UFFDIO_CONTINUE.  The memfd of a
+      // UMAP_SHARED region is shared with other processes, which agree on
+      // who fills and frees its pages through shared.  The region takes
+      // ownership of memfd, alias, and shared.
+      //
+      inline void set_shmem( int memfd, char* alias, SharedPages* shared ) {
+        m_memfd = memfd;
+        m_alias = alias;
+        m_shared = shared;
+      }
+      inline SharedPages* shared( void ) { return m_shared;                }
+      inline bool     shmem( void )    { return m_memfd != -1;              }
+      inline int      memfd( void )    { return m_memfd;                    }
+      inline char*    alias( char* addr ) { return m_alias + store_offset(addr); }
 
       inline void insert_page_descriptor(PageDescriptor* pd) {
-        m_active_pages.insert(pd);
+        if ( m_active_pages.insert(pd).second )
+          ++m_stats.resident_pages;
       }
 
       inline void erase_page_descriptor(PageDescriptor* pd) {
         UMAP_LOG(Debug, "Erasing PD: " << pd);
-        m_active_pages.erase(pd);
+        if ( m_active_pages.erase(pd) )
+          --m_stats.resident_pages;
+      }
+
+      //
+      // Set once the region is being unmapped.  No more of its pages are
+      // brought in after that, be it for a prefetch or for a fault that was
+      // read before the pages were evicted.
+      //
+      inline void set_unmapping( void ) { m_unmapping.store(true);         }
+      inline bool unmapping( void )     { return m_unmapping.load();       }
+
+      //
+      // Calls to umap_advise() still dropping pages of the region, which
+      // must not be freed until they are done.  Kept under the
+      // RegionManager lock.
+      //
+      inline void begin_advise( void )  { ++m_advising;                    }
+      inline void end_advise( void )    { --m_advising;                    }
+      inline bool advising( void )      { return m_advising != 0;          }
+
+      //
+      // Access advice (UMAP_ADV_*) is kept per range of pages, by page
+      // index within the region.  UMAP_ADV_NORMAL is never stored as such;
+      // it is what pages without other advice get.
+      //
+      void set_advice( uint64_t first, uint64_t last, int advice ) {
+        std::lock_guard<std::mutex> guard(m_advice_mutex);
+        uint64_t unused;
+        int after = _advice(last, &unused);
+
+        m_advice.erase(m_advice.lower_bound(first), m_advice.lower_bound(last));
+        m_advice[first] = advice;
+        m_advice[last] = after;
+        m_have_advice = true;
       }
 
-      inline PageDescriptor* get_next_page_descriptor( void ) {
-        if ( m_active_pages.size() == 0 )
-          return nullptr;
+      //
+      // Returns the advice for page and the first page of the range it
+      // was given for.
+      //
+      int advice( uint64_t page, uint64_t* first ) {
+        if ( ! m_have_advice ) {
+          *first = 0;
+          return UMAP_ADV_NORMAL;
+        }
 
-        auto it = m_active_pages.begin();
-        auto rval = *it;
-        rval->deferred = false;
-        erase_page_descriptor(rval);
+        std::lock_guard<std::mutex> guard(m_advice_mutex);
+        return _advice(page, first);
+      }
 
-        return rval;
+      //
+      // Pages of the region in the buffer, for the Buffer to walk with its
+      // lock held
+      //
+      inline const std::unordered_set<PageDescriptor*>& page_descriptors( void ) {
+        return m_active_pages;
       }
 
     private:
       char*    m_umap_region;
       uint64_t m_umap_region_size;
+      uint64_t m_page_size;
+      uint64_t m_data_size;       // Length mapped, up to size()
       char*    m_mmap_region;
       uint64_t m_mmap_region_size;
       Store*   m_store;
+      RegionStats m_stats;
+      int      m_numa_node;       // Node to fill pages on, -1 for faulter's
+      int      m_prot;
+      int      m_memfd;
+      char*    m_alias;
+      SharedPages* m_shared;
+      std::atomic<bool> m_unmapping;
+      uint64_t m_advising;
 
       std::unordered_set<PageDescriptor*> m_active_pages;
+
+      std::mutex              m_advice_mutex;
+      std::map<uint64_t, int> m_advice;   // First page of range -> advice
+      std::atomic<bool>       m_have_advice;
+
+      int _advice( uint64_t page, uint64_t* first ) {
+        auto it = m_advice.upper_bound(page);
+
+        if ( it == m_advice.begin() ) {
+          *first = 0;
+          return UMAP_ADV_NORMAL;
+        }
+        --it;
+        *first = it->first;
+        return it->second;
+      }
   };
 } // end of namespace Umap
 #endif // _UMAP_RegionDescripto_HPP
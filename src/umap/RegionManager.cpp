@@ -6,6 +6,7 @@
 //////////////////////////////////////////////////////////////////////////////
 #include "umap/config.h"
 
+#include <algorithm>      // find()
 #include <cstdint>        // uint64_t
 #include <fstream>        // for reading meminfo
 #include <mutex>
@@ -14,15 +15,20 @@
 #include <string>         // string to integer operations
 #include <thread>         // for max_concurrency
 #include <unordered_map>
+#include <sched.h>        // CPU_SETSIZE
 #include <unistd.h>       // sysconf()
 
 #include "umap/Buffer.hpp"
 #include "umap/EvictManager.hpp"
 #include "umap/FillWorkers.hpp"
+#include "umap/MemoryController.hpp"
+#include "umap/Prefetcher.hpp"
 #include "umap/RegionManager.hpp"
 #include "umap/RegionDescriptor.hpp"
+#include "umap/StatsServer.hpp"
 #include "umap/store/Store.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Numa.hpp"
 
 namespace Umap {
 
@@ -35,22 +41,69 @@ RegionManager::getInstance( void )
 }
 
 void
-RegionManager::addRegion(Store* store, char* region, uint64_t region_size, char* mmap_region, uint64_t mmap_region_size)
+RegionManager::addRegion(Store* store, char* region, uint64_t region_size, char* mmap_region, uint64_t mmap_region_size, int prot, uint64_t page_size, uint64_t data_size, int memfd, char* alias, SharedPages* shared)
 {
-  std::lock_guard<std::mutex> lock(m_mutex);
+  RegionDescriptor* stale = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
 
-  auto rd = new RegionDescriptor(region, region_size, mmap_region, mmap_region_size, store);
-  const auto active_region = m_active_regions.find((void*)region);
-  if (active_region != m_active_regions.cend()) {
-    _removeRegion(region);
+    const auto active_region = m_active_regions.find((void*)region);
+    if (active_region != m_active_regions.cend()) {
+      stale = _removeRegion(region);
+    }
   }
 
+  if ( stale != nullptr )
+    retire_region(stale);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto rd = new RegionDescriptor(region, region_size, mmap_region, mmap_region_size, store, prot, page_size, data_size);
+  if ( memfd != -1 )
+    rd->set_shmem(memfd, alias, shared);
+
   if ( !m_uffd ) {
     UMAP_LOG(Debug, "No active regions, initializing engine");
     m_buffer = new Buffer();
     m_uffd = new Uffd();
-    m_fill_workers = new FillWorkers();
+
+    //
+    // With more than one node, each node gets its own fill workers and
+    // faults are routed to the node of the faulting thread.  Faults whose
+    // node cannot be determined go to the first pool.
+    //
+    if ( m_numa_aware && numa::num_nodes() > 1 ) {
+      uint64_t per_node = m_num_fillers / numa::num_nodes();
+
+      for ( int n = 0; n < numa::num_nodes(); ++n ) {
+        std::vector<int> cpus;
+
+        for ( auto c : numa::node_cpus(n) )
+          if ( m_filler_cpus.empty() || std::find(m_filler_cpus.begin(), m_filler_cpus.end(), c) != m_filler_cpus.end() )
+            cpus.push_back(c);
+
+        if ( cpus.empty() ) {
+          m_node_fill_workers.push_back(nullptr);
+          continue;
+        }
+        m_node_fill_workers.push_back(new FillWorkers(n, per_node ? per_node : 1, cpus));
+        if ( m_fill_workers == nullptr )
+          m_fill_workers = m_node_fill_workers.back();
+      }
+    }
+    else {
+      if ( m_numa_aware )
+        UMAP_LOG(Info, "Only one NUMA node, ignoring UMAP_NUMA_AWARE");
+      m_fill_workers = new FillWorkers();
+    }
     m_evict_manager = new EvictManager();
+    m_prefetcher = new Prefetcher();
+
+    if ( ! m_stats_socket.empty() )
+      m_stats_server = new StatsServer(m_stats_socket);
+
+    if ( m_memory_controller_enabled )
+      m_memory_controller = new MemoryController();
   }
 
   m_active_regions[(void*)region] = rd;
@@ -65,7 +118,11 @@ RegionManager::addRegion(Store* store, char* region, uint64_t region_size, char*
   m_last_iter = m_active_regions.end();
 }
 
-void RegionManager::_removeRegion( char* region ) {
+//
+// Takes the region out of service and returns it, to be handed to
+// retire_region() once the lock is dropped
+//
+RegionDescriptor* RegionManager::_removeRegion( char* region ) {
   auto it = m_active_regions.find(region);
 
   if (it == m_active_regions.end())
@@ -77,9 +134,19 @@ void RegionManager::_removeRegion( char* region ) {
                       << ", number of regions: " << m_active_regions.size()
   );
 
-  m_uffd->unregister_region(it->second);
+  //
+  // Neither prefetches nor faults of the region may bring pages in once
+  // they have been evicted, and none of its prefetches may still be running
+  //
+  auto rd = it->second;
+
+  rd->set_unmapping();
+
+  if ( m_prefetcher != nullptr )
+    m_prefetcher->cancel_region(rd);
+
+  m_uffd->unregister_region(rd);
 
-  delete it->second;
   m_active_regions.erase(it);
 
   m_last_iter = m_active_regions.end();
@@ -92,13 +159,38 @@ void RegionManager::_removeRegion( char* region ) {
 //    delete m_uffd; m_uffd = nullptr;
 //    delete m_buffer; m_buffer = nullptr;
 //  }
+
+  return rd;
+}
+
+//
+// The uffd thread may still be handing faults it looked the region up for
+// to the buffer.  They are dropped, as the region is being unmapped, but the
+// region has to stay around until the uffd thread is done with them, as do
+// calls to advise() dropping its pages.
+//
+void
+RegionManager::retire_region( RegionDescriptor* rd )
+{
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_advise_done.wait(lock, [rd] { return ! rd->advising(); });
+  }
+
+  m_uffd->wait_for_dispatch();
+  delete rd;
 }
 
 void
 RegionManager::removeRegion( char* region )
 {
-  std::lock_guard<std::mutex> lock(m_mutex);
-  _removeRegion(region);
+  RegionDescriptor* rd;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    rd = _removeRegion(region);
+  }
+
+  retire_region(rd);
 }
 
 int 
@@ -111,11 +203,202 @@ RegionManager::flush_buffer(){
   return 0;
 }
 
+void
+RegionManager::fill_region_stats( RegionDescriptor* rd, umap_region_stats* stats )
+{
+  RegionStats& rs = rd->stats();
+
+  stats->region = rd->start();
+  stats->region_size = rd->size();
+  stats->faults = rs.faults;
+  stats->write_faults = rs.write_faults;
+  stats->fills = rs.fills;
+  stats->evictions = rs.evictions;
+  stats->write_backs = rs.write_backs;
+  stats->bytes_read = rs.bytes_read;
+  stats->bytes_written = rs.bytes_written;
+  stats->resident_pages = rs.resident_pages;
+  stats->page_size = rd->page_size();
+  stats->stalls = rs.stalls;
+  stats->stall_ns = rs.stall_ns;
+  for ( int i = 0; i < UMAP_STALL_BUCKETS; ++i )
+    stats->stall_hist[i] = rs.stall_hist[i];
+  stats->shootdowns = rs.shootdowns;
+  stats->demand_fills = rs.demand_fills;
+  stats->demand_fill_ns = rs.demand_fill_ns;
+  stats->prefetch_fills = rs.prefetch_fills;
+  stats->prefetch_fill_ns = rs.prefetch_fill_ns;
+  stats->prefetch_cancelled = rs.prefetch_cancelled;
+}
+
+int
+RegionManager::set_region_numa_node( char* region, int node )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto rd = _containing_region(region);
+
+  if ( rd == nullptr || node < -1 || node >= numa::num_nodes() )
+    return -1;
+
+  rd->set_numa_node(node);
+  return 0;
+}
+
+int
+RegionManager::get_region_memfd( char* addr )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto rd = _containing_region(addr);
+
+  if ( rd == nullptr )
+    return -1;
+
+  return rd->memfd();
+}
+
+int
+RegionManager::get_region_stats( char* addr, umap_region_stats* stats )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto rd = _containing_region(addr);
+
+  if ( rd == nullptr )
+    return -1;
+
+  fill_region_stats(rd, stats);
+  return 0;
+}
+
+int
+RegionManager::get_all_region_stats( umap_region_stats* stats, int max_regions )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  int i = 0;
+
+  for ( auto it : m_active_regions ) {
+    if ( i < max_regions )
+      fill_region_stats(it.second, &stats[i]);
+    ++i;
+  }
+  return i;
+}
+
 void
 RegionManager::prefetch(int npages, umap_prefetch_item* page_array)
 {
-  for (int i{0}; i < npages; ++i)
-    m_uffd->process_page(false, (char*)(page_array[i].page_base_addr));
+  std::vector<umap_prefetch_range> ranges;
+  umap_prefetch_handle handle;
+
+  //
+  // Adjacent pages make a single range so that they are read together
+  //
+  for (int i{0}; i < npages; ++i) {
+    char* page = (char*)(page_array[i].page_base_addr);
+    auto rd = containing_region(page);
+
+    if ( rd == nullptr )
+      continue;
+
+    if ( ranges.size() && (char*)ranges.back().addr + ranges.back().length == page )
+      ranges.back().length += rd->page_size();
+    else
+      ranges.push_back(umap_prefetch_range{page, rd->page_size()});
+  }
+
+  if ( prefetch_async(ranges.data(), (int)ranges.size(), &handle) == 0 )
+    prefetch_wait(handle);
+}
+
+int
+RegionManager::prefetch_async(const umap_prefetch_range* ranges, int nranges, umap_prefetch_handle* handle)
+{
+  if ( m_prefetcher == nullptr )
+    return -1;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  *handle = m_prefetcher->submit(ranges, nranges);
+  return 0;
+}
+
+int
+RegionManager::prefetch_test(umap_prefetch_handle handle)
+{
+  return m_prefetcher->test(handle) ? 1 : 0;
+}
+
+int
+RegionManager::prefetch_wait(umap_prefetch_handle handle)
+{
+  m_prefetcher->wait(handle);
+  return 0;
+}
+
+int
+RegionManager::advise(char* addr, uint64_t length, int advice)
+{
+  RegionDescriptor* rd;
+  char* first;
+  uint64_t npages;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    rd = _containing_region(addr);
+
+    if ( rd == nullptr )
+      return -1;
+
+    uint64_t page_size = rd->page_size();
+    char* last = (char*)(((uint64_t)addr + length + page_size - 1) & ~(page_size - 1));
+
+    first = (char*)((uint64_t)addr & ~(page_size - 1));
+    if ( last > rd->end() || last <= first )
+      return -1;
+
+    npages = (last - first) / page_size;
+
+    switch ( advice ) {
+      case UMAP_ADV_NORMAL:
+      case UMAP_ADV_RANDOM:
+      case UMAP_ADV_SEQUENTIAL: {
+        uint64_t first_page = (first - rd->start()) / page_size;
+
+        rd->set_advice(first_page, first_page + npages, advice);
+        return 0;
+      }
+
+      case UMAP_ADV_WILLNEED: {
+        umap_prefetch_range range = { first, (uint64_t)(last - first) };
+
+        m_prefetcher->submit(&range, 1, true);
+        return 0;
+      }
+
+      case UMAP_ADV_DONTNEED:
+        //
+        // Dropping pages blocks, so it is done without the lock.  Should
+        // the region be unmapped meanwhile, retire_region() waits for us.
+        //
+        if ( rd->unmapping() )
+          return -1;
+        rd->begin_advise();
+        break;
+
+      default:
+        return -1;
+    }
+  }
+
+  // Let read-ahead in flight land first so that it is dropped too
+  m_prefetcher->wait_for_idle();
+  m_buffer->drop_pages(rd, first, npages, true);
+  m_evict_manager->WaitAll();
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    rd->end_advise();
+  }
+  m_advise_done.notify_all();
+
+  return 0;
 }
 
 RegionManager::RegionManager()
@@ -129,24 +412,71 @@ RegionManager::RegionManager()
   m_system_page_size = sysconf(_SC_PAGESIZE);
 
   const uint64_t MAX_FAULT_EVENTS = 256;
+  m_max_pages_in_buffer = 0;
+  m_buffer_pages = 0;
+
   uint64_t env_value = 0;
   if ( (read_env_var("UMAP_MAX_FAULT_EVENTS", &env_value)) != nullptr )
     set_max_fault_events(env_value);
   else
     set_max_fault_events(MAX_FAULT_EVENTS);
 
+  //
+  // Service threads may be confined to reserved cpus so that they stay out
+  // of the way of the application.  UMAP_SERVICE_CPUS applies to every
+  // service thread that does not have a set of its own.
+  //
+  read_env_cpus("UMAP_SERVICE_CPUS", m_service_cpus);
+  if ( ! read_env_cpus("UMAP_FILLER_CPUS", m_filler_cpus) )
+    m_filler_cpus = m_service_cpus;
+  if ( ! read_env_cpus("UMAP_EVICTOR_CPUS", m_evictor_cpus) )
+    m_evictor_cpus = m_service_cpus;
+  if ( ! read_env_cpus("UMAP_UFFD_CPUS", m_uffd_cpus) )
+    m_uffd_cpus = m_service_cpus;
+  if ( ! read_env_cpus("UMAP_EVICT_MANAGER_CPUS", m_evict_manager_cpus) )
+    m_evict_manager_cpus = m_service_cpus;
+
   unsigned int nthreads = std::thread::hardware_concurrency();
   nthreads = (nthreads == 0) ? 16 : nthreads;
 
+  //
+  // There is no point in running more fillers or evictors than there are
+  // cpus for them to run on.
+  //
   if ( (read_env_var("UMAP_PAGE_FILLERS", &env_value)) != nullptr )
     set_num_fillers(env_value);
   else
-    set_num_fillers(nthreads);
+    set_num_fillers(m_filler_cpus.empty() ? nthreads : m_filler_cpus.size());
 
   if ( (read_env_var("UMAP_PAGE_EVICTORS", &env_value)) != nullptr )
     set_num_evictors(env_value);
   else
-    set_num_evictors(nthreads);
+    set_num_evictors(m_evictor_cpus.empty() ? nthreads : m_evictor_cpus.size());
+
+  //
+  // Fillers and evictors may be elastic: each pool then keeps at least its
+  // minimum number of threads and adds more, up to the numbers above, as
+  // work backs up.  Threads idle for longer than the timeout go away.
+  //
+  if ( (read_env_var("UMAP_PAGE_FILLERS_MIN", &env_value)) != nullptr )
+    m_min_fillers = std::min(env_value, m_num_fillers);
+  else
+    m_min_fillers = m_num_fillers;
+
+  if ( (read_env_var("UMAP_PAGE_EVICTORS_MIN", &env_value)) != nullptr )
+    m_min_evictors = std::min(env_value, m_num_evictors);
+  else
+    m_min_evictors = m_num_evictors;
+
+  if ( (read_env_var("UMAP_POOL_IDLE_TIMEOUT", &env_value)) != nullptr )
+    m_pool_idle_timeout = env_value;
+  else
+    m_pool_idle_timeout = 1000;
+
+  if ( (read_env_var("UMAP_PREFETCH_THREADS", &env_value)) != nullptr )
+    m_num_prefetchers = env_value;
+  else
+    m_num_prefetchers = 2;
 
   if ( (read_env_var("UMAP_EVICT_HIGH_WATER_THRESHOLD", &env_value)) != nullptr )
     set_evict_high_water_threshold(env_value);
@@ -158,11 +488,28 @@ RegionManager::RegionManager()
   else
     set_evict_low_water_threshold(70);
 
+  //
+  // Minimum percentage of the buffer to keep free for new pages; the gap
+  // above the high water mark is always kept free.
+  //
+  if ( (read_env_var("UMAP_EVICT_RESERVE", &env_value)) != nullptr )
+    m_evict_reserve = env_value < 100 ? env_value : 99;
+  else
+    m_evict_reserve = 0;
+
   if ( (read_env_var("UMAP_PAGESIZE", &env_value)) != nullptr )
     set_umap_page_size(env_value);
   else
     set_umap_page_size(m_system_page_size);
 
+  //
+  // The memory controller resizes the buffer at run time, between its
+  // configured size and a small fraction of it, according to cgroup limits
+  // and memory pressure.  When on, it also caps the buffer to the cgroup
+  // limit, so it must be known before the buffer is sized.
+  //
+  m_memory_controller_enabled = (read_env_var("UMAP_MEMORY_CONTROLLER", &env_value) != nullptr);
+
   if ( (read_env_var("UMAP_BUFSIZE", &env_value)) != nullptr )
     set_max_pages_in_buffer(env_value);
   else
@@ -172,17 +519,65 @@ RegionManager::RegionManager()
     set_read_ahead(env_value);
   else
     set_read_ahead(0);
+
+  //
+  // The elevator: hold faults while the fill workers are busy, sort them
+  // by offset, and fill runs that are close together with one read
+  //
+  if ( (read_env_var("UMAP_FILL_WINDOW", &env_value)) != nullptr )
+    m_fill_window = env_value;
+  else
+    m_fill_window = 0;
+
+  if ( (read_env_var("UMAP_FILL_MERGE_GAP", &env_value)) != nullptr )
+    m_fill_merge_gap = env_value;
+  else
+    m_fill_merge_gap = 0;
+
+  //
+  // An optional Unix socket that umapstat may poll for live statistics.  Any
+  // "%p" in the name is replaced with the process id.
+  //
+  char* sock = getenv("UMAP_STATS_SOCKET");
+  if ( sock != nullptr ) {
+    m_stats_socket = sock;
+
+    auto pos = m_stats_socket.find("%p");
+    if ( pos != std::string::npos )
+      m_stats_socket.replace(pos, 2, std::to_string(getpid()));
+  }
+
+  m_numa_aware = (read_env_var("UMAP_NUMA_AWARE", &env_value) != nullptr);
+  m_uffd_move_disabled = (read_env_var("UMAP_DISABLE_UFFD_MOVE", &env_value) != nullptr);
+  m_shmem_regions = (read_env_var("UMAP_SHMEM_REGIONS", &env_value) != nullptr);
+  m_dirty_scan = (read_env_var("UMAP_DIRTY_SCAN", &env_value) != nullptr);
+
+  if ( (read_env_var("UMAP_MEMORY_CONTROLLER_INTERVAL", &env_value)) != nullptr )
+    m_memory_controller_interval = env_value;
+  else
+    m_memory_controller_interval = 1000;
+
+  if ( (read_env_var("UMAP_MEMORY_PRESSURE_THRESHOLD", &env_value)) != nullptr )
+    m_memory_pressure_threshold = env_value;
+  else
+    m_memory_pressure_threshold = 10;
+
+  if ( (read_env_var("UMAP_MEMORY_HEADROOM", &env_value)) != nullptr )
+    m_memory_headroom = env_value < 100 ? env_value : 99;
+  else
+    m_memory_headroom = 10;
 }
 
 uint64_t
 RegionManager::get_max_pages_in_memory( void )
 {
   static uint64_t total_mem_kb = 0;
+  static bool have_total_mem = false;
   const uint64_t oneK = 1024;
   const uint64_t percent = 90;  // 90% of available memory
 
   // Lazily set total_mem_kb global
-  if ( ! total_mem_kb ) {
+  if ( ! have_total_mem ) {
     std::string token;
     std::ifstream file("/proc/meminfo");
     while (file >> token) {
@@ -197,6 +592,17 @@ RegionManager::get_max_pages_in_memory( void )
       // ignore rest of the line
       file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
     }
+
+    //
+    // When the memory controller is on, the cgroup limit is what it sizes
+    // the buffer against, so never plan on more than that limit.  Usage is
+    // left out: it includes page cache, which the kernel will reclaim.
+    //
+    uint64_t limit;
+    if ( m_memory_controller_enabled && read_cgroup_limit(limit) && limit / oneK < total_mem_kb )
+      total_mem_kb = limit / oneK;
+
+    have_total_mem = true;
   }
   return ( ((total_mem_kb / (get_umap_page_size() / oneK)) * percent) / 100 );
 }
@@ -205,7 +611,8 @@ void
 RegionManager::set_max_pages_in_buffer( uint64_t max_pages )
 {
   uint64_t max_pages_in_mem = get_max_pages_in_memory();
-  uint64_t old_max_pages_in_buffer = get_max_pages_in_buffer();
+  uint64_t old_max_pages_in_buffer;
+  Buffer* buffer;
 
   if ( max_pages > max_pages_in_mem ) {
     UMAP_ERROR("Cannot set maximum pages to "
@@ -214,7 +621,27 @@ RegionManager::set_max_pages_in_buffer( uint64_t max_pages )
         << max_pages_in_mem);
   }
 
-  m_max_pages_in_buffer = max_pages;
+  std::lock_guard<std::mutex> resizing(m_resize_mutex);
+
+  //
+  // The first umap() creates the buffer, sized from m_max_pages_in_buffer,
+  // under m_mutex.  Either it sees the new size or we see its buffer.
+  //
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    old_max_pages_in_buffer = m_max_pages_in_buffer;
+    m_max_pages_in_buffer = max_pages;
+    m_buffer_pages = max_pages;
+    buffer = m_buffer;
+  }
+
+  //
+  // Once the engine is running, the buffer is resized in place.  This may
+  // block until enough pages have been evicted, so it is not done under
+  // m_mutex.
+  //
+  if ( buffer != nullptr )
+    buffer->resize(max_pages);
 
   UMAP_LOG(Debug,
     "Maximum pages in page buffer changed from "
@@ -222,6 +649,30 @@ RegionManager::set_max_pages_in_buffer( uint64_t max_pages )
     << " to " << get_max_pages_in_buffer() << " pages");
 }
 
+//
+// Used by the memory controller to resize the buffer within the maximum set
+// by the application, which is left as it is.
+//
+void
+RegionManager::resize_buffer( uint64_t pages )
+{
+  Buffer* buffer;
+  std::lock_guard<std::mutex> resizing(m_resize_mutex);
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The maximum may have been lowered since the caller looked at it
+    if ( pages > m_max_pages_in_buffer )
+      pages = m_max_pages_in_buffer;
+    m_buffer_pages = pages;
+    buffer = m_buffer;
+  }
+
+  if ( buffer != nullptr )
+    buffer->resize(pages);
+}
+
 void
 RegionManager::set_read_ahead(uint64_t num_pages)
 {
@@ -267,11 +718,37 @@ RegionManager::read_env_var( const char* env, uint64_t*  val )
   return nullptr;
 }
 
+bool
+RegionManager::read_env_cpus( const char* env, std::vector<int>& cpus )
+{
+  char* val = getenv(env);
+
+  if ( val == nullptr || *val == '\0' )
+    return false;
+
+  cpus = numa::parse_cpulist(val);
+
+  long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  for ( auto c : cpus )
+    if ( c >= ncpus || c >= CPU_SETSIZE )
+      UMAP_ERROR(env << ": cpu " << c << " does not exist");
+
+  if ( cpus.empty() )
+    UMAP_ERROR(env << ": invalid cpu list \"" << val << "\"");
+
+  return true;
+}
+
 RegionDescriptor*
 RegionManager::containing_region( char* vaddr )
 {
   std::lock_guard<std::mutex> lock(m_mutex);
+  return _containing_region(vaddr);
+}
 
+RegionDescriptor*
+RegionManager::_containing_region( char* vaddr )
+{
   //
   // Since the list of pages coming in are usually sorted, we have a special
   // check here to see if the region found for the previous check will work.
@@ -7,9 +7,13 @@
 #ifndef _UMAP_RegionManager_HPP
 #define _UMAP_RegionManager_HPP
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <mutex>
 #include <map>
+#include <string>
+#include <vector>
 
 #include "umap/Buffer.hpp"
 #include "umap/EvictManager.hpp"
@@ -22,6 +26,9 @@
 namespace Umap {
 class FillWorkers;
 class EvictManager;
+class MemoryController;
+class Prefetcher;
+class StatsServer;
 
 struct Version {
   int major;
@@ -51,44 +58,116 @@ class RegionManager {
         , uint64_t region_size
         , char*    mmap_region
         , uint64_t mmap_region_size
+        , int      prot
+        , uint64_t page_size
+        , uint64_t data_size
+        , int      memfd = -1
+        , char*    alias = nullptr
+        , SharedPages* shared = nullptr
     );
 
     int flush_buffer();
     void prefetch(int npages, umap_prefetch_item* page_array);
+    int prefetch_async(const umap_prefetch_range* ranges, int nranges, umap_prefetch_handle* handle);
+    int prefetch_test(umap_prefetch_handle handle);
+    int prefetch_wait(umap_prefetch_handle handle);
+    int advise(char* addr, uint64_t length, int advice);
     void removeRegion( char* region );
+    int get_region_stats( char* addr, umap_region_stats* stats );
+    int get_all_region_stats( umap_region_stats* stats, int max_regions );
     Version  get_umap_version( void ) { return m_version; }
     long     get_system_page_size( void ) { return m_system_page_size; }
     uint64_t get_max_pages_in_buffer( void ) { return m_max_pages_in_buffer; }
+    void set_max_pages_in_buffer( uint64_t max_pages );
+    uint64_t get_buffer_pages( void ) { return m_buffer_pages; }
+    void resize_buffer( uint64_t pages );
+    uint64_t get_max_pages_in_memory( void );
     uint64_t get_read_ahead( void ) { return m_read_ahead; }
     uint64_t get_umap_page_size( void ) { return m_umap_page_size; }
     uint64_t get_num_fillers( void ) { return m_num_fillers; }
     uint64_t get_num_evictors( void ) { return m_num_evictors; }
+    uint64_t get_min_fillers( void ) { return m_min_fillers; }
+    uint64_t get_min_evictors( void ) { return m_min_evictors; }
+    uint64_t get_pool_idle_timeout( void ) { return m_pool_idle_timeout; }
+    uint64_t get_num_prefetchers( void ) { return m_num_prefetchers; }
     int get_evict_low_water_threshold( void ) { return m_evict_low_water_threshold; }
     int get_evict_high_water_threshold( void ) { return m_evict_high_water_threshold; }
+    int get_evict_reserve( void ) { return m_evict_reserve; }
     uint64_t get_max_fault_events( void ) { return m_max_fault_events; }
+    uint64_t get_fill_window( void ) { return m_fill_window; }
+    uint64_t get_fill_merge_gap( void ) { return m_fill_merge_gap; }
+    const std::string& get_stats_socket( void ) { return m_stats_socket; }
+    uint64_t get_memory_controller_interval( void ) { return m_memory_controller_interval; }
+    uint64_t get_memory_pressure_threshold( void ) { return m_memory_pressure_threshold; }
+    uint64_t get_memory_headroom( void ) { return m_memory_headroom; }
     Buffer* get_buffer_h() { return m_buffer; }
     Uffd* get_uffd_h() { return m_uffd; }
-    FillWorkers* get_fill_workers_h() { return m_fill_workers; }
+    Prefetcher* get_prefetcher_h() { return m_prefetcher; }
+    FillWorkers* get_fill_workers_h( int node = -1 ) {
+      if ( node >= 0 && node < (int)m_node_fill_workers.size() && m_node_fill_workers[node] )
+        return m_node_fill_workers[node];
+      return m_fill_workers;
+    }
+    bool get_numa_aware( void ) { return m_numa_aware; }
+    bool get_uffd_move_disabled( void ) { return m_uffd_move_disabled; }
+    bool get_shmem_regions( void ) { return m_shmem_regions; }
+    bool get_dirty_scan( void ) { return m_dirty_scan; }
+    int get_region_memfd( char* addr );
+    const std::vector<int>& get_filler_cpus( void ) { return m_filler_cpus; }
+    const std::vector<int>& get_evictor_cpus( void ) { return m_evictor_cpus; }
+    const std::vector<int>& get_uffd_cpus( void ) { return m_uffd_cpus; }
+    const std::vector<int>& get_evict_manager_cpus( void ) { return m_evict_manager_cpus; }
+    const std::vector<int>& get_service_cpus( void ) { return m_service_cpus; }
+    int set_region_numa_node( char* region, int node );
     EvictManager* get_evict_manager() { return m_evict_manager; }
     RegionDescriptor* containing_region( char* vaddr );
+    RegionDescriptor* _containing_region( char* vaddr );   // Lock held
     uint64_t get_num_active_regions( void ) { return (uint64_t)m_active_regions.size(); }
 
   private:
     Version  m_version;
-    uint64_t m_max_pages_in_buffer;
+    std::atomic<uint64_t> m_max_pages_in_buffer;  // Written under m_mutex
+    std::atomic<uint64_t> m_buffer_pages;   // Current size, at most the above
     uint64_t m_read_ahead;
     long     m_umap_page_size;
     uint64_t m_system_page_size;
     uint64_t m_num_fillers;
     uint64_t m_num_evictors;
+    uint64_t m_min_fillers;
+    uint64_t m_min_evictors;
+    uint64_t m_pool_idle_timeout;
+    uint64_t m_num_prefetchers;
     int m_evict_low_water_threshold;
     int m_evict_high_water_threshold;
+    int m_evict_reserve;
     uint64_t m_max_fault_events;
-    Buffer* m_buffer;
+    uint64_t m_fill_window;       // Microseconds faults are held to be sorted
+    uint64_t m_fill_merge_gap;    // Pages a fill may read past to join two runs
+    Buffer* m_buffer = nullptr;
     Uffd* m_uffd = nullptr;
-    FillWorkers* m_fill_workers;
+    FillWorkers* m_fill_workers = nullptr;
+    std::vector<FillWorkers*> m_node_fill_workers;
+    bool m_numa_aware;
+    bool m_uffd_move_disabled;
+    bool m_shmem_regions;
+    bool m_dirty_scan;
+    std::vector<int> m_filler_cpus;
+    std::vector<int> m_evictor_cpus;
+    std::vector<int> m_uffd_cpus;
+    std::vector<int> m_evict_manager_cpus;
+    std::vector<int> m_service_cpus;
     EvictManager* m_evict_manager;
+    StatsServer* m_stats_server = nullptr;
+    std::string m_stats_socket;
+    MemoryController* m_memory_controller = nullptr;
+    Prefetcher* m_prefetcher = nullptr;
+    bool m_memory_controller_enabled;
+    uint64_t m_memory_controller_interval;
+    uint64_t m_memory_pressure_threshold;
+    uint64_t m_memory_headroom;
     std::mutex m_mutex;
+    std::condition_variable m_advise_done;  // A region's advising() went false
+    std::mutex m_resize_mutex;    // Serializes buffer resizes, which may block
 
     std::map<void*, RegionDescriptor*> m_active_regions;
     std::map<void*, RegionDescriptor*>::iterator m_last_iter;
@@ -96,10 +175,11 @@ class RegionManager {
     RegionManager( void );
 
     uint64_t* read_env_var( const char* env, uint64_t* val);
-    void _removeRegion( char* region );
-    uint64_t        get_max_pages_in_memory( void );
+    bool read_env_cpus( const char* env, std::vector<int>& cpus );
+    RegionDescriptor* _removeRegion( char* region );
+    void retire_region( RegionDescriptor* rd );
+    void fill_region_stats( RegionDescriptor* rd, umap_region_stats* stats );
     void set_max_fault_events( uint64_t max_events );
-    void set_max_pages_in_buffer( uint64_t max_pages );
     void set_read_ahead(uint64_t num_pages);
     void set_umap_page_size( uint64_t page_size );
     void set_num_fillers( uint64_t num_fillers );
@@ -0,0 +1,340 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include "umap/SharedPages.hpp"
+
+#include <algorithm>            // std::min
+#include <sstream>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>              // O_*, fallocate()
+#include <sched.h>              // sched_yield()
+#include <signal.h>             // kill()
+#include <string.h>             // strerror()
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+  //
+  // Lives right behind the pages in the shared memory object, followed by
+  // the per page state words.
+  //
+  struct SharedHeader {
+    uint64_t              magic;
+    uint64_t              region_size;
+    uint64_t              page_size;
+    int64_t               mtime_sec;
+    int64_t               mtime_nsec;
+    std::atomic<uint32_t> ready;
+    std::atomic<uint32_t> attached;
+    char                  pad[16];
+  };
+
+  static const uint64_t shared_magic = 0x756d6170736872ULL;    // "umapshr"
+
+  //
+  // Per page state: the number of processes that have the page mapped and
+  // whether the page holds valid data, is being read by one of them, or is
+  // being punched out by the last one to let go.  The process reading or
+  // punching the page is kept in the upper half, so that should it die the
+  // others can tell and take over.
+  //
+  static const uint64_t count_mask = 0xffff;
+  static const uint64_t valid      = 1 << 16;
+  static const uint64_t filling    = 1 << 17;
+  static const uint64_t evicting   = 1 << 18;
+  static const uint64_t owner_mask = 0xffffffffULL << 32;
+
+  static uint64_t owned_by( pid_t pid )
+  {
+    return (uint64_t)(uint32_t)pid << 32;
+  }
+
+  //
+  // Whether the process reading or punching the page has gone away.  Only
+  // asked every so often, as it takes a system call.
+  //
+  static const int owner_check_interval = 256;
+
+  static bool owner_died( uint64_t v )
+  {
+    pid_t pid = (pid_t)(v >> 32);
+
+    return pid != 0 && kill(pid, 0) == -1 && errno == ESRCH;
+  }
+
+  //
+  // Give the first process a while to size and set up a new object
+  //
+  static const int attach_timeout_ms = 10000;
+
+  SharedPages*
+  SharedPages::attach( int fd, off_t offset, uint64_t region_size, uint64_t page_size )
+  {
+    struct stat st;
+
+    if ( fstat(fd, &st) == -1 )
+      UMAP_ERROR("fstat failed: " << strerror(errno));
+
+    std::stringstream name;
+    name << "/umap-" << std::hex << st.st_dev << "-" << st.st_ino << "-" << offset;
+
+    uint64_t sys_page_size = sysconf(_SC_PAGESIZE);
+    uint64_t num_pages = region_size / page_size;
+    uint64_t ctl_size = sizeof(SharedHeader) + num_pages * sizeof(uint64_t);
+
+    ctl_size = (ctl_size + sys_page_size - 1) & ~(sys_page_size - 1);
+
+    auto sp = new SharedPages();
+    sp->m_name = name.str();
+    sp->m_region_size = region_size;
+    sp->m_page_size = page_size;
+    sp->m_num_pages = num_pages;
+    sp->m_ctl_size = ctl_size;
+
+    //
+    // Whoever manages to create the object sets it up; everyone else waits
+    // for that to be done.  The name may go away between our two attempts
+    // when the last user detaches, so go around again if it does.
+    //
+    bool creator = false;
+
+    while ( 1 ) {
+      sp->m_fd = shm_open(sp->m_name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+      if ( sp->m_fd != -1 ) {
+        creator = true;
+        break;
+      }
+      if ( errno != EEXIST )
+        UMAP_ERROR("shm_open(" << sp->m_name << ") failed: " << strerror(errno));
+
+      sp->m_fd = shm_open(sp->m_name.c_str(), O_RDWR | O_CLOEXEC, 0);
+      if ( sp->m_fd != -1 )
+        break;
+      if ( errno != ENOENT )
+        UMAP_ERROR("shm_open(" << sp->m_name << ") failed: " << strerror(errno));
+    }
+
+    if ( creator ) {
+      if ( ftruncate(sp->m_fd, region_size + ctl_size) == -1 )
+        UMAP_ERROR("ftruncate(" << sp->m_name << ") failed: " << strerror(errno));
+    }
+    else {
+      struct stat shm_st;
+      int waited = 0;
+
+      for ( ; ; ++waited ) {
+        if ( fstat(sp->m_fd, &shm_st) == -1 )
+          UMAP_ERROR("fstat(" << sp->m_name << ") failed: " << strerror(errno));
+        if ( (uint64_t)shm_st.st_size >= region_size + ctl_size || waited == attach_timeout_ms )
+          break;
+        usleep(1000);
+      }
+
+      if ( (uint64_t)shm_st.st_size != region_size + ctl_size )
+        UMAP_ERROR(sp->m_name << " does not match this region (size "
+            << shm_st.st_size << "), remove it from /dev/shm if it is stale");
+    }
+
+    void* ctl = mmap(nullptr, ctl_size, PROT_READ | PROT_WRITE, MAP_SHARED, sp->m_fd, region_size);
+
+    if ( ctl == MAP_FAILED )
+      UMAP_ERROR("mmap(" << sp->m_name << ") failed: " << strerror(errno));
+
+    sp->m_header = (SharedHeader*)ctl;
+    sp->m_state = (std::atomic<uint64_t>*)((char*)ctl + sizeof(SharedHeader));
+
+    SharedHeader* h = sp->m_header;
+
+    if ( creator ) {
+      h->magic = shared_magic;
+      h->region_size = region_size;
+      h->page_size = page_size;
+      h->mtime_sec = st.st_mtim.tv_sec;
+      h->mtime_nsec = st.st_mtim.tv_nsec;
+      h->ready.store(1, std::memory_order_release);
+    }
+    else {
+      for ( int waited = 0; h->ready.load(std::memory_order_acquire) == 0; ++waited ) {
+        if ( waited == attach_timeout_ms )
+          UMAP_ERROR("timed out waiting for " << sp->m_name << " to be set up");
+        usleep(1000);
+      }
+
+      if (   h->magic != shared_magic || h->region_size != region_size
+          || h->page_size != page_size
+          || h->mtime_sec != st.st_mtim.tv_sec || h->mtime_nsec != st.st_mtim.tv_nsec )
+        UMAP_ERROR(sp->m_name << " was set up for a different region, page size, "
+            << "or version of the file; remove it from /dev/shm if it is stale");
+    }
+
+    h->attached.fetch_add(1);
+
+    //
+    // A flag per page of what may be a multi-terabyte region; anonymous
+    // memory reads as zero and only costs memory where it is written.
+    //
+    sp->m_held_size = (num_pages + sys_page_size - 1) & ~(sys_page_size - 1);
+    void* held = mmap(nullptr, sp->m_held_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if ( held == MAP_FAILED )
+      UMAP_ERROR("mmap of " << sp->m_held_size << " bytes failed: " << strerror(errno));
+
+    sp->m_held = (std::atomic<uint8_t>*)held;
+    sp->m_num_held.store(0);
+
+    UMAP_LOG(Debug, (creator ? "Created " : "Attached to ") << sp->m_name
+        << ", " << h->attached.load() << " processes attached");
+
+    return sp;
+  }
+
+  SharedPages::~SharedPages( void )
+  {
+    //
+    // Only the parts of m_held that have been written to can hold a flag.
+    // Should any of those have been swapped out, look at every page.
+    //
+    uint64_t sys_page_size = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> resident(m_held_size / sys_page_size);
+
+    if ( m_num_held.load() != 0 && mincore(m_held, m_held_size, &resident[0]) == 0 ) {
+      for ( uint64_t c = 0; c < resident.size() && m_num_held.load() != 0; ++c ) {
+        if ( ! (resident[c] & 1) )
+          continue;
+
+        uint64_t last = std::min((c + 1) * sys_page_size, m_num_pages);
+
+        for ( uint64_t i = c * sys_page_size; i < last; ++i )
+          release(i);
+      }
+    }
+
+    for ( uint64_t i = 0; i < m_num_pages && m_num_held.load() != 0; ++i )
+      release(i);
+
+    if ( m_header->attached.fetch_sub(1) == 1 ) {
+      UMAP_LOG(Debug, "Removing " << m_name);
+      shm_unlink(m_name.c_str());
+    }
+
+    munmap(m_header, m_ctl_size);
+    close(m_fd);
+    munmap(m_held, m_held_size);
+  }
+
+  bool
+  SharedPages::acquire( uint64_t page )
+  {
+    auto& state = m_state[page];
+    uint64_t me = owned_by(getpid());
+    uint64_t v = state.load();
+
+    //
+    // Wait out a punch in progress; the page has to be read again after it.
+    // If the process punching it died, finish the punch for it.
+    //
+    for ( int spins = 0; ; ) {
+      if ( v & evicting ) {
+        if ( ++spins % owner_check_interval == 0 && owner_died(v) ) {
+          if ( state.compare_exchange_strong(v, evicting | me) ) {
+            punch(page);
+            v = state.load();
+          }
+          continue;
+        }
+        sched_yield();
+        v = state.load();
+        continue;
+      }
+
+      if ( (v & count_mask) == count_mask )
+        UMAP_ERROR("too many processes mapping page " << page << " of " << m_name);
+
+      if ( state.compare_exchange_weak(v, v + 1) )
+        break;
+    }
+    if ( m_held[page].exchange(1) == 0 )
+      m_num_held.fetch_add(1);
+    v += 1;
+
+    //
+    // Our count keeps the page from being punched out from here on.  Either
+    // it is there already, or we read it, or we wait for whoever is.  If
+    // that process died, we read it instead.
+    //
+    for ( int spins = 0; ; ) {
+      if ( v & valid )
+        return false;
+
+      if ( ! (v & filling) ) {
+        if ( state.compare_exchange_weak(v, v | filling | me) )
+          return true;
+        continue;
+      }
+
+      if ( ++spins % owner_check_interval == 0 && owner_died(v) ) {
+        if ( state.compare_exchange_strong(v, (v & ~owner_mask) | me) ) {
+          UMAP_LOG(Debug, "Taking over page " << page << " of " << m_name
+              << " from process " << (v >> 32));
+          return true;
+        }
+        continue;
+      }
+
+      sched_yield();
+      v = state.load();
+    }
+  }
+
+  void
+  SharedPages::filled( uint64_t page )
+  {
+    auto& state = m_state[page];
+    uint64_t v = state.load();
+
+    while ( ! state.compare_exchange_weak(v, (v | valid) & ~(filling | owner_mask)) )
+      ;
+  }
+
+  void
+  SharedPages::release( uint64_t page )
+  {
+    if ( m_held[page].exchange(0) == 0 )
+      return;
+
+    m_num_held.fetch_sub(1);
+
+    auto& state = m_state[page];
+    uint64_t v = state.fetch_sub(1) - 1;
+
+    if ( (v & count_mask) != 0 )
+      return;
+
+    //
+    // We were the last.  Somebody may be acquiring the page again already,
+    // in which case it stays.
+    //
+    if ( ! state.compare_exchange_strong(v, evicting | owned_by(getpid())) )
+      return;
+
+    punch(page);
+  }
+
+  void
+  SharedPages::punch( uint64_t page )
+  {
+    if ( fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, page * m_page_size, m_page_size) == -1 )
+      UMAP_ERROR("fallocate(" << m_name << ") failed: " << strerror(errno));
+
+    m_state[page].store(0);
+  }
+} // end of namespace Umap
@@ -0,0 +1,81 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_SharedPages_HPP
+#define _UMAP_SharedPages_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <sys/types.h>
+
+namespace Umap {
+  struct SharedHeader;
+
+  //
+  // The pages of a UMAP_SHARED region live in a POSIX shared memory object
+  // named after the backing file, so that every process on the node that
+  // maps the same file sees the same resident pages.  Each process still
+  // runs its own fill and evict workers.  Behind the pages, the object holds
+  // a state word per umap page that the processes use to agree on:
+  //
+  //  - who reads a page from the store (whoever maps it first); the others
+  //    take a minor fault and map the page without any I/O, and
+  //  - when a page may be freed (once no process has it mapped).
+  //
+  // The first process to attach creates the object and the last one to
+  // detach removes its name.
+  //
+  // Should a process die while reading or punching out a page, the others
+  // take the page over.  The pages it had mapped, and its attachment, stay
+  // counted though: those pages are not punched out until the object is
+  // removed, and the object outlives the last process.  Remove it from
+  // /dev/shm by hand once no process on the node maps the file.
+  //
+  class SharedPages {
+    public:
+      static SharedPages* attach( int fd, off_t offset, uint64_t region_size, uint64_t page_size );
+      ~SharedPages( void );
+
+      //
+      // Shared memory object holding the pages, to be mapped at offset 0
+      //
+      int fd( void ) { return m_fd; }
+
+      //
+      // Count this process as a user of the page.  Returns true if the
+      // caller has to read the page into the object, and must then call
+      // filled(); false if the page is already there.
+      //
+      bool acquire( uint64_t page );
+      void filled( uint64_t page );
+
+      //
+      // This process no longer has the page mapped.  The last process to
+      // let go of a page punches it out of the object.
+      //
+      void release( uint64_t page );
+
+    private:
+      SharedPages( void ) {}
+
+      void punch( uint64_t page );
+
+      std::string            m_name;
+      int                    m_fd;
+      uint64_t               m_region_size;
+      uint64_t               m_page_size;
+      uint64_t               m_num_pages;
+      uint64_t               m_ctl_size;
+      SharedHeader*          m_header;
+      std::atomic<uint64_t>* m_state;
+      std::atomic<uint8_t>*  m_held;      // Pages acquired by this process
+      uint64_t               m_held_size;
+      std::atomic<uint64_t>  m_num_held;
+  };
+} // end of namespace Umap
+#endif // _UMAP_SharedPages_HPP
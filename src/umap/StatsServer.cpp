@@ -0,0 +1,205 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <cstdlib>              // atexit()
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>               // poll()
+#include <string.h>             // strerror()
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "umap/config.h"
+#include "umap/RegionManager.hpp"
+#include "umap/StatsServer.hpp"
+#include "umap/umap.h"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+
+//
+// The engine is not torn down at exit, so remove the socket from here to
+// avoid leaving a stale name in the file system.
+//
+static std::string s_socket_path;
+
+static void unlink_socket_at_exit( void )
+{
+  unlink(s_socket_path.c_str());
+}
+
+std::string
+StatsServer::snapshot( void )
+{
+  std::vector<umap_region_stats> stats(m_rm.get_num_active_regions() + 1);
+  int nregions;
+
+  //
+  // Regions may come and go while we are looking, so retry until the array
+  // is large enough.
+  //
+  while ( (nregions = m_rm.get_all_region_stats(&stats[0], stats.size())) > (int)stats.size() )
+    stats.resize(nregions);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  std::ostringstream ss;
+  ss << "umap pid=" << getpid()
+     << " time_ns=" << (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec
+     << " regions=" << nregions
+     << " max_pages_in_buffer=" << m_rm.get_max_pages_in_buffer()
+     << " buffer_pages=" << m_rm.get_buffer_pages()
+     << " page_size=" << m_rm.get_umap_page_size()
+     << "\n";
+
+  for ( int i = 0; i < nregions; ++i ) {
+    umap_region_stats& s = stats[i];
+
+    ss << "region addr=" << s.region
+       << " size=" << s.region_size
+       << " page_size=" << s.page_size
+       << " faults=" << s.faults
+       << " write_faults=" << s.write_faults
+       << " fills=" << s.fills
+       << " evictions=" << s.evictions
+       << " write_backs=" << s.write_backs
+       << " bytes_read=" << s.bytes_read
+       << " bytes_written=" << s.bytes_written
+       << " resident_pages=" << s.resident_pages
+       << " stalls=" << s.stalls
+       << " stall_ns=" << s.stall_ns
+       << " shootdowns=" << s.shootdowns
+       << " demand_fills=" << s.demand_fills
+       << " demand_fill_ns=" << s.demand_fill_ns
+       << " prefetch_fills=" << s.prefetch_fills
+       << " prefetch_fill_ns=" << s.prefetch_fill_ns
+       << " prefetch_cancelled=" << s.prefetch_cancelled
+       << " stall_hist=";
+
+    for ( int b = 0; b < UMAP_STALL_BUCKETS; ++b )
+      ss << (b ? "," : "") << s.stall_hist[b];
+    ss << "\n";
+  }
+  return ss.str();
+}
+
+void
+StatsServer::serve( void )
+{
+  struct pollfd pollfd[2] = {
+      { .fd = m_listen_fd, .events = POLLIN }
+    , { .fd = m_pipe[0], .events = POLLIN }
+  };
+
+  //
+  // As with the Uffd manager, our work queue is only used as a sentinel for
+  // when it is time to leave.
+  //
+  while ( wq_is_empty() ) {
+    if ( poll(&pollfd[0], 2, -1) == -1 ) {
+      if ( errno == EINTR )
+        continue;
+      UMAP_ERROR("poll failed: " << strerror(errno));
+    }
+
+    if ( pollfd[1].revents & POLLIN )
+      break;
+
+    if ( !(pollfd[0].revents & POLLIN) )
+      continue;
+
+    int fd = accept4(m_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if ( fd == -1 ) {
+      UMAP_LOG(Debug, "accept failed: " << strerror(errno));
+      continue;
+    }
+
+    std::string s = snapshot();
+    const char* p = s.c_str();
+    size_t left = s.size();
+
+    while ( left ) {
+      ssize_t rval = send(fd, p, left, MSG_NOSIGNAL);
+
+      if ( rval == -1 ) {
+        if ( errno == EINTR )
+          continue;
+        break;
+      }
+      p += rval;
+      left -= rval;
+    }
+    close(fd);
+  }
+  UMAP_LOG(Debug, "Good bye");
+}
+
+void
+StatsServer::ThreadEntry( void )
+{
+  serve();
+}
+
+StatsServer::StatsServer( const std::string& socket_path )
+  :   WorkerPool("Stats Server", 1)
+    , m_rm(RegionManager::getInstance())
+    , m_socket_path(socket_path)
+{
+  struct sockaddr_un addr;
+
+  if ( m_socket_path.size() >= sizeof(addr.sun_path) )
+    UMAP_ERROR("UMAP_STATS_SOCKET path too long: " << m_socket_path);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, m_socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  if ( (m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 )
+    UMAP_ERROR("socket failed: " << strerror(errno));
+
+  unlink(m_socket_path.c_str());
+
+  if ( bind(m_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 )
+    UMAP_ERROR("bind(" << m_socket_path << ") failed: " << strerror(errno));
+
+  if ( listen(m_listen_fd, 8) == -1 )
+    UMAP_ERROR("listen failed: " << strerror(errno));
+
+  if (pipe2(m_pipe, O_CLOEXEC) < 0)
+    UMAP_ERROR("stats server pipe failed: " << strerror(errno));
+
+  UMAP_LOG(Info, "Serving statistics on " << m_socket_path);
+
+  if ( s_socket_path.empty() ) {
+    s_socket_path = m_socket_path;
+    atexit(unlink_socket_at_exit);
+  }
+
+  set_cpus(m_rm.get_service_cpus());
+  start_thread_pool();
+}
+
+StatsServer::~StatsServer( void )
+{
+  char bye[5] = "bye";
+
+  write(m_pipe[1], bye, 3);
+
+  stop_thread_pool();
+
+  close(m_listen_fd);
+  close(m_pipe[0]);
+  close(m_pipe[1]);
+  unlink(m_socket_path.c_str());
+}
+} // end of namespace Umap
@@ -0,0 +1,42 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_StatsServer_HPP
+#define _UMAP_StatsServer_HPP
+
+#include <string>
+
+#include "umap/WorkerPool.hpp"
+
+namespace Umap {
+  class RegionManager;
+
+  //
+  // Listens on a Unix domain socket and answers each connection with a text
+  // snapshot of the per-region statistics.  The snapshot is one line per
+  // record of space separated key=value pairs:
+  //
+  //   umap pid=<pid> time_ns=<ns> regions=<n> max_pages_in_buffer=<n> ...
+  //   region addr=<addr> size=<bytes> faults=<n> ... resident_pages=<n>
+  //
+  class StatsServer : public WorkerPool {
+    public:
+      StatsServer( const std::string& socket_path );
+      ~StatsServer( void );
+
+      std::string snapshot( void );
+
+    private:
+      RegionManager& m_rm;
+      std::string    m_socket_path;
+      int            m_listen_fd;
+      int            m_pipe[2];
+
+      void serve( void );
+      void ThreadEntry( void );
+  };
+} // end of namespace Umap
+#endif // _UMAP_StatsServer_HPP
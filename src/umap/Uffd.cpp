@@ -6,18 +6,24 @@
 //////////////////////////////////////////////////////////////////////////////
 #include <algorithm>            // sort()
 #include <cassert>              // assert()
+#include <chrono>
 #include <cstdint>              // uint64_t
 #include <iomanip>
 #include <iostream>
+#include <mutex>                // call_once()
+#include <unordered_map>
 #include <vector>               // We all have lists to manage
 
 #include <errno.h>              // strerror()
 #include <fcntl.h>              // O_CLOEXEC
+#include <linux/fs.h>           // PAGEMAP_SCAN
 #include <linux/userfaultfd.h>  // ioctl(UFFDIO_*)
-#include <poll.h>               // poll()
+#include <poll.h>               // ppoll()
 #include <string.h>             // strerror()
 #include <sys/ioctl.h>          // ioctl()
+#include <sys/mman.h>           // madvise()
 #include <sys/syscall.h>        // syscall()
+#include <time.h>
 #include <unistd.h>             // syscall()
 
 #include "umap/config.h"
@@ -25,6 +31,51 @@
 #include "umap/RegionDescriptor.hpp"
 #include "umap/RegionManager.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Numa.hpp"
+#include "umap/util/Trace.hpp"
+#include "umap/util/UffdCopy.hpp"
+
+//
+// Asynchronous write protection and PAGEMAP_SCAN arrived with Linux 6.7
+//
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC         (1<<15)
+#endif
+
+//
+// Mapping pages write protected with UFFDIO_CONTINUE arrived with Linux 6.4
+//
+#ifndef UFFDIO_CONTINUE_MODE_WP
+#define UFFDIO_CONTINUE_MODE_WP       ((__u64)1<<1)
+#endif
+
+#ifndef PAGEMAP_SCAN
+struct page_region {
+  __u64 start;
+  __u64 end;
+  __u64 categories;
+};
+
+struct pm_scan_arg {
+  __u64 size;
+  __u64 flags;
+  __u64 start;
+  __u64 end;
+  __u64 walk_end;
+  __u64 vec;
+  __u64 vec_len;
+  __u64 max_pages;
+  __u64 category_inverted;
+  __u64 category_mask;
+  __u64 category_anyof_mask;
+  __u64 return_mask;
+};
+
+#define PAGEMAP_SCAN                  _IOWR('f', 16, struct pm_scan_arg)
+#define PM_SCAN_WP_MATCHING           (1<<0)
+#define PM_SCAN_CHECK_WPASYNC         (1<<1)
+#define PAGE_IS_WRITTEN               (1<<1)
+#endif
 
 namespace Umap {
 
@@ -37,13 +88,49 @@ struct less_than_key {
   }
 };
 
+//
+// Pick the node whose fill workers should handle a fault.  A node bound to
+// the region wins; otherwise we use the node the faulting thread last ran
+// on.  Looking that up costs a read of /proc, so it is cached for a short
+// while (threads do migrate, but not often).
+//
+int
+Uffd::fault_node( const uffd_msg& msg, RegionDescriptor* rd )
+{
+  const uint64_t max_age_ns = 100000000;   // 100ms
+
+  if ( rd->numa_node() >= 0 )
+    return rd->numa_node();
+
+  if ( !m_numa_aware || !m_have_thread_id )
+    return -1;
+
+  uint32_t tid = msg.arg.pagefault.feat.ptid;
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  auto it = m_thread_nodes.find(tid);
+  if ( it != m_thread_nodes.end() && now - it->second.when_ns < max_age_ns )
+    return it->second.node;
+
+  if ( m_thread_nodes.size() > 4096 )
+    m_thread_nodes.clear();
+
+  int node = numa::node_of_thread(tid);
+  m_thread_nodes[tid] = ThreadNode{node, now};
+  return node;
+}
+
 void
 Uffd::uffd_handler( void )
 {
-  struct pollfd pollfd[3] = {
+  struct pollfd pollfd[4] = {
       { .fd = m_uffd_fd, .events = POLLIN }
     , { .fd = m_pipe[0], .events = POLLIN }
     , { .fd = m_pipe[1], .events = POLLIN }
+    , { .fd = m_wake[0], .events = POLLIN }
   };
 
   //
@@ -51,21 +138,53 @@ Uffd::uffd_handler( void )
   // when it is time to leave (since this particular thread gets its work
   // from the m_uffd_fd kernel module.
   //
+  uint64_t window_ns = m_rm.get_fill_window() * 1000;
+  std::chrono::steady_clock::time_point held_since;
+
   while ( wq_is_empty() ) {
-    int pollres = poll(&pollfd[0], 3, -1);
-
-    switch (pollres) {
-      case 1:
-        break;
-      case -1:
-        UMAP_ERROR("poll failed: " << strerror(errno));
-      default:
-        UMAP_ERROR("poll: unexpected result: " << pollres);
+    //
+    // Held faults go to the fill workers once one of them is done
+    // reading, or once they have waited out the fill window
+    //
+    struct timespec timeout;
+    struct timespec* ptimeout = nullptr;
+
+    if ( ! m_held.empty() ) {
+      uint64_t held_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - held_since).count();
+
+      if ( held_ns >= window_ns ) {
+        dispatch_held();
+        continue;
+      }
+
+      timeout.tv_sec = (window_ns - held_ns) / 1000000000;
+      timeout.tv_nsec = (window_ns - held_ns) % 1000000000;
+      ptimeout = &timeout;
+    }
+
+    int pollres = ppoll(&pollfd[0], 4, ptimeout, nullptr);
+
+    if ( pollres == 0 )
+      continue;   // The window is up
+
+    if ( pollres == -1 ) {
+      if (errno == EINTR)
+        continue;
+      UMAP_ERROR("poll failed: " << strerror(errno));
     }
 
     if (pollfd[1].revents & POLLIN || pollfd[2].revents & POLLIN)
       break;
 
+    if ( pollfd[3].revents & POLLIN ) {
+      char drain[64];
+
+      while ( read(m_wake[0], drain, sizeof(drain)) > 0 )
+        ;
+      dispatch_held();
+    }
+
     if (pollfd[0].revents & POLLERR)
       UMAP_ERROR("POLLERR: ");
 
@@ -89,46 +208,148 @@ Uffd::uffd_handler( void )
 
     //
     // Since uffd page events arrive on the system page boundary which could
-    // be different from umap's page size, the page address for the incoming
-    // events are adjusted to the beginning of the umap page address.  The
-    // events are then sorted in page base address / operation type order and
-    // are processed only once while duplicates are skipped.
+    // be different from the umap page size of the region, the page address
+    // for the incoming events are adjusted to the beginning of the umap page
+    // address.
     //
-    for (int i = 0; i < msgs; ++i)
-      m_events[i].arg.pagefault.address &= ~(m_page_size-1);
-
-    std::sort(&m_events[0], &m_events[msgs], less_than_key());
+    RegionDescriptor* rd = nullptr;
+    std::unique_lock<std::mutex> dispatching(m_dispatch_mutex);
 
-    char* last_addr = nullptr;
     for (int i = 0; i < msgs; ++i) {
-      if ((char*)(m_events[i].arg.pagefault.address) == last_addr)
-        continue;
+      char* addr = (char*)m_events[i].arg.pagefault.address;
+
+      if ( rd == nullptr || addr < rd->start() || addr >= rd->end() )
+        rd = m_rm.containing_region(addr);
+
+      if ( rd != nullptr )
+        m_events[i].arg.pagefault.address &= ~(rd->page_size()-1);
+    }
+    dispatching.unlock();
+
+    if ( window_ns == 0 ) {
+      dispatch_faults(&m_events[0], msgs);
+      continue;
+    }
+
+    //
+    // Faults that come in while every fill worker has a read to do are
+    // held, as an elevator queues requests while the disk is busy, so
+    // that they can be sorted and merged.  A fault finding a fill worker
+    // free goes straight through; so do the held ones once one read's
+    // worth of faults is waiting.  m_holding is set before looking, so
+    // that a read finishing meanwhile wakes us.
+    //
+    if ( m_held.empty() )
+      held_since = std::chrono::steady_clock::now();
+
+    m_held.insert(m_held.end(), &m_events[0], &m_events[msgs]);
+    m_holding.store(true);
+
+    if ( m_held.size() >= m_max_fault_events || m_unread_fills.load() < m_rm.get_num_fillers() )
+      dispatch_held();
+  }
+  UMAP_LOG(Debug, "Good bye");
+}
+
+void
+Uffd::dispatch_held( void )
+{
+  m_holding.store(false);
+
+  if ( ! m_held.empty() ) {
+    dispatch_faults(&m_held[0], m_held.size());
+    m_held.clear();
+  }
+}
 
-      last_addr = (char*)(m_events[i].arg.pagefault.address);
+void
+Uffd::fill_read_done( void )
+{
+  char c = 0;
+
+  if ( --m_unread_fills < m_rm.get_num_fillers() && m_holding.exchange(false) )
+    write(m_wake[1], &c, 1);
+}
+
+//
+// The events are sorted in page base address / operation type order, and
+// so by offset within each region, and are processed only once while
+// duplicates are skipped.  Consecutive faults on one region (and for one
+// node) are handed to the buffer together so that pages close to each
+// other are filled as a run.
+//
+void
+Uffd::dispatch_faults( uffd_msg* events, uint64_t nevents )
+{
+  std::sort(&events[0], &events[nevents], less_than_key());
+
+  std::lock_guard<std::mutex> dispatching(m_dispatch_mutex);
+  RegionDescriptor* rd = nullptr;
+  char* last_addr = nullptr;
+  RegionDescriptor* batch_rd = nullptr;
+  int batch_node = -1;
+
+  m_batch.clear();
+
+  for (uint64_t i = 0; i < nevents; ++i) {
+    if ((char*)(events[i].arg.pagefault.address) == last_addr)
+      continue;
+
+    last_addr = (char*)(events[i].arg.pagefault.address);
+    UMAP_TRACE(FAULT, last_addr);
 
 #ifndef UMAP_RO_MODE
-      bool iswrite = (m_events[i].arg.pagefault.flags & (UFFD_PAGEFAULT_FLAG_WP | UFFD_PAGEFAULT_FLAG_WRITE) != 0);
+    bool iswrite = (events[i].arg.pagefault.flags & (UFFD_PAGEFAULT_FLAG_WP | UFFD_PAGEFAULT_FLAG_WRITE) != 0);
 #else
-      bool iswrite = false;
+    bool iswrite = false;
 #endif
 
-      //
-      // TODO: Since the addresses are sorted, we could optimize the
-      // search to continue from where it last found something.
-      //
-      process_page(iswrite, last_addr);
+    if ( rd == nullptr || last_addr < rd->start() || last_addr >= rd->end() )
+      rd = m_rm.containing_region(last_addr);
+
+    if ( rd != nullptr ) {
+      int node = fault_node(events[i], rd);
+
+      ++rd->stats().faults;
+      if ( iswrite )
+        ++rd->stats().write_faults;
+
+      if ( rd != batch_rd || node != batch_node ) {
+        if ( ! m_batch.empty() )
+          m_buffer->process_page_events(&m_batch[0], m_batch.size(), batch_rd, batch_node);
+        m_batch.clear();
+        batch_rd = rd;
+        batch_node = node;
+      }
+
+      m_batch.push_back(Buffer::FaultEvent{ last_addr, iswrite });
     }
   }
-  UMAP_LOG(Debug, "Good bye");
+
+  if ( ! m_batch.empty() )
+    m_buffer->process_page_events(&m_batch[0], m_batch.size(), batch_rd, batch_node);
 }
 
 void
 Uffd::process_page( bool iswrite, char* addr )
 {
+  std::lock_guard<std::mutex> dispatching(m_dispatch_mutex);
   auto rd = m_rm.containing_region(addr);
 
-  if ( rd != nullptr )
-    m_buffer->process_page_event(addr, iswrite, rd);
+  if ( rd != nullptr ) {
+    int node = rd->numa_node();
+
+    if ( node < 0 && m_numa_aware )
+      node = numa::current_node();
+
+    m_buffer->process_page_event(addr, iswrite, rd, node);
+  }
+}
+
+void
+Uffd::wait_for_dispatch( void )
+{
+  std::lock_guard<std::mutex> dispatching(m_dispatch_mutex);
 }
 
 void
@@ -141,11 +362,16 @@ Uffd::Uffd( void )
   :   WorkerPool("Uffd Manager", 1)
     , m_rm(RegionManager::getInstance())
     , m_max_fault_events(m_rm.get_max_fault_events())
-    , m_page_size(m_rm.get_umap_page_size())
     , m_buffer(m_rm.get_buffer_h())
+    , m_holding(false)
+    , m_unread_fills(0)
+    , m_numa_aware(m_rm.get_numa_aware() && numa::num_nodes() > 1)
+    , m_have_thread_id(false)
+    , m_have_move(false)
+    , m_dirty_scan(false)
+    , m_pagemap_fd(-1)
 {
-  UMAP_LOG(Debug, "\n maximum fault events: " << m_max_fault_events
-                  << "\n            page size: " << m_page_size);
+  UMAP_LOG(Debug, "\n maximum fault events: " << m_max_fault_events);
 
   if ((m_uffd_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK)) < 0)
     UMAP_ERROR("userfaultfd syscall not available in this kernel: "
@@ -154,9 +380,13 @@ Uffd::Uffd( void )
   if (pipe2(m_pipe, 0) < 0)
     UMAP_ERROR("userfaultfd pipe failed: " << strerror(errno));
 
+  if (pipe2(m_wake, O_CLOEXEC | O_NONBLOCK) < 0)
+    UMAP_ERROR("userfaultfd wake pipe failed: " << strerror(errno));
+
   check_uffd_compatibility();
   m_events.resize(m_max_fault_events);
 
+  set_cpus(m_rm.get_uffd_cpus());
   start_thread_pool();
 }
 
@@ -167,6 +397,12 @@ Uffd::~Uffd()
   write(m_pipe[1], bye, 3);
 
   stop_thread_pool();
+
+  close(m_wake[0]);
+  close(m_wake[1]);
+
+  if ( m_pagemap_fd != -1 )
+    close(m_pagemap_fd);
 }
 
 void
@@ -174,12 +410,16 @@ Uffd::enable_write_protect(
           void*
 #ifndef UMAP_RO_MODE
           page_address
+#endif
+        , uint64_t
+#ifndef UMAP_RO_MODE
+          len
 #endif
       )
 {
 #ifndef UMAP_RO_MODE
   struct uffdio_writeprotect wp = {
-      .range = { .start = (uint64_t)page_address, .len = m_page_size }
+      .range = { .start = (uint64_t)page_address, .len = len }
     , .mode = UFFDIO_WRITEPROTECT_MODE_WP
   };
 
@@ -194,11 +434,15 @@ Uffd::disable_write_protect(
 #ifndef UMAP_RO_MODE
   page_address
 #endif
+, uint64_t
+#ifndef UMAP_RO_MODE
+  len
+#endif
 )
 {
 #ifndef UMAP_RO_MODE
   struct uffdio_writeprotect wp = {
-      .range = { .start = (uint64_t)page_address, .len = m_page_size }
+      .range = { .start = (uint64_t)page_address, .len = len }
     , .mode = 0
   };
 
@@ -208,42 +452,217 @@ Uffd::disable_write_protect(
 }
 
 void
-Uffd::copy_in_page(char* data, void* page_address)
+Uffd::copy_in_page(char* data, void* page_address, uint64_t len)
+{
+  copy_in_pages(data, page_address, len, false);
+}
+
+void
+Uffd::copy_in_page_and_write_protect(char* data, void* page_address, uint64_t len)
 {
-  struct uffdio_copy copy = {
+  UMAP_LOG(Debug, "(page_address = " << page_address << ")");
+  copy_in_pages(data, page_address, len, true);
+}
+
+bool
+Uffd::move_in_page(char* data, void* page_address, uint64_t len)
+{
+  struct uffdio_move move = {
       .dst = (uint64_t)page_address
     , .src = (uint64_t)data
-    , .len = m_page_size
+    , .len = len
     , .mode = 0
+    , .move = 0
   };
 
-  if (ioctl(m_uffd_fd, UFFDIO_COPY, &copy) == -1)
-    UMAP_ERROR("UFFDIO_COPY failed: " << strerror(errno));
+  UMAP_TRACE_BEGIN(UFFD_MOVE, page_address);
+  while (ioctl(m_uffd_fd, UFFDIO_MOVE, &move) == -1) {
+    int err = errno;
+
+    if ( move.move <= 0 ) {
+      if ( err == EAGAIN )
+        continue;
+
+      //
+      // Nothing was moved, e.g. the staging page is shared after a fork
+      // or the region is not writable.  The data is still in place.
+      //
+      UMAP_LOG(Debug, "UFFDIO_MOVE failed @ " << page_address << ": " << strerror(err));
+      UMAP_TRACE_END(UFFD_MOVE, page_address);
+      return false;
+    }
+
+    break;
+  }
+  UMAP_TRACE_END(UFFD_MOVE, page_address);
+
+  //
+  // Partially moved: copy the rest in from where the move stopped, the same
+  // way any other page is copied in
+  //
+  if ( move.move > 0 && (uint64_t)move.move < len )
+    copy_in_pages(data + move.move, (char*)page_address + move.move, len - move.move, false);
+
+  return true;
 }
 
 void
-Uffd::copy_in_page_and_write_protect(char* data, void* page_address)
+Uffd::continue_pages(void* page_address, uint64_t len, bool write_protect)
 {
-  UMAP_LOG(Debug, "(page_address = " << page_address << ")");
-  struct uffdio_copy copy = {
-      .dst = (uint64_t)page_address
-    , .src = (uint64_t)data
-    , .len = m_page_size
-#ifndef UMAP_RO_MODE
-    , .mode = UFFDIO_COPY_MODE_WP
-#else
+  struct uffdio_continue cont = {
+      .range = { .start = (uint64_t)page_address, .len = len }
     , .mode = 0
+    , .mapped = 0
+  };
+
+  //
+  // The pages must be write protected as they are mapped; protecting them
+  // afterwards would let a write slip in unseen.
+  //
+#ifndef UMAP_RO_MODE
+  if ( write_protect )
+    cont.mode = UFFDIO_CONTINUE_MODE_WP;
+#endif
+
+  UMAP_TRACE_BEGIN(UFFD_CONTINUE, page_address);
+  while (ioctl(m_uffd_fd, UFFDIO_CONTINUE, &cont) == -1) {
+    if ( errno != EAGAIN )
+      UMAP_ERROR("UFFDIO_CONTINUE failed @ " << page_address << ": " << strerror(errno));
+
+    if ( cont.mapped > 0 ) {
+      cont.range.start += cont.mapped;
+      cont.range.len -= cont.mapped;
+    }
+    cont.mapped = 0;
+  }
+  UMAP_TRACE_END(UFFD_CONTINUE, page_address);
+}
+
+uint64_t
+Uffd::copy_in_pages(char* data, void* page_address, uint64_t len, bool write_protect)
+{
+  uint64_t sys_page_size = m_rm.get_system_page_size();
+  uint64_t mode = 0;
+
+#ifndef UMAP_RO_MODE
+  if ( write_protect )
+    mode = UFFDIO_COPY_MODE_WP;
 #endif
+
+  UMAP_TRACE_BEGIN(UFFD_COPY, page_address);
+  int64_t copied = uffd::copy_pages(m_uffd_fd, (uint64_t)page_address, (uint64_t)data, len, mode, sys_page_size,
+    [this, sys_page_size]( uint64_t page ) {
+      //
+      // Anyone that faulted on the page before it got there is woken
+      //
+      struct uffdio_range wake = { .start = page, .len = sys_page_size };
+
+      UMAP_LOG(Debug, "UFFDIO_COPY found " << (void*)page << " present");
+      if (ioctl(m_uffd_fd, UFFDIO_WAKE, &wake) == -1)
+        UMAP_ERROR("ioctl(UFFDIO_WAKE): " << strerror(errno));
+    });
+
+  if ( copied == -1 )
+    UMAP_ERROR("UFFDIO_COPY failed @ " << page_address << ": " << strerror(errno));
+
+  UMAP_TRACE_END(UFFD_COPY, page_address);
+  return copied;
+}
+
+void
+Uffd::scan_written(char* page_address, uint64_t len, uint64_t page_size, std::vector<bool>& written)
+{
+  uint64_t npages = len / page_size;
+  std::vector<page_region> vec(npages);
+  struct pm_scan_arg scan = {
+      .size = sizeof(scan)
+    , .flags = PM_SCAN_WP_MATCHING | PM_SCAN_CHECK_WPASYNC
+    , .start = (uint64_t)page_address
+    , .end = (uint64_t)page_address + len
+    , .walk_end = 0
+    , .vec = (uint64_t)&vec[0]
+    , .vec_len = npages
+    , .max_pages = 0
+    , .category_inverted = 0
+    , .category_mask = PAGE_IS_WRITTEN
+    , .category_anyof_mask = 0
+    , .return_mask = PAGE_IS_WRITTEN
   };
 
-  if (ioctl(m_uffd_fd, UFFDIO_COPY, &copy) == -1) {
-    UMAP_ERROR("UFFDIO_COPY failed @ " 
-        << page_address << " : "
-        << strerror(errno) << std::endl
-    );
+  written.assign(npages, false);
+
+  //
+  // A umap page with any written system page in it is written.  The scan
+  // stops early when it runs out of room for ranges; go on from there.
+  //
+  while ( scan.start < scan.end ) {
+    long n = ioctl(m_pagemap_fd, PAGEMAP_SCAN, &scan);
+
+    if ( n == -1 ) {
+      if ( errno == EINTR )
+        continue;
+      UMAP_ERROR("ioctl(PAGEMAP_SCAN) failed @ " << page_address << ": " << strerror(errno));
+    }
+
+    for ( long r = 0; r < n; ++r ) {
+      uint64_t first = (vec[r].start - (uint64_t)page_address) / page_size;
+      uint64_t last = (vec[r].end - 1 - (uint64_t)page_address) / page_size;
+
+      for ( uint64_t i = first; i <= last; ++i )
+        written[i] = true;
+    }
+
+    scan.start = scan.walk_end;
   }
 }
 
+void
+Uffd::register_staging(char* staging, uint64_t len)
+{
+  struct uffdio_register uffdio_register = {
+      .range = { .start = (__u64)staging, .len = len }
+    , .mode = UFFDIO_REGISTER_MODE_MISSING
+  };
+
+  if (ioctl(m_uffd_fd, UFFDIO_REGISTER, &uffdio_register) == -1)
+    UMAP_ERROR("ioctl(UFFDIO_REGISTER) of staging failed: " << strerror(errno));
+}
+
+uint64_t
+Uffd::move_out_pages(char* page_address, char* staging, uint64_t len)
+{
+  uint64_t moved = 0;
+
+  UMAP_TRACE_BEGIN(UFFD_MOVE, page_address);
+  while ( moved < len ) {
+    struct uffdio_move move = {
+        .dst = (uint64_t)staging + moved
+      , .src = (uint64_t)page_address + moved
+      , .len = len - moved
+      , .mode = 0
+      , .move = 0
+    };
+
+    if (ioctl(m_uffd_fd, UFFDIO_MOVE, &move) == 0) {
+      moved = len;
+      break;
+    }
+
+    int err = errno;
+
+    if ( move.move > 0 )
+      moved += move.move;
+
+    if ( err != EAGAIN ) {
+      UMAP_LOG(Debug, "UFFDIO_MOVE out failed @ " << page_address << ": " << strerror(err));
+      break;
+    }
+  }
+  UMAP_TRACE_END(UFFD_MOVE, page_address);
+
+  return moved;
+}
+
 void
 Uffd::register_region( RegionDescriptor* rd )
 {
@@ -256,8 +675,16 @@ Uffd::register_region( RegionDescriptor* rd )
 #endif
   };
 
+  //
+  // Pages of a shmem region that are missing from the memfd fault as
+  // missing; pages that are in the memfd but not mapped here (e.g. filled
+  // by another process) fault as minor.
+  //
+  if ( rd->shmem() )
+    uffdio_register.mode |= UFFDIO_REGISTER_MODE_MINOR;
+
   UMAP_LOG(Debug,
-    "Registering " << (uffdio_register.range.len / m_page_size)
+    "Registering " << (uffdio_register.range.len / rd->page_size())
     << " pages from: " << (void*)(uffdio_register.range.start)
     << " - " << (void*)(uffdio_register.range.start +
                               (uffdio_register.range.len-1)));
@@ -268,7 +695,19 @@ Uffd::register_region( RegionDescriptor* rd )
     );
   }
 
-  if ((uffdio_register.ioctls & UFFD_API_RANGE_IOCTLS) != UFFD_API_RANGE_IOCTLS)
+  //
+  // Only check for the ioctls we use.  UFFD_API_RANGE_IOCTLS has grown
+  // over time to include ioctls (e.g. UFFDIO_CONTINUE) that are never
+  // available on anonymous memory.
+  //
+  uint64_t needed = (uint64_t)1 << _UFFDIO_WAKE | (uint64_t)1 << _UFFDIO_COPY;
+#ifndef UMAP_RO_MODE
+  needed |= (uint64_t)1 << _UFFDIO_WRITEPROTECT;
+#endif
+  if ( rd->shmem() )
+    needed |= (uint64_t)1 << _UFFDIO_CONTINUE;
+
+  if ((uffdio_register.ioctls & needed) != needed)
     UMAP_ERROR("unexpected userfaultfd ioctl set: " << uffdio_register.ioctls);
 }
 
@@ -287,7 +726,7 @@ Uffd::unregister_region( RegionDescriptor* rd )
   };
 
   UMAP_LOG(Debug,
-    "Unregistering " << (uffdio_register.range.len / m_page_size)
+    "Unregistering " << (uffdio_register.range.len / rd->page_size())
     << " pages from: " << (void*)(uffdio_register.range.start)
     << " - " << (void*)(uffdio_register.range.start +
                               (uffdio_register.range.len-1)));
@@ -296,17 +735,166 @@ Uffd::unregister_region( RegionDescriptor* rd )
     UMAP_ERROR("ioctl(UFFDIO_UNREGISTER) failed: " << strerror(errno));
 }
 
+//
+// Ask the kernel what it supports with a throwaway descriptor, since
+// UFFDIO_API fails outright when an unknown feature is requested and may
+// only be issued once per descriptor.
+//
+uint64_t
+Uffd::kernel_features( void )
+{
+  static uint64_t supported = 0;
+  static std::once_flag once;
+
+  std::call_once(once, [] {
+    int fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+
+    if ( fd >= 0 ) {
+      struct uffdio_api probe = { .api = UFFD_API, .features = 0, .ioctls = 0 };
+
+      if ( ioctl(fd, UFFDIO_API, &probe) == 0 )
+        supported = probe.features;
+      close(fd);
+    }
+  });
+
+  return supported;
+}
+
+//
+// No feature bit tells whether UFFDIO_CONTINUE takes UFFDIO_CONTINUE_MODE_WP,
+// so map a page of a throwaway memfd with it and see whether the kernel
+// accepts the mode.
+//
+bool
+Uffd::continue_wp_supported( void )
+{
+  static bool supported = false;
+  static std::once_flag once;
+
+  std::call_once(once, [] {
+    long psize = sysconf(_SC_PAGESIZE);
+    int fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    int memfd = memfd_create("umap-probe", MFD_CLOEXEC);
+    void* addr = MAP_FAILED;
+
+    if ( fd >= 0 && memfd >= 0 && ftruncate(memfd, psize) == 0 && pwrite(memfd, "", 1, 0) == 1 )
+      addr = mmap(nullptr, psize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+    if ( addr != MAP_FAILED ) {
+      struct uffdio_api api = {
+          .api = UFFD_API
+        , .features = UFFD_FEATURE_MINOR_SHMEM | UFFD_FEATURE_WP_HUGETLBFS_SHMEM
+        , .ioctls = 0
+      };
+      struct uffdio_register reg = {
+          .range = { .start = (__u64)addr, .len = (__u64)psize }
+        , .mode = UFFDIO_REGISTER_MODE_MINOR | UFFDIO_REGISTER_MODE_WP
+        , .ioctls = 0
+      };
+      struct uffdio_continue cont = {
+          .range = { .start = (__u64)addr, .len = (__u64)psize }
+        , .mode = UFFDIO_CONTINUE_MODE_WP
+        , .mapped = 0
+      };
+
+      supported = (   ioctl(fd, UFFDIO_API, &api) == 0
+                   && ioctl(fd, UFFDIO_REGISTER, &reg) == 0
+                   && ioctl(fd, UFFDIO_CONTINUE, &cont) == 0 );
+      munmap(addr, psize);
+    }
+
+    if ( memfd >= 0 )
+      close(memfd);
+    if ( fd >= 0 )
+      close(fd);
+  });
+
+  return supported;
+}
+
+bool
+Uffd::shmem_supported( void )
+{
+  uint64_t needed = UFFD_FEATURE_MINOR_SHMEM;
+
+#ifndef UMAP_RO_MODE
+  needed |= UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
+#endif
+
+  if ( (kernel_features() & needed) != needed )
+    return false;
+
+#ifndef UMAP_RO_MODE
+  return continue_wp_supported();
+#else
+  return true;
+#endif
+}
+
 void
 Uffd::check_uffd_compatibility( void )
 {
-  struct uffdio_api uffdio_api = {
-      .api = UFFD_API
-#ifdef UMAP_RO_MODE
-    , .features = 0
-#else
-    , .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP
+  uint64_t features = 0;
+
+#ifndef UMAP_RO_MODE
+  features |= UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+#endif
+
+  uint64_t supported = kernel_features();
+
+  //
+  // Shmem regions are only created when the kernel supports them, so ask
+  // for the features whenever they are there.
+  //
+  if ( shmem_supported() ) {
+    features |= UFFD_FEATURE_MINOR_SHMEM;
+#ifndef UMAP_RO_MODE
+    features |= UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
 #endif
+  }
 
+  //
+  // We only need to know who faulted when routing faults to per-node fill
+  // workers.
+  //
+  if ( m_numa_aware ) {
+    if ( supported & UFFD_FEATURE_THREAD_ID )
+      features |= UFFD_FEATURE_THREAD_ID;
+    else
+      UMAP_LOG(Info, "userfaultfd does not report thread ids, faults will "
+          "only be routed by region node");
+  }
+
+  if ( (supported & UFFD_FEATURE_MOVE) && ! m_rm.get_uffd_move_disabled() )
+    features |= UFFD_FEATURE_MOVE;
+
+#ifndef UMAP_RO_MODE
+  //
+  // Evicting a page that may be written to at any time takes moving it out
+  // of the region, which leaves nothing behind for the writer but a fault.
+  //
+  bool dirty_scan = false;
+
+  if ( m_rm.get_dirty_scan() ) {
+    m_pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+
+    struct pm_scan_arg probe = { .size = sizeof(probe) };
+
+    dirty_scan = (   (supported & UFFD_FEATURE_WP_ASYNC) && (supported & UFFD_FEATURE_MOVE)
+                  && m_pagemap_fd != -1 && ioctl(m_pagemap_fd, PAGEMAP_SCAN, &probe) == 0 );
+
+    if ( dirty_scan )
+      features |= UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_MOVE;
+    else
+      UMAP_LOG(Warning, "UMAP_DIRTY_SCAN needs asynchronous write protection, "
+          "PAGEMAP_SCAN, and UFFDIO_MOVE (Linux 6.8), faulting on writes instead");
+  }
+#endif
+
+  struct uffdio_api uffdio_api = {
+      .api = UFFD_API
+    , .features = features
     , .ioctls = 0
   };
 
@@ -317,5 +905,13 @@ if (ioctl(m_uffd_fd, UFFDIO_API, &uffdio_api) == -1)
 if ( !(uffdio_api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP) )
   UMAP_ERROR("UFFD Compatibilty Check - unsupported userfaultfd WP");
 #endif
+
+  m_have_thread_id = (uffdio_api.features & UFFD_FEATURE_THREAD_ID) != 0;
+  m_have_move = (uffdio_api.features & UFFD_FEATURE_MOVE) != 0 && ! m_rm.get_uffd_move_disabled();
+#ifndef UMAP_RO_MODE
+  m_dirty_scan = dirty_scan && (uffdio_api.features & UFFD_FEATURE_WP_ASYNC) != 0;
+#endif
+
+  UMAP_LOG(Debug, "UFFDIO_MOVE " << (m_have_move ? "" : "not ") << "available");
 }
 } // end of namespace Umap
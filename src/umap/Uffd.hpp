@@ -8,10 +8,13 @@
 #define _UMAP_Uffd_HPP
 
 #include <algorithm>            // sort()
+#include <atomic>
 #include <cassert>              // assert()
 #include <cstdint>              // uint64_t
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <unordered_map>
 #include <vector>               // We all have lists to manage
 
 #include <errno.h>              // strerror()
@@ -24,6 +27,25 @@
 #include <unistd.h>             // syscall()
 
 #include "umap/config.h"
+
+//
+// UFFDIO_MOVE arrived with Linux 6.8; allow building against older headers
+// and detect support at run time.
+//
+#ifndef _UFFDIO_MOVE
+#define _UFFDIO_MOVE                  (0x05)
+#define UFFD_FEATURE_MOVE             (1<<16)
+#define UFFDIO_MOVE_MODE_DONTWAKE     ((__u64)1<<0)
+struct uffdio_move {
+  __u64 dst;
+  __u64 src;
+  __u64 len;
+  __u64 mode;
+  __s64 move;
+};
+#define UFFDIO_MOVE _IOWR(UFFDIO, _UFFDIO_MOVE, struct uffdio_move)
+#endif
+
 //
 // The UFFDIO_COPY_MODE_WP is only defined in later versions of Linux (>5.0)
 //
@@ -50,26 +72,111 @@ namespace Umap {
       ~Uffd( void);
 
       void process_page(bool iswrite, char* addr );
+
+      //
+      // Returns once the uffd thread is done with the regions it looked
+      // faults up in, so that a region removed before the call may be
+      // freed.
+      //
+      void wait_for_dispatch( void );
       void register_region( RegionDescriptor* region );
       void unregister_region( RegionDescriptor* region );
 
-      void  enable_write_protect( void* );
-      void disable_write_protect( void* );
-      void copy_in_page(char* data, void* page_address);
-      void copy_in_page_and_write_protect(char* data, void* page_address);
+      //
+      // len is the page size of the region the page belongs to
+      //
+      void  enable_write_protect( void*, uint64_t len );
+      void disable_write_protect( void*, uint64_t len );
+      void copy_in_page(char* data, void* page_address, uint64_t len);
+      void copy_in_page_and_write_protect(char* data, void* page_address, uint64_t len);
+
+      //
+      // Move the pages of data (a private anonymous mapping) into place
+      // instead of copying them.  Returns false, leaving data intact, if the
+      // kernel refused; the caller should then copy the page in instead.
+      // Moved pages are mapped writable, and a write to them before they
+      // could be write protected would go unseen, so only pages filled for
+      // a write may be moved.
+      //
+      bool move_in_page(char* data, void* page_address, uint64_t len);
+      bool have_move( void ) { return m_have_move; }
+
+      //
+      // Copy in (or, for shmem regions, map the page cache pages, filled
+      // through the region's alias mapping, of) len bytes of consecutive
+      // pages with a single ioctl, which also wakes every thread waiting on
+      // any of them.  Should the kernel stop part way, the copy goes on from
+      // there; pages found already present are left as they are.
+      // copy_in_pages() returns the number of bytes it copied.
+      //
+      uint64_t copy_in_pages(char* data, void* page_address, uint64_t len, bool write_protect);
+      void continue_pages(void* page_address, uint64_t len, bool write_protect);
+
+      //
+      // The buffer counts each fill it queues for a fault, and the fill
+      // worker counts it off once it is done reading for it.  While there
+      // are as many of those as fill workers, faults are held for
+      // UMAP_FILL_WINDOW.
+      //
+      void fill_queued( void ) { ++m_unread_fills; }
+      void fill_read_done( void );
+
+      //
+      // With UMAP_DIRTY_SCAN, the kernel lets writes to write protected
+      // pages through without a fault, and dirty pages are found by
+      // scanning instead.  scan_written() write protects the pages of
+      // [page_address, page_address + len) again and sets written[i] for
+      // each one that was written to since it was last protected.
+      //
+      bool dirty_scan( void ) { return m_dirty_scan; }
+      void scan_written(char* page_address, uint64_t len, uint64_t page_size, std::vector<bool>& written);
+
+      //
+      // Move pages out of a region into staging, a private anonymous
+      // mapping given to register_staging() first.  Returns the number of
+      // bytes moved, from the start.
+      //
+      void register_staging(char* staging, uint64_t len);
+      uint64_t move_out_pages(char* page_address, char* staging, uint64_t len);
+
+      //
+      // Features the running kernel offers, and whether it can handle
+      // shmem regions (minor faults, and mapping pages write protected with
+      // UFFDIO_CONTINUE when needed).  Both may be called before any Uffd
+      // exists.
+      //
+      static uint64_t kernel_features( void );
+      static bool shmem_supported( void );
 
     private:
       RegionManager&        m_rm;
       uint64_t              m_max_fault_events;
-      uint64_t              m_page_size;
       Buffer*               m_buffer;
       int                   m_uffd_fd;
       int                   m_pipe[2];
+      int                   m_wake[2];      // Written when held faults should go
+      std::atomic<bool>     m_holding;
+      std::atomic<uint64_t> m_unread_fills;
       std::vector<uffd_msg> m_events;
+      std::vector<Buffer::FaultEvent> m_batch;
+      std::vector<uffd_msg> m_held;   // Faults waiting out UMAP_FILL_WINDOW
+      std::mutex            m_dispatch_mutex;  // Held while faults are looked up and dispatched
+      bool                  m_numa_aware;
+      bool                  m_have_thread_id;
+      bool                  m_have_move;
+      bool                  m_dirty_scan;
+      int                   m_pagemap_fd;
+
+      struct ThreadNode { int node; uint64_t when_ns; };
+      std::unordered_map<uint32_t, ThreadNode> m_thread_nodes;
 
       void uffd_handler( void );
+      void dispatch_faults( uffd_msg* events, uint64_t nevents );
+      void dispatch_held( void );
+      int fault_node( const uffd_msg& msg, RegionDescriptor* rd );
       void ThreadEntry( void );
       void check_uffd_compatibility( void );
+      static bool continue_wp_supported( void );
   };
 } // end of namespace Umap
 #endif // _UMAP_Uffd_HPP
@@ -10,7 +10,9 @@
 #include <list>
 
 #include <cstdint>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "umap/Uffd.hpp"
@@ -25,6 +27,8 @@ class WorkQueue {
       :   m_max_waiting(max_workers)
         , m_waiting_workers(0)
         , m_idle_waiters(0)
+        , m_limit_workers(max_workers)
+        , m_target_busy(max_workers)
     {
       pthread_mutex_init(&m_mutex, NULL);
       pthread_cond_init(&m_cond, NULL);
@@ -37,10 +41,30 @@ class WorkQueue {
       pthread_cond_destroy(&m_idle_cond);
     }
 
-    void enqueue(T item) {
+    //
+    // Returns true when the queue has backed up beyond the idle workers and
+    // another worker may be started.  The new worker is counted right away,
+    // so the caller must either start it or call worker_start_failed().
+    //
+    bool enqueue(T item) {
       pthread_mutex_lock(&m_mutex);
       m_queue.push_back(item);
       pthread_cond_signal(&m_cond);
+
+      bool grow = (   m_max_waiting < m_limit_workers
+                   && m_queue.size() > m_waiting_workers
+                   && m_max_waiting - m_waiting_workers < m_target_busy );
+      if ( grow )
+        ++m_max_waiting;
+
+      pthread_mutex_unlock(&m_mutex);
+      return grow;
+    }
+
+    void worker_start_failed( void ) {
+      pthread_mutex_lock(&m_mutex);
+      --m_max_waiting;
+      signal_if_idle();
       pthread_mutex_unlock(&m_mutex);
     }
 
@@ -51,7 +75,7 @@ class WorkQueue {
 
       while ( m_queue.size() == 0 ) {
         if (m_waiting_workers == m_max_waiting && m_idle_waiters)
-          pthread_cond_signal(&m_idle_cond);
+          pthread_cond_broadcast(&m_idle_cond);
 
         pthread_cond_wait(&m_cond, &m_mutex);
       }
@@ -65,6 +89,71 @@ class WorkQueue {
       return item;
     }
 
+    //
+    // Like dequeue(), but gives up after idle_ms without work.  When that
+    // happens and there are more than min_workers workers, the caller is
+    // removed from the count of workers and false is returned; the caller
+    // is expected to exit.
+    //
+    bool dequeue_or_retire(T& item, uint64_t idle_ms, uint64_t min_workers) {
+      pthread_mutex_lock(&m_mutex);
+
+      ++m_waiting_workers;
+
+      while ( m_queue.size() == 0 ) {
+        if (m_waiting_workers == m_max_waiting && m_idle_waiters)
+          pthread_cond_broadcast(&m_idle_cond);
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += idle_ms / 1000;
+        ts.tv_nsec += (idle_ms % 1000) * 1000000;
+        if ( ts.tv_nsec >= 1000000000 ) {
+          ts.tv_sec++;
+          ts.tv_nsec -= 1000000000;
+        }
+
+        if ( pthread_cond_timedwait(&m_cond, &m_mutex, &ts) == ETIMEDOUT
+            && m_queue.size() == 0 && m_max_waiting > min_workers ) {
+          --m_waiting_workers;
+          --m_max_waiting;
+          signal_if_idle();
+          pthread_mutex_unlock(&m_mutex);
+          return false;
+        }
+      }
+
+      --m_waiting_workers;
+
+      item = m_queue.front();
+      m_queue.pop_front();
+
+      pthread_mutex_unlock(&m_mutex);
+      return true;
+    }
+
+    //
+    // Upper bounds for growing the number of workers in enqueue(): the
+    // number of workers, and the number of them that may be busy at once.
+    //
+    void set_limits(uint64_t max_workers, uint64_t target_busy) {
+      pthread_mutex_lock(&m_mutex);
+      m_limit_workers = max_workers;
+      m_target_busy = target_busy;
+      pthread_mutex_unlock(&m_mutex);
+    }
+
+    uint64_t num_workers( void ) {
+      pthread_mutex_lock(&m_mutex);
+      uint64_t n = m_max_waiting;
+      pthread_mutex_unlock(&m_mutex);
+      return n;
+    }
+
+    //
+    // More than one thread may wait, e.g. umap_advise() and uunmap() both
+    // waiting for the evictors, so all of them are woken.
+    //
     void wait_for_idle( void ) {
       pthread_mutex_lock(&m_mutex);
       ++m_idle_waiters;
@@ -84,6 +173,11 @@ class WorkQueue {
     }
 
   private:
+    void signal_if_idle( void ) {
+      if (m_queue.size() == 0 && m_waiting_workers == m_max_waiting && m_idle_waiters)
+        pthread_cond_broadcast(&m_idle_cond);
+    }
+
     pthread_mutex_t m_mutex;
     pthread_cond_t m_cond;
     pthread_cond_t m_idle_cond;
@@ -91,6 +185,8 @@ class WorkQueue {
     uint64_t m_max_waiting;
     uint64_t m_waiting_workers;
     int m_idle_waiters;
+    uint64_t m_limit_workers;
+    uint64_t m_target_busy;
 };
 
 } // end of namespace Umap
@@ -7,7 +7,9 @@
 #ifndef _UMAP_Pthread_HPP
 #define _UMAP_Pthread_HPP
 
+#include <algorithm>
 #include <cstdint>
+#include <mutex>
 #include <pthread.h>
 #include <string>
 #include <vector>
@@ -18,7 +20,7 @@
 
 namespace Umap {
   struct WorkItem {
-    enum WorkType { NONE, EXIT, THRESHOLD, EVICT, FAST_EVICT, FLUSH };
+    enum WorkType { NONE, EXIT, THRESHOLD, EVICT, FAST_EVICT, FLUSH, PREFETCH };
     PageDescriptor* page_desc;
     WorkType type;
   };
@@ -35,6 +37,7 @@ namespace Umap {
       case Umap::WorkItem::WorkType::EVICT: os << ", type: " << "EVICT"; break;
       case Umap::WorkItem::WorkType::FAST_EVICT: os << ", type: " << "FAST_EVICT"; break;
       case Umap::WorkItem::WorkType::FLUSH: os << ", type: " << "FLUSH"; break;
+      case Umap::WorkItem::WorkType::PREFETCH: os << ", type: " << "PREFETCH"; break;
     }
 
     os << " }";
@@ -47,6 +50,14 @@ namespace Umap {
         :   m_pool_name(pool_name)
           , m_num_threads(num_threads)
           , m_wq(new WorkQueue<WorkItem>(num_threads))
+          , m_elastic(false)
+          , m_min_threads(num_threads)
+          , m_max_threads(num_threads)
+          , m_idle_ms(0)
+          , m_target_busy(num_threads)
+          , m_latency_ewma(0)
+          , m_latency_floor(0)
+          , m_latency_samples(0)
       {
         if (m_pool_name.length() > 15)
           m_pool_name.resize(15);
@@ -58,53 +69,151 @@ namespace Umap {
       }
 
       void send_work(const WorkItem& work) {
-        m_wq->enqueue(work);
+        if ( m_wq->enqueue(work) )
+          start_thread();
       }
 
       WorkItem get_work() {
-        return m_wq->dequeue();
+        if ( ! m_elastic )
+          return m_wq->dequeue();
+
+        WorkItem w;
+
+        join_retired();
+
+        if ( ! m_wq->dequeue_or_retire(w, m_idle_ms, m_min_threads) ) {
+          //
+          // We have been idle for a while and there are enough others to
+          // cover for us.  Leave our thread to be joined by the next worker
+          // to look for work, or by stop_thread_pool().
+          //
+          std::lock_guard<std::mutex> guard(m_threads_mutex);
+          m_retired.push_back(pthread_self());
+          w.page_desc = nullptr;
+          w.type = Umap::WorkItem::WorkType::EXIT;
+        }
+        return w;
       }
 
       bool wq_is_empty( void ) {
         return m_wq->is_empty();
       }
 
-      void start_thread_pool() {
-        UMAP_LOG(Debug, "Starting " <<  m_pool_name << " Pool of "
-            << m_num_threads << " threads");
+      //
+      // Restrict the threads of the pool to the given cpus.  Must be called
+      // before start_thread_pool(); an empty set leaves affinity alone.
+      //
+      void set_cpus( const std::vector<int>& cpus ) {
+        m_cpus = cpus;
+      }
 
-        for ( uint64_t i = 0; i < m_num_threads; ++i) {
-          pthread_t t;
+      //
+      // Let the pool run between min_threads and max_threads threads.  It
+      // starts with min_threads, adds a thread whenever work is queued with
+      // no idle thread to take it (while fewer than the in-flight target are
+      // busy), and lets a thread go after idle_ms without work.  Must be
+      // called before start_thread_pool().
+      //
+      void set_elastic( uint64_t min_threads, uint64_t max_threads, uint64_t idle_ms ) {
+        if ( min_threads == 0 )
+          min_threads = 1;
+        if ( min_threads >= max_threads )
+          return;
 
-          if (pthread_create(&t, NULL, ThreadEntryFunc, this) != 0)
-            UMAP_ERROR("Failed to launch thread");
+        m_elastic = true;
+        m_min_threads = min_threads;
+        m_max_threads = max_threads;
+        m_idle_ms = idle_ms;
+        m_target_busy = max_threads;
+
+        delete m_wq;
+        m_num_threads = min_threads;
+        m_wq = new WorkQueue<WorkItem>(min_threads);
+        m_wq->set_limits(m_max_threads, m_target_busy);
+      }
+
+      //
+      // Workers of an elastic pool report how long each store operation
+      // took.  Once the latency climbs well above the best we have seen, the
+      // store is saturated and more concurrency would only add queueing, so
+      // the in-flight target is cut back; otherwise it creeps up again.
+      //
+      void record_latency( uint64_t ns ) {
+        const uint64_t window = 64;
+
+        if ( ! m_elastic )
+          return;
+
+        std::lock_guard<std::mutex> guard(m_latency_mutex);
+
+        m_latency_ewma = m_latency_ewma ? (m_latency_ewma * 7 + ns) / 8 : ns;
 
-          if (pthread_setname_np(t, m_pool_name.c_str()) != 0)
-            UMAP_ERROR("Failed to set thread name");
+        if ( m_latency_floor == 0 || m_latency_ewma < m_latency_floor )
+          m_latency_floor = m_latency_ewma;
 
-          m_threads.push_back(t);
+        if ( ++m_latency_samples < window )
+          return;
+        m_latency_samples = 0;
+
+        if ( m_latency_ewma > 2 * m_latency_floor ) {
+          m_target_busy -= m_target_busy / 4;
+          if ( m_target_busy < m_min_threads )
+            m_target_busy = m_min_threads;
+
+          // Let the floor follow the store if it has really become slower
+          m_latency_floor += (m_latency_ewma - m_latency_floor) / 16;
         }
+        else if ( m_target_busy < m_max_threads ) {
+          ++m_target_busy;
+        }
+
+        m_wq->set_limits(m_max_threads, m_target_busy);
+      }
+
+      void start_thread_pool() {
+        UMAP_LOG(Debug, "Starting " <<  m_pool_name << " Pool of "
+            << m_num_threads << " threads"
+            << (m_elastic ? " (elastic up to " + std::to_string(m_max_threads) + ")" : ""));
+
+        for ( uint64_t i = 0; i < m_num_threads; ++i)
+          if ( ! launch_thread() )
+            UMAP_ERROR("Failed to launch thread");
       }
 
       void stop_thread_pool() {
+        uint64_t num_threads = m_wq->num_workers();
+
         UMAP_LOG(Debug, "Stopping " <<  m_pool_name << " Pool of "
-            << m_num_threads << " threads");
+            << num_threads << " threads");
 
         WorkItem w = {.page_desc = nullptr, .type = Umap::WorkItem::WorkType::EXIT };
 
+        //
+        // Make sure the EXIT messages below do not start more threads
+        //
+        m_wq->set_limits(0, 0);
+
         //
         // This will inform all of the threads it is time to go away
         //
-        for ( uint64_t i = 0; i < m_num_threads; ++i)
+        for ( uint64_t i = 0; i < num_threads; ++i)
           send_work(w);
 
         //
-        // Wait for all of the threads to exit
+        // Wait for all of the threads to exit, including any that retired
+        // on their own and have not been joined yet
         //
-        for ( auto pt : m_threads )
+        std::vector<pthread_t> threads;
+        {
+          std::lock_guard<std::mutex> guard(m_threads_mutex);
+          threads.swap(m_threads);
+        }
+
+        for ( auto pt : threads )
           (void) pthread_join(pt, NULL);
 
-        m_threads.clear();
+        std::lock_guard<std::mutex> guard(m_threads_mutex);
+        m_retired.clear();
 
         UMAP_LOG(Debug, m_pool_name << " stopped");
       }
@@ -122,10 +231,96 @@ namespace Umap {
         return NULL;
       }
 
+      bool launch_thread( void ) {
+        //
+        // Affinity is set at creation so that anything the thread allocates
+        // on start up is first touched on the right cpus.
+        //
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+
+        if ( ! m_cpus.empty() ) {
+          cpu_set_t cpuset;
+
+          CPU_ZERO(&cpuset);
+          for ( auto c : m_cpus )
+            if ( c >= 0 && c < CPU_SETSIZE )
+              CPU_SET(c, &cpuset);
+
+          if (pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset) != 0)
+            UMAP_ERROR("Failed to set thread affinity");
+        }
+
+        pthread_t t;
+        int rval = pthread_create(&t, &attr, ThreadEntryFunc, this);
+
+        pthread_attr_destroy(&attr);
+
+        if ( rval != 0 )
+          return false;
+
+        if (pthread_setname_np(t, m_pool_name.c_str()) != 0)
+          UMAP_ERROR("Failed to set thread name");
+
+        std::lock_guard<std::mutex> guard(m_threads_mutex);
+        m_threads.push_back(t);
+        return true;
+      }
+
+      //
+      // Join the threads that have retired.  This is done by the workers
+      // rather than by send_work(), whose callers may hold locks.  A thread
+      // that is no longer in m_threads has been taken by stop_thread_pool(),
+      // which joins it instead.
+      //
+      void join_retired( void ) {
+        std::vector<pthread_t> joinable;
+        {
+          std::lock_guard<std::mutex> guard(m_threads_mutex);
+
+          for ( auto pt : m_retired ) {
+            auto it = std::find(m_threads.begin(), m_threads.end(), pt);
+
+            if ( it != m_threads.end() ) {
+              m_threads.erase(it);
+              joinable.push_back(pt);
+            }
+          }
+          m_retired.clear();
+        }
+
+        for ( auto pt : joinable )
+          (void) pthread_join(pt, NULL);
+      }
+
+      //
+      // Grow an elastic pool by one thread.  The work queue has already
+      // counted it.
+      //
+      void start_thread( void ) {
+        if ( ! launch_thread() ) {
+          UMAP_LOG(Debug, m_pool_name << ": unable to add a thread");
+          m_wq->worker_start_failed();
+        }
+      }
+
       std::string             m_pool_name;
       uint64_t                m_num_threads;
       WorkQueue<WorkItem>*    m_wq;
       std::vector<pthread_t>  m_threads;
+      std::vector<pthread_t>  m_retired;
+      std::mutex              m_threads_mutex;
+      std::vector<int>        m_cpus;
+
+      bool                    m_elastic;
+      uint64_t                m_min_threads;
+      uint64_t                m_max_threads;
+      uint64_t                m_idle_ms;
+      uint64_t                m_target_busy;
+      std::mutex              m_latency_mutex;
+      uint64_t                m_latency_ewma;
+      uint64_t                m_latency_floor;
+      uint64_t                m_latency_samples;
   };
 } // end of namespace Umap
 #endif // _UMAP_WorkerPool_HPP
@@ -13,4 +13,22 @@ namespace Umap {
   {
     return new StoreFile{_region_, _rsize_, _alignsize_, _fd_, _file_offset_};
   }
+
+  ssize_t Store::read_from_store_v(const struct iovec* iov, int iovcnt, off_t off)
+  {
+    ssize_t total = 0;
+
+    for ( int i = 0; i < iovcnt; ++i ) {
+      ssize_t nread = read_from_store((char*)iov[i].iov_base, iov[i].iov_len, off + total);
+
+      if ( nread == -1 )
+        return -1;
+
+      total += nread;
+
+      if ( (size_t)nread < iov[i].iov_len )
+        break;    // End of the store
+    }
+    return total;
+  }
 }
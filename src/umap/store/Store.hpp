@@ -7,6 +7,7 @@
 #ifndef _UMAP_STORE_H_
 #define _UMAP_STORE_H_
 #include <cstdint>
+#include <sys/uio.h>
 #include <unistd.h>
 
 namespace Umap {
@@ -16,6 +17,14 @@ class Store {
 
     virtual ssize_t read_from_store(char* buf, std::size_t nb, off_t off) = 0;
     virtual ssize_t  write_to_store(char* buf, std::size_t nb, off_t off) = 0;
+
+    //
+    // Read the bytes at off into the iovcnt buffers of iov in turn, e.g.
+    // several pages that do not lie next to each other in memory.  Returns
+    // the number of bytes read, which is less than asked only at the end
+    // of the store.  Stores that cannot do better read one buffer at a time.
+    //
+    virtual ssize_t read_from_store_v(const struct iovec* iov, int iovcnt, off_t off);
 };
 } // end of namespace Umap
 #endif
@@ -4,12 +4,17 @@
 //
 // SPDX-License-Identifier: LGPL-2.1-only
 //////////////////////////////////////////////////////////////////////////////
+#include <errno.h>
+#include <limits.h>             // IOV_MAX
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/uio.h>
 #include "StoreFile.h"
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <string.h>
+#include <vector>
 
 #include "umap/store/Store.hpp"
 #include "umap/util/Macros.hpp"
@@ -23,38 +28,105 @@ namespace Umap {
         << " alignsize: " << alignsize << " fd: " << fd);
   }
 
+  //
+  // pread() and pwrite() may transfer less than asked, e.g. when
+  // interrupted or, for large pages, at the per-call size limit.  Reads
+  // stop short only at the end of the file; the caller zero-fills the rest.
+  //
   ssize_t StoreFile::read_from_store(char* buf, size_t nb, off_t off)
   {
-    size_t rval = 0;
+    size_t total = 0;
 
     UMAP_LOG(Debug, "pread(fd=" << fd << ", buf=" << (void*)buf
                     << ", nb=" << nb << ", off=" << off << ", file_offset=" << file_offset << ")";);
 
-    rval = pread(fd, buf, nb, off + file_offset);
+    while ( total < nb ) {
+      ssize_t rval = pread(fd, buf + total, nb - total, off + file_offset + total);
 
-    if (rval == -1) {
-      int eno = errno;
-      UMAP_ERROR("pread(fd=" << fd << ", buf=" << (void*)buf
-                      << ", nb=" << nb << ", off=" << off
-                      << "): Failed - " << strerror(eno));
+      if (rval == -1) {
+        int eno = errno;
+
+        if (eno == EINTR)
+          continue;
+
+        UMAP_ERROR("pread(fd=" << fd << ", buf=" << (void*)buf
+                        << ", nb=" << nb << ", off=" << off
+                        << "): Failed - " << strerror(eno));
+      }
+
+      if (rval == 0)
+        break;    // End of file
+
+      total += rval;
     }
-    return rval;
+    return total;
+  }
+
+  //
+  // One preadv() for the whole list, or one per IOV_MAX buffers.  A short
+  // read leaves us part way into some buffer; go on from there.
+  //
+  ssize_t StoreFile::read_from_store_v(const struct iovec* iov, int iovcnt, off_t off)
+  {
+    std::vector<struct iovec> left(iov, iov + iovcnt);
+    size_t total = 0;
+    int i = 0;
+
+    UMAP_LOG(Debug, "preadv(fd=" << fd << ", iovcnt=" << iovcnt
+                    << ", off=" << off << ", file_offset=" << file_offset << ")";);
+
+    while ( i < iovcnt ) {
+      ssize_t rval = preadv(fd, &left[i], std::min(iovcnt - i, IOV_MAX), off + file_offset + total);
+
+      if (rval == -1) {
+        int eno = errno;
+
+        if (eno == EINTR)
+          continue;
+
+        UMAP_ERROR("preadv(fd=" << fd << ", iovcnt=" << iovcnt
+                        << ", off=" << off << "): Failed - " << strerror(eno));
+      }
+
+      if (rval == 0)
+        break;    // End of file
+
+      total += rval;
+
+      while ( i < iovcnt && (size_t)rval >= left[i].iov_len )
+        rval -= left[i++].iov_len;
+
+      if ( i < iovcnt ) {
+        left[i].iov_base = (char*)left[i].iov_base + rval;
+        left[i].iov_len -= rval;
+      }
+    }
+    return total;
   }
 
   ssize_t  StoreFile::write_to_store(char* buf, size_t nb, off_t off)
   {
-    size_t rval = 0;
+    size_t total = 0;
 
     UMAP_LOG(Debug, "pwrite(fd=" << fd << ", buf=" << (void*)buf
                     << ", nb=" << nb << ", off=" << off << ")";);
 
-    rval = pwrite(fd, buf, nb, off + file_offset);
-    if (rval == -1) {
-      int eno = errno;
-      UMAP_ERROR("pwrite(fd=" << fd << ", buf=" << (void*)buf
-                      << ", nb=" << nb << ", off=" << off
-                      << "): Failed - " << strerror(eno));
+    while ( total < nb ) {
+      ssize_t rval = pwrite(fd, buf + total, nb - total, off + file_offset + total);
+
+      if (rval == -1) {
+        int eno = errno;
+
+        if (eno == EINTR)
+          continue;
+
+        UMAP_ERROR("pwrite(fd=" << fd << ", buf=" << (void*)buf
+                        << ", nb=" << nb << ", off=" << off
+                        << "): Failed - " << strerror(eno));
+      }
+
+      total += rval;
     }
-    return rval;
+    return total;
   }
 }
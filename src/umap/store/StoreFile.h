@@ -17,6 +17,7 @@ namespace Umap {
 
       ssize_t read_from_store(char* buf, size_t nb, off_t off);
       ssize_t  write_to_store(char* buf, size_t nb, off_t off);
+      ssize_t read_from_store_v(const struct iovec* iov, int iovcnt, off_t off);
     private:
       void* region;
       void* alignment_buffer;
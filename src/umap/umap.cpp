@@ -9,13 +9,16 @@
 #include <errno.h>              // strerror()
 #include <string.h>             // strerror()
 #include <sys/mman.h>
+#include <unistd.h>             // ftruncate()
 
 #include "umap/config.h"
 
 #include "umap/RegionManager.hpp"
+#include "umap/SharedPages.hpp"
 #include "umap/umap.h"
 #include "umap/store/Store.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
 
 void*
 umap(
@@ -37,6 +40,28 @@ umap(
   return Umap::umap_ex(region_addr, region_size, prot, flags, fd, offset, nullptr);
 }
 
+void*
+umap_variable(
+    void* region_addr
+  , uint64_t region_size
+  , int prot
+  , int flags
+  , int fd
+  , off_t offset
+  , uint64_t page_size
+)
+{
+  UMAP_LOG(Debug, 
+      "region_addr: " << region_addr
+      << ", region_size: " << region_size
+      << ", prot: " << prot
+      << ", flags: " << flags
+      << ", offset: " << offset
+      << ", page_size: " << page_size
+  );
+  return Umap::umap_ex(region_addr, region_size, prot, flags, fd, offset, nullptr, page_size);
+}
+
 int
 uunmap(void*  addr, uint64_t length)
 {
@@ -62,6 +87,46 @@ void umap_prefetch( int npages, umap_prefetch_item* page_array )
   Umap::RegionManager::getInstance().prefetch(npages, page_array);
 }
 
+int umap_prefetch_async( const umap_prefetch_range* ranges, int nranges, umap_prefetch_handle* handle )
+{
+  return Umap::RegionManager::getInstance().prefetch_async(ranges, nranges, handle);
+}
+
+int umap_prefetch_test( umap_prefetch_handle handle )
+{
+  return Umap::RegionManager::getInstance().prefetch_test(handle);
+}
+
+int umap_prefetch_wait( umap_prefetch_handle handle )
+{
+  return Umap::RegionManager::getInstance().prefetch_wait(handle);
+}
+
+int umap_get_region_stats( void* addr, struct umap_region_stats* stats )
+{
+  return Umap::RegionManager::getInstance().get_region_stats((char*)addr, stats);
+}
+
+int umap_get_all_region_stats( struct umap_region_stats* stats, int max_regions )
+{
+  return Umap::RegionManager::getInstance().get_all_region_stats(stats, max_regions);
+}
+
+int umap_set_region_numa_node( void* addr, int node )
+{
+  return Umap::RegionManager::getInstance().set_region_numa_node((char*)addr, node);
+}
+
+int umap_advise( void* addr, uint64_t length, int advice )
+{
+  return Umap::RegionManager::getInstance().advise((char*)addr, length, advice);
+}
+
+int umap_region_memfd( void* addr )
+{
+  return Umap::RegionManager::getInstance().get_region_memfd((char*)addr);
+}
+
 long
 umapcfg_get_system_page_size( void )
 {
@@ -74,6 +139,21 @@ umapcfg_get_max_pages_in_buffer( void )
   return Umap::RegionManager::getInstance().get_max_pages_in_buffer();
 }
 
+int
+umapcfg_set_max_pages_in_buffer( uint64_t max_pages )
+{
+  auto& rm = Umap::RegionManager::getInstance();
+
+  if ( max_pages == 0 || max_pages > rm.get_max_pages_in_memory() ) {
+    UMAP_LOG(Warning, "Invalid buffer size of " << max_pages
+        << " pages, must be between 1 and " << rm.get_max_pages_in_memory());
+    return -1;
+  }
+
+  rm.set_max_pages_in_buffer(max_pages);
+  return 0;
+}
+
 uint64_t
 umapcfg_get_read_ahead( void )
 {
@@ -116,10 +196,57 @@ umapcfg_get_max_fault_events( void )
   return Umap::RegionManager::getInstance().get_max_fault_events();
 }
 
+int
+umap_trace_dump( const char* filename )
+{
+  return Umap::trace::dump(filename);
+}
+
 namespace Umap {
   // A global variable to ensure thread-safety
   std::mutex g_mutex;
 
+//
+// Replace the anonymous mapping at umap_region with a shared mapping of
+// memfd (a new one if memfd is -1), and map the memfd a second time (the
+// alias) for the fill workers to write pages through.
+//
+static int
+map_shmem( void* umap_region, uint64_t umap_size, uint64_t umap_psize, int prot, int memfd, char** alias )
+{
+  const uint64_t huge_page_size = 2 * 1024 * 1024;
+
+  if ( memfd == -1 ) {
+    memfd = memfd_create("umap", MFD_CLOEXEC);
+
+    if ( memfd == -1 )
+      UMAP_ERROR("memfd_create failed: " << strerror(errno));
+
+    if ( ftruncate(memfd, umap_size) == -1 )
+      UMAP_ERROR("ftruncate of memfd failed: " << strerror(errno));
+  }
+
+  if ( mmap(umap_region, umap_size, prot, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED )
+    UMAP_ERROR("mmap of memfd failed: " << strerror(errno));
+
+  void* p = mmap(nullptr, umap_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+  if ( p == MAP_FAILED )
+    UMAP_ERROR("mmap of memfd alias failed: " << strerror(errno));
+
+  //
+  // With umap pages of huge page size the memfd may use huge pages, if
+  // /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it.
+  //
+  if ( umap_psize % huge_page_size == 0 ) {
+    madvise(umap_region, umap_size, MADV_HUGEPAGE);
+    madvise(p, umap_size, MADV_HUGEPAGE);
+  }
+
+  *alias = (char*)p;
+  return memfd;
+}
+
 void*
 umap_ex(
     void* region_addr
@@ -130,10 +257,25 @@ umap_ex(
   , off_t offset
   , Store* store
 )
+{
+  return umap_ex(region_addr, region_size, prot, flags, fd, offset, store,
+                  RegionManager::getInstance().get_umap_page_size());
+}
+
+void*
+umap_ex(
+    void* region_addr
+  , uint64_t region_size
+  , int prot
+  , int flags
+  , int fd
+  , off_t offset
+  , Store* store
+  , uint64_t umap_psize
+)
 {
   std::lock_guard<std::mutex> lock(g_mutex);
   auto& rm = RegionManager::getInstance();
-  auto umap_psize = rm.get_umap_page_size();
 
   UMAP_LOG(Info, 
       "region_addr: " << region_addr
@@ -153,24 +295,47 @@ umap_ex(
     UMAP_ERROR("only PROT_READ or PROT_WRITE is supported in UMap");
 #endif
     
-  //
-  // TODO: Allow for non-page-multiple size and zero-fill like mmap does
-  //
-  if ( ( region_size % umap_psize ) ) {
-    UMAP_ERROR("Region size " << region_size 
-                << " is not a multple of umapPageSize (" 
-                << rm.get_umap_page_size() << ")");
+  if (   umap_psize == 0 || (umap_psize & (umap_psize - 1))
+      || umap_psize % rm.get_system_page_size() ) {
+    UMAP_ERROR("Page size " << umap_psize << " is not a power of two multiple "
+                << "of the system page size (" << rm.get_system_page_size() << ")");
   }
 
+  if ( region_size == 0 )
+    UMAP_ERROR("Region size must not be 0");
+
   if ( ( (uint64_t)region_addr & (umap_psize - 1) ) ) {
     UMAP_ERROR("region_addr must be page aligned: " << region_addr
-      << ", page size is: " << rm.get_umap_page_size());
+      << ", page size is: " << umap_psize);
   }
 
-  if (!(flags & UMAP_PRIVATE) || flags & ~(UMAP_PRIVATE|UMAP_FIXED)) {
+  if (   !(flags & (UMAP_PRIVATE|UMAP_SHARED))
+      || (flags & UMAP_PRIVATE && flags & UMAP_SHARED)
+      || flags & ~(UMAP_PRIVATE|UMAP_SHARED|UMAP_FIXED|UMAP_SHMEM)) {
     UMAP_ERROR("Invalid flags: " << std::hex << flags);
   }
 
+  //
+  // Shared regions are read only: the processes sharing the pages could not
+  // tell which of them should write a dirty page back, or when.
+  //
+  bool shared = (flags & UMAP_SHARED);
+
+  if ( shared && prot != PROT_READ )
+    UMAP_ERROR("UMAP_SHARED regions must be PROT_READ");
+
+  if ( shared && fd < 0 )
+    UMAP_ERROR("UMAP_SHARED regions must be backed by a file descriptor");
+
+  bool shmem = shared || (flags & UMAP_SHMEM) || rm.get_shmem_regions();
+  flags = (flags & ~(UMAP_SHARED|UMAP_SHMEM)) | UMAP_PRIVATE;
+
+  if ( shmem && ! Uffd::shmem_supported() ) {
+    UMAP_LOG(Info, "userfaultfd does not support minor faults on shmem, "
+        "using anonymous memory" << (shared ? " private to this process" : ""));
+    shmem = shared = false;
+  }
+
   //
   // When dealing with umap-page-sizes that could be multiples of the actual
   // system-page-size, it is possible for mmap() to provide a region that is on
@@ -179,7 +344,11 @@ umap_ex(
   // We always allocate an additional umap-page-size set of bytes so that we can
   // make certain that the umap-region begins on a umap-page-size boundary.
   //
-  uint64_t mmap_size = region_size + umap_psize;
+  // Like mmap, a size that is not a multiple of the page size is rounded up
+  // and the rest of the last page reads as zeros.
+  //
+  uint64_t umap_size = (region_size + umap_psize - 1) & ~(umap_psize - 1);
+  uint64_t mmap_size = umap_size + umap_psize;
 
   void* mmap_region = mmap(region_addr, mmap_size,
                         prot, flags | (MAP_ANONYMOUS | MAP_NORESERVE), -1, 0);
@@ -188,15 +357,28 @@ umap_ex(
     UMAP_ERROR("mmap failed: " << strerror(errno));
     return UMAP_FAILED;
   }
-  uint64_t umap_size = region_size;
   void* umap_region;
   umap_region = (void*)((uint64_t)mmap_region + umap_psize - 1);
   umap_region = (void*)((uint64_t)umap_region & ~(umap_psize - 1));
 
+  int memfd = -1;
+  char* alias = nullptr;
+  SharedPages* shared_pages = nullptr;
+
+  if ( shared ) {
+    shared_pages = SharedPages::attach(fd, offset, umap_size, umap_psize);
+
+    if ( (memfd = dup(shared_pages->fd())) == -1 )
+      UMAP_ERROR("dup failed: " << strerror(errno));
+  }
+
+  if ( shmem )
+    memfd = map_shmem(umap_region, umap_size, umap_psize, prot, memfd, &alias);
+
   if ( store == nullptr )
-    store = Store::make_store(umap_region, umap_size, umap_psize, fd, offset);
+    store = Store::make_store(umap_region, region_size, umap_psize, fd, offset);
 
-  rm.addRegion(store, (char*)umap_region, umap_size, (char*)mmap_region, mmap_size);
+  rm.addRegion(store, (char*)umap_region, umap_size, (char*)mmap_region, mmap_size, prot, umap_psize, region_size, memfd, alias, shared_pages);
 
   return umap_region;
 }
@@ -37,6 +37,21 @@ void* umap_ex(
   , off_t         offset
   , Umap::Store*  store
 );
+
+/** As above, but with pages of page_size bytes instead of the default
+ * UMAP_PAGESIZE.  page_size must be a power of two multiple of the system
+ * page size.
+ */
+void* umap_ex(
+    void*         addr
+  , std::size_t   length
+  , int           prot
+  , int           flags
+  , int           fd
+  , off_t         offset
+  , Umap::Store*  store
+  , uint64_t      page_size
+);
 } // namespace Umap
 #endif // __cplusplus
 
@@ -58,6 +73,23 @@ void* umap(
   , off_t offset
 );
 
+/** Like umap(), but the region is managed in pages of page_size bytes
+ * rather than the default UMAP_PAGESIZE, e.g. small pages for an index that
+ * is looked up at random and large ones for arrays that are streamed.  All
+ * regions share the buffer, which holds UMAP_BUFSIZE pages of the default
+ * size worth of bytes.
+ * \param page_size A power of two multiple of the system page size
+ */
+void* umap_variable(
+    void* addr
+  , size_t length
+  , int prot
+  , int flags
+  , int fd
+  , off_t offset
+  , uint64_t page_size
+);
+
 int uunmap(
     void*  addr
   , size_t length
@@ -70,15 +102,131 @@ struct umap_prefetch_item {
 };
 
 void umap_prefetch( int npages, struct umap_prefetch_item* page_array );
+
+struct umap_prefetch_range {
+  void*    addr;              // Start of the range, rounded down to a umap page
+  uint64_t length;            // Bytes, rounded up to whole umap pages
+};
+
+typedef struct umap_prefetch_request* umap_prefetch_handle;
+
+/** Start bringing the pages of the given ranges into the buffer and return
+ * without waiting for them.  Adjacent pages are read from the store
+ * together.  Pages outside of any umap region are ignored.  The regions
+ * must stay mapped until the prefetch has completed.
+ * \param handle Set to a handle to pass to umap_prefetch_test() and
+ * umap_prefetch_wait()
+ * \return 0 on success, -1 if no region has been mapped yet
+ */
+int umap_prefetch_async( const struct umap_prefetch_range* ranges, int nranges,
+                         umap_prefetch_handle* handle );
+
+/** \return 1 if the prefetch has completed, 0 if it is still in progress
+ */
+int umap_prefetch_test( umap_prefetch_handle handle );
+
+/** Wait for the prefetch to complete and release the handle, which must not
+ * be used afterwards.  Every handle must be waited on once.
+ * \return 0
+ */
+int umap_prefetch_wait( umap_prefetch_handle handle );
+
+#define UMAP_STALL_BUCKETS 20
+
+struct umap_region_stats {
+  void*    region;            // Start address of the region
+  uint64_t region_size;       // Size of the region in bytes
+  uint64_t faults;            // Fault events received for the region
+  uint64_t write_faults;      // ... of which were write faults
+  uint64_t fills;             // Pages read in from the store
+  uint64_t evictions;         // Pages removed from the buffer
+  uint64_t write_backs;       // Dirty pages written to the store
+  uint64_t bytes_read;        // Bytes read from the store
+  uint64_t bytes_written;     // Bytes written to the store
+  uint64_t resident_pages;    // Pages of the region currently in the buffer
+  uint64_t page_size;         // Umap page size of the region
+  uint64_t stalls;            // Faults that waited for room in the buffer
+  uint64_t stall_ns;          // ... and the total time they waited
+  uint64_t stall_hist[UMAP_STALL_BUCKETS];  // Stalls of 2^i to 2^(i+1) microseconds;
+                                            // the first and last buckets are open
+  uint64_t shootdowns;        // Ranges of the region unmapped or write protected, each
+                              // of which interrupts every cpu running the process
+  uint64_t demand_fills;      // Fills of faulted pages (one per run of adjacent pages)
+  uint64_t demand_fill_ns;    // ... and their total time from fault to page present
+  uint64_t prefetch_fills;    // Chunks of read-ahead or umap_prefetch() filled
+  uint64_t prefetch_fill_ns;  // ... and their total time from request to pages present
+  uint64_t prefetch_cancelled;  // Pages of chunks dropped as they would be evicted unused
+};
+
+/** Retrieve the statistics of the region containing addr
+ * \return 0 on success, -1 if addr is not within a umap region
+ */
+int umap_get_region_stats( void* addr, struct umap_region_stats* stats );
+
+/** Retrieve the statistics of up to max_regions active regions
+ * \return The number of active regions, which may be larger than max_regions
+ */
+int umap_get_all_region_stats( struct umap_region_stats* stats, int max_regions );
+
+/** Fill the pages of the region containing addr from NUMA node node.  The
+ * fill workers of that node copy the pages in, so they are allocated on the
+ * node unless the region has its own memory policy.  A node of -1 restores
+ * the default of filling on the node of the faulting thread.  Only has an
+ * effect when UMAP_NUMA_AWARE is set on a multi-node system.
+ * \return 0 on success, -1 if addr is not within a umap region or node is
+ * not a valid node
+ */
+int umap_set_region_numa_node( void* addr, int node );
+
+/** Return the memfd backing the region containing addr, if it was mapped
+ * with UMAP_SHMEM or UMAP_SHARED.  The descriptor may be passed to another process (over
+ * a Unix socket) and mapped there with MAP_SHARED to see the pages that are
+ * resident in the region.  It remains owned by umap and is closed by uunmap.
+ * \return The memfd, or -1 if addr is not within a shmem umap region
+ */
+int umap_region_memfd( void* addr );
+
+/** Tell umap how the range [addr, addr + length) of a region will be
+ * accessed, like madvise(2).  The range is widened to whole umap pages and
+ * must lie within one region.
+ *  - UMAP_ADV_NORMAL: the default; read ahead UMAP_READ_AHEAD pages while
+ *    the buffer is below its low water mark
+ *  - UMAP_ADV_RANDOM: never read ahead
+ *  - UMAP_ADV_SEQUENTIAL: read ahead aggressively and evict pages soon
+ *    after the scan has passed them
+ *  - UMAP_ADV_WILLNEED: prefetch the range in the background
+ *  - UMAP_ADV_DONTNEED: evict the pages of the range that are in the
+ *    buffer, writing back dirty ones, and return when that is done
+ * The first three stay in effect for the range until changed.
+ * \return 0 on success, -1 if the range is not within a umap region or
+ * advice is not one of the above
+ */
+int umap_advise( void* addr, uint64_t length, int advice );
+
 uint64_t umapcfg_get_umap_page_size( void );
 uint64_t umapcfg_get_max_fault_events( void );
 uint64_t umapcfg_get_num_fillers( void );
 uint64_t umapcfg_get_num_evictors( void );
 uint64_t umapcfg_get_max_pages_in_buffer( void );
+
+/** Change the maximum number of umap pages held in the buffer.  This may be
+ * called while regions are mapped; when shrinking, the call returns once
+ * enough pages have been evicted to fit the new size.
+ * \return 0 on success, -1 if max_pages is 0 or more than the pages that
+ * fit in memory
+ */
+int      umapcfg_set_max_pages_in_buffer( uint64_t max_pages );
 uint64_t umapcfg_get_read_ahead( void );
 int      umapcfg_get_evict_low_water_threshold( void );
 int      umapcfg_get_evict_high_water_threshold( void );
 
+/** Write the events recorded so far to filename.  The file may be converted
+ * to Chrome trace / Perfetto JSON with the umaptrace tool.
+ * \return 0 on success, -1 on failure or when umap was built without
+ * ENABLE_TRACING
+ */
+int umap_trace_dump( const char* filename );
+
 #ifdef __cplusplus
 }
 #endif
@@ -86,8 +234,19 @@ int      umapcfg_get_evict_high_water_threshold( void );
 /*
  * flags
  */
-#define UMAP_PRIVATE    MAP_PRIVATE // Note - UMAP_SHARED not currently supported
+#define UMAP_PRIVATE    MAP_PRIVATE
+#define UMAP_SHARED     MAP_SHARED  // Read only; resident pages are shared with other processes mapping the same file
 #define UMAP_FIXED      MAP_FIXED   // See mmap(2) - This flag is currently then only flag supported.
+#define UMAP_SHMEM      0x40000000  // Back the region with a memfd and fill it through minor faults
+
+/*
+ * Advice for umap_advise()
+ */
+#define UMAP_ADV_NORMAL      MADV_NORMAL
+#define UMAP_ADV_RANDOM      MADV_RANDOM
+#define UMAP_ADV_SEQUENTIAL  MADV_SEQUENTIAL
+#define UMAP_ADV_WILLNEED    MADV_WILLNEED
+#define UMAP_ADV_DONTNEED    MADV_DONTNEED
 
 /*
  * Return codes
@@ -0,0 +1,169 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include "umap/util/Numa.hpp"
+
+#include <cstdlib>              // strtol()
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sched.h>              // sched_getcpu()
+#include <unistd.h>             // sysconf()
+
+namespace Umap {
+namespace numa {
+
+struct Topology {
+  std::vector<std::vector<int>> node_cpus;
+  std::vector<int>              cpu_node;
+};
+
+std::vector<int>
+parse_cpulist( const std::string& list )
+{
+  std::vector<int> cpus;
+  std::istringstream ss(list);
+  std::string range;
+
+  while ( std::getline(ss, range, ',') ) {
+    char* end;
+    const char* s = range.c_str();
+
+    while ( *s == ' ' || *s == '\n' )
+      ++s;
+    if ( *s == '\0' )
+      continue;
+
+    long first = strtol(s, &end, 10);
+    long last = first;
+
+    if ( end == s || first < 0 )
+      return std::vector<int>();
+
+    if ( *end == '-' ) {
+      s = end + 1;
+      last = strtol(s, &end, 10);
+      if ( end == s || last < first )
+        return std::vector<int>();
+    }
+
+    if ( *end != '\0' && *end != '\n' )
+      return std::vector<int>();
+
+    for ( long c = first; c <= last; ++c )
+      cpus.push_back((int)c);
+  }
+  return cpus;
+}
+
+static std::string read_line( const std::string& fname )
+{
+  std::ifstream f(fname);
+  std::string line;
+
+  std::getline(f, line);
+  return line;
+}
+
+static const Topology& topology( void )
+{
+  static Topology topo;
+  static std::once_flag once;
+
+  std::call_once(once, [] {
+    const std::string base("/sys/devices/system/node/");
+    std::vector<int> nodes = parse_cpulist(read_line(base + "online"));
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    if ( ncpus < 1 )
+      ncpus = 1;
+
+    topo.cpu_node.assign(ncpus, 0);
+
+    for ( auto n : nodes ) {
+      std::vector<int> cpus = parse_cpulist(read_line(base + "node" + std::to_string(n) + "/cpulist"));
+
+      if ( (int)topo.node_cpus.size() <= n )
+        topo.node_cpus.resize(n + 1);
+
+      for ( auto c : cpus ) {
+        if ( c >= (int)topo.cpu_node.size() )
+          topo.cpu_node.resize(c + 1, 0);
+        topo.cpu_node[c] = n;
+      }
+      topo.node_cpus[n] = cpus;
+    }
+
+    if ( topo.node_cpus.empty() ) {
+      topo.node_cpus.resize(1);
+      for ( long c = 0; c < ncpus; ++c )
+        topo.node_cpus[0].push_back((int)c);
+    }
+  });
+
+  return topo;
+}
+
+int
+num_nodes( void )
+{
+  return (int)topology().node_cpus.size();
+}
+
+const std::vector<int>&
+node_cpus( int node )
+{
+  return topology().node_cpus.at(node);
+}
+
+int
+cpu_to_node( int cpu )
+{
+  const Topology& t = topology();
+
+  if ( cpu < 0 || cpu >= (int)t.cpu_node.size() )
+    return -1;
+  return t.cpu_node[cpu];
+}
+
+int
+node_of_thread( pid_t tid )
+{
+  std::ifstream f("/proc/self/task/" + std::to_string(tid) + "/stat");
+  std::string stat;
+
+  if ( ! std::getline(f, stat) )
+    return -1;
+
+  //
+  // The command name may contain spaces, so count fields from the closing
+  // parenthesis.  The cpu last run on is field 39; the field after ")" is 3.
+  //
+  auto pos = stat.rfind(')');
+  if ( pos == std::string::npos )
+    return -1;
+
+  std::istringstream fields(stat.substr(pos + 1));
+  std::string field;
+
+  for ( int i = 3; i <= 39; ++i )
+    if ( ! (fields >> field) )
+      return -1;
+
+  return cpu_to_node(atoi(field.c_str()));
+}
+
+int
+current_node( void )
+{
+  return cpu_to_node(sched_getcpu());
+}
+
+} // end of namespace numa
+} // end of namespace Umap
@@ -0,0 +1,46 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef UMAP_Numa_HPP
+#define UMAP_Numa_HPP
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace Umap {
+namespace numa {
+
+//
+// Parse a Linux cpu list such as "0-3,8,10-11" into its members.  Returns an
+// empty vector if the list is malformed.
+//
+std::vector<int> parse_cpulist( const std::string& list );
+
+//
+// Topology is read from /sys/devices/system/node once and cached.  Machines
+// (or kernels) without NUMA support are reported as a single node 0 holding
+// every online cpu.
+//
+int num_nodes( void );
+const std::vector<int>& node_cpus( int node );
+int cpu_to_node( int cpu );
+
+//
+// Node of the cpu that thread tid (of this process) last ran on, or -1 if it
+// cannot be determined (e.g. the thread has exited).
+//
+int node_of_thread( pid_t tid );
+
+//
+// Node of the cpu the calling thread is running on
+//
+int current_node( void );
+
+} // end of namespace numa
+} // end of namespace Umap
+#endif // UMAP_Numa_HPP
@@ -0,0 +1,180 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include "umap/util/Trace.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>      // getenv(), strtoull()
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace Umap {
+namespace trace {
+
+#ifdef UMAP_TRACING
+
+static const char* env_trace_file = "UMAP_TRACE_FILE";
+static const char* env_trace_events = "UMAP_TRACE_EVENTS";
+static const uint64_t default_events_per_thread = 16384;
+
+//
+// Each thread owns one ring buffer and is its only writer, so recording an
+// event is a handful of stores and a single release of the head counter.
+// When the ring wraps, the oldest records are overwritten.
+//
+struct ThreadBuffer {
+  uint32_t              tid;
+  char                  name[16];
+  uint64_t              mask;
+  std::atomic<uint64_t> head;
+  Record*               records;
+};
+
+static std::mutex g_trace_mutex;
+
+//
+// Thread buffers are intentionally never released so that the records of
+// threads that have already exited are still available when dumping.
+//
+static std::vector<ThreadBuffer*>* g_buffers = new std::vector<ThreadBuffer*>;
+static thread_local ThreadBuffer* t_buffer = nullptr;
+
+static uint64_t events_per_thread( void )
+{
+  uint64_t n = default_events_per_thread;
+  char* val = getenv(env_trace_events);
+
+  if ( val != nullptr && strtoull(val, nullptr, 0) != 0 )
+    n = strtoull(val, nullptr, 0);
+
+  // Round up to a power of two so that the ring index is a simple mask
+  uint64_t rval = 1;
+  while ( rval < n )
+    rval <<= 1;
+  return rval;
+}
+
+static ThreadBuffer* register_thread( void )
+{
+  static const uint64_t capacity = events_per_thread();
+  ThreadBuffer* b = new ThreadBuffer;
+
+  b->tid = (uint32_t)syscall(__NR_gettid);
+  memset(b->name, 0, sizeof(b->name));
+  pthread_getname_np(pthread_self(), b->name, sizeof(b->name));
+  b->mask = capacity - 1;
+  b->head.store(0, std::memory_order_relaxed);
+  b->records = (Record*)calloc(capacity, sizeof(Record));
+
+  if ( b->records == nullptr ) {
+    // Out of memory: leave tracing disabled for this thread
+    b->mask = 0;
+  }
+
+  std::lock_guard<std::mutex> guard(g_trace_mutex);
+  g_buffers->push_back(b);
+  t_buffer = b;
+  return b;
+}
+
+void record( Event ev, Phase ph, const void* addr )
+{
+  ThreadBuffer* b = t_buffer;
+
+  if ( b == nullptr )
+    b = register_thread();
+
+  if ( b->records == nullptr )
+    return;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  uint64_t h = b->head.load(std::memory_order_relaxed);
+  Record& r = b->records[h & b->mask];
+
+  r.ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+  r.addr = (uint64_t)addr;
+  r.event = (uint16_t)ev;
+  r.phase = (uint16_t)ph;
+  r.pad = 0;
+
+  b->head.store(h + 1, std::memory_order_release);
+}
+
+int dump( const char* filename )
+{
+  std::lock_guard<std::mutex> guard(g_trace_mutex);
+  FILE* fp = fopen(filename, "w");
+
+  if ( fp == nullptr )
+    return -1;
+
+  FileHeader fh;
+  memcpy(fh.magic, TRACE_MAGIC, sizeof(fh.magic));
+  fh.pid = (uint32_t)getpid();
+  fh.num_threads = (uint32_t)g_buffers->size();
+  fwrite(&fh, sizeof(fh), 1, fp);
+
+  for ( auto b : *g_buffers ) {
+    uint64_t head = b->head.load(std::memory_order_acquire);
+    uint64_t capacity = (b->records != nullptr) ? b->mask + 1 : 0;
+    uint64_t n = head < capacity ? head : capacity;
+    ThreadHeader th;
+
+    th.tid = b->tid;
+    memcpy(th.name, b->name, sizeof(th.name));
+    th.dropped = (uint32_t)(head - n);
+    th.num_records = n;
+    fwrite(&th, sizeof(th), 1, fp);
+
+    for ( uint64_t i = head - n; i < head; ++i )
+      fwrite(&b->records[i & b->mask], sizeof(Record), 1, fp);
+  }
+
+  int rval = ferror(fp) ? -1 : 0;
+  if ( fclose(fp) != 0 )
+    rval = -1;
+  return rval;
+}
+
+//
+// Write the trace out when the library is unloaded if UMAP_TRACE_FILE is set
+//
+static struct TraceFinalizer {
+  ~TraceFinalizer() {
+    char* fname = getenv(env_trace_file);
+
+    if ( fname != nullptr && dump(fname) != 0 )
+      fprintf(stderr, "umap: failed to write trace to %s: %s\n",
+          fname, strerror(errno));
+  }
+} s_trace_finalizer;
+
+#else
+
+void record( Event, Phase, const void* )
+{
+}
+
+int dump( const char* )
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+#endif // UMAP_TRACING
+
+} // end of namespace trace
+} // end of namespace Umap
@@ -0,0 +1,111 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef UMAP_Trace_HPP
+#define UMAP_Trace_HPP
+
+#include <cstdint>
+
+#include "umap/config.h"
+
+namespace Umap {
+namespace trace {
+
+//
+// The event and phase identifiers are written verbatim into the trace file,
+// so new entries must only be appended.
+//
+enum Event {
+  FAULT = 0,        // Fault message received from userfaultfd
+  FILL,             // Fill worker handling a page
+  STORE_READ,       // Reading page contents from the store
+  UFFD_COPY,        // UFFDIO_COPY of page into the region
+  EVICT,            // Evict worker handling a page
+  WRITE_BACK,       // Writing a dirty page back to the store
+  EVICT_SCAN,       // Evict manager selecting victims
+  BUFFER_STALL,     // Fault waiting for a free page descriptor
+  UFFD_MOVE,        // UFFDIO_MOVE of a staging page into the region
+  UFFD_CONTINUE,    // UFFDIO_CONTINUE of a shmem page into the region
+  UNMAP,            // Unmapping a run of evicted pages
+
+  Num_Events
+};
+
+enum Phase {
+  INSTANT = 0,
+  BEGIN,
+  END
+};
+
+static const char* const EventName[ Num_Events ] = {
+  "fault",
+  "fill",
+  "store_read",
+  "uffd_copy",
+  "evict",
+  "write_back",
+  "evict_scan",
+  "buffer_stall",
+  "uffd_move",
+  "uffd_continue",
+  "unmap"
+};
+
+//
+// On-disk trace format, written by Trace::dump() and read by umaptrace:
+//
+//   FileHeader
+//   { ThreadHeader, Record[ThreadHeader::num_records] } * num_threads
+//
+// Records of each thread are written oldest first.
+//
+static const char TRACE_MAGIC[8] = { 'U', 'M', 'A', 'P', 'T', 'R', 'C', '1' };
+
+struct FileHeader {
+  char     magic[8];
+  uint32_t pid;
+  uint32_t num_threads;
+};
+
+struct ThreadHeader {
+  uint32_t tid;
+  char     name[16];
+  uint32_t dropped;       // Records overwritten before the dump
+  uint64_t num_records;
+};
+
+struct Record {
+  uint64_t ts_ns;         // CLOCK_MONOTONIC
+  uint64_t addr;
+  uint16_t event;
+  uint16_t phase;
+  uint32_t pad;
+};
+
+void record( Event ev, Phase ph, const void* addr );
+int  dump( const char* filename );
+
+} // end of namespace trace
+} // end of namespace Umap
+
+#ifdef UMAP_TRACING
+
+#define UMAP_TRACE( ev, addr )                                                \
+  Umap::trace::record(Umap::trace::ev, Umap::trace::INSTANT, (addr))
+#define UMAP_TRACE_BEGIN( ev, addr )                                          \
+  Umap::trace::record(Umap::trace::ev, Umap::trace::BEGIN, (addr))
+#define UMAP_TRACE_END( ev, addr )                                            \
+  Umap::trace::record(Umap::trace::ev, Umap::trace::END, (addr))
+
+#else
+
+#define UMAP_TRACE( ev, addr ) ((void)0)
+#define UMAP_TRACE_BEGIN( ev, addr ) ((void)0)
+#define UMAP_TRACE_END( ev, addr ) ((void)0)
+
+#endif // UMAP_TRACING
+
+#endif // UMAP_Trace_HPP
@@ -0,0 +1,84 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef UMAP_UffdCopy_HPP
+#define UMAP_UffdCopy_HPP
+
+#include <cstdint>
+
+#include <errno.h>
+#include <linux/userfaultfd.h>  // UFFDIO_COPY
+#include <sys/ioctl.h>          // ioctl()
+
+namespace Umap {
+namespace uffd {
+
+//
+// Copy len bytes from src into the range at dst, registered with the
+// userfaultfd fd, with as few UFFDIO_COPY calls as the kernel allows.  Only
+// headers are needed, so that tools measuring the ioctl without umap run
+// the very same loop.
+//
+// The kernel may stop part way, e.g. when it has to wait for mmap_lock or
+// when it comes to a page that is there already.  It has copied (and woken
+// the threads waiting on) what comes before.  A page that is there is left
+// alone and handed to present() before going on with the next one.
+//
+// Returns the number of bytes copied, or -1 with errno set on any other
+// error.  Each call made is counted in *ioctls if given.
+//
+template <typename Present>
+int64_t copy_pages( int fd, uint64_t dst, uint64_t src, uint64_t len, uint64_t mode,
+                    uint64_t page_size, Present present, uint64_t* ioctls = nullptr )
+{
+  uint64_t copied = 0;
+  struct uffdio_copy copy = {
+      .dst = dst
+    , .src = src
+    , .len = len
+    , .mode = mode
+    , .copy = 0
+  };
+
+  while ( 1 ) {
+    if ( ioctls != nullptr )
+      ++*ioctls;
+
+    if ( ioctl(fd, UFFDIO_COPY, &copy) == 0 ) {
+      copied += copy.len;
+      break;
+    }
+
+    int err = errno;
+
+    if ( copy.copy > 0 ) {
+      copied += copy.copy;
+      copy.dst += copy.copy;
+      copy.src += copy.copy;
+      copy.len -= copy.copy;
+    }
+    else if ( err == EEXIST ) {
+      present(copy.dst);
+      copy.dst += page_size;
+      copy.src += page_size;
+      copy.len -= page_size;
+    }
+    else if ( err != EAGAIN ) {
+      errno = err;
+      return -1;
+    }
+    copy.copy = 0;
+
+    if ( copy.len == 0 )
+      break;
+  }
+
+  return copied;
+}
+
+} // end of namespace uffd
+} // end of namespace Umap
+#endif // UMAP_UffdCopy_HPP
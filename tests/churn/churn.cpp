@@ -43,6 +43,7 @@
    Load Page to be paged in and out of the smaller Page_Buffer.
 */
 #include <iostream>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <chrono>
@@ -135,7 +136,37 @@ public:
         if (options.initonly)
             return;
 
+        have_stats = ! options.usemmap && umap_get_region_stats(base_addr, &stats_before) == 0;
+        auto start = steady_clock::now();
+
         this_thread::sleep_for(seconds(options.testduration));
+
+        elapsed = duration<double>(steady_clock::now() - start).count();
+        if ( have_stats )
+            umap_get_region_stats(base_addr, &stats_after);
+    }
+
+    //
+    // Shootdowns are the ranges umap unmapped or write protected, each of
+    // which interrupts every cpu running one of our threads
+    //
+    void report( void ) {
+        if (options.initonly)
+            return;
+
+        cout << "Churn reads/s: " << (uint64_t)(churn_reads / elapsed) << "\n";
+
+        if ( ! have_stats )
+            return;
+
+        auto rate = [&](uint64_t umap_region_stats::* field) {
+            return (uint64_t)((stats_after.*field - stats_before.*field) / elapsed);
+        };
+
+        cout << "Faults/s: " << rate(&umap_region_stats::faults) << "\n"
+             << "Evictions/s: " << rate(&umap_region_stats::evictions) << "\n"
+             << "Write backs/s: " << rate(&umap_region_stats::write_backs) << "\n"
+             << "Shootdowns/s: " << rate(&umap_region_stats::shootdowns) << "\n";
     }
 
     void stop( void ) {
@@ -167,6 +198,12 @@ private:
     vector<thread*> load_rw_writers;
     vector<thread*> churn_readers;
 
+    atomic<uint64_t> churn_reads{0};
+    double elapsed = 0.0;
+    bool have_stats = false;
+    umap_region_stats stats_before;
+    umap_region_stats stats_after;
+
     uint64_t num_churn_pages;
     uint64_t num_read_load_pages;
     uint64_t num_rw_load_pages;
@@ -237,7 +274,9 @@ private:
                 lock.unlock();
                 break;
             }
+            ++cnt;
         }
+        churn_reads += cnt;
         return cnt;
     }
 
@@ -314,6 +353,7 @@ int main(int argc, char **argv)
     test.start();
     test.run();
     test.stop();
+    test.report();
 
     return 0;
 }
@@ -0,0 +1,262 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Measures how much the umap service threads (uffd manager, fillers,
+ * evictors, evict manager) disturb compute threads running on the same
+ * machine.
+ *
+ * A set of compute threads, each pinned to one cpu of the -c list, runs a
+ * fixed amount of arithmetic over and over and records how long each
+ * quantum took.  At the same time pager threads read random pages of a umap
+ * region that is much larger than the umap buffer, which keeps the service
+ * threads busy filling and evicting.  Any quantum that takes longer than the
+ * fastest one was delayed by something else running on its cpu.
+ *
+ * Run it twice with the same options, once as is and once with the service
+ * threads confined to cpus outside of the compute set, and compare the tail
+ * latencies:
+ *
+ *   service_jitter -c 2-15 -P 0-1
+ *   UMAP_SERVICE_CPUS=0-1 service_jitter -c 2-15 -P 0-1
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "umap/umap.h"
+
+using namespace std;
+
+struct Options {
+  const char*  filename;
+  uint64_t     numpages;
+  uint64_t     bufpages;
+  uint64_t     seconds;
+  uint64_t     quantum;
+  uint64_t     pagers;
+  vector<int>  compute_cpus;
+  vector<int>  pager_cpus;
+};
+
+static void usage(const char* pname)
+{
+  cerr
+    << "Usage: " << pname << " [-c cpus] [-P cpus] [-w #] [-s #] [-q #] [-p #] [-b #] [-f name]\n\n"
+    << " -c cpus    - Cpus to run one compute thread each on, default: all\n"
+    << " -P cpus    - Cpus the pager threads may run on, default: any\n"
+    << " -w #       - Number of pager threads, default: 2\n"
+    << " -s #       - Seconds to run, default: 10\n"
+    << " -q #       - Arithmetic iterations per quantum, default: 100000\n"
+    << " -p #       - Pages in the umap region, default: 65536\n"
+    << " -b #       - Pages in the umap buffer, default: 1/16th of -p\n"
+    << " -f name    - Backing file, default: /tmp/service_jitter.dat\n\n"
+    << " Cpus are given as a list such as 0-3,8,10-11.  Confine the umap\n"
+    << " service threads with UMAP_SERVICE_CPUS or UMAP_FILLER_CPUS,\n"
+    << " UMAP_EVICTOR_CPUS, UMAP_UFFD_CPUS, and UMAP_EVICT_MANAGER_CPUS.\n";
+  exit(1);
+}
+
+static vector<int> parse_cpus(const char* list)
+{
+  vector<int> cpus;
+  const char* s = list;
+
+  while ( *s ) {
+    char* end;
+    long first = strtol(s, &end, 10);
+    long last = first;
+
+    if ( end == s )
+      usage("service_jitter");
+    if ( *end == '-' ) {
+      s = end + 1;
+      last = strtol(s, &end, 10);
+    }
+    for ( long c = first; c <= last; ++c )
+      cpus.push_back((int)c);
+    s = (*end == ',') ? end + 1 : end;
+  }
+  return cpus;
+}
+
+static void pin(const vector<int>& cpus)
+{
+  cpu_set_t set;
+
+  if ( cpus.empty() )
+    return;
+
+  CPU_ZERO(&set);
+  for ( auto c : cpus )
+    CPU_SET(c, &set);
+
+  if ( pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0 ) {
+    cerr << "pthread_setaffinity_np failed\n";
+    exit(1);
+  }
+}
+
+static uint64_t now_ns()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void compute(int cpu, uint64_t iterations, atomic<bool>* done, vector<uint64_t>* samples)
+{
+  volatile double sink;
+  double x = 1.0 + cpu;
+
+  pin(vector<int>(1, cpu));
+
+  while ( ! done->load(memory_order_relaxed) ) {
+    uint64_t start = now_ns();
+
+    for ( uint64_t i = 0; i < iterations; ++i )
+      x = x * 1.0000001 + 0.0000001;
+
+    samples->push_back(now_ns() - start);
+  }
+  sink = x;
+  (void)sink;
+}
+
+static void pager(const Options* opts, char* region, uint64_t pagesize, int seed,
+                  atomic<bool>* done, atomic<uint64_t>* touched)
+{
+  mt19937_64 gen(seed);
+  uniform_int_distribution<uint64_t> page(0, opts->numpages - 1);
+  uint64_t sum = 0;
+
+  pin(opts->pager_cpus);
+
+  while ( ! done->load(memory_order_relaxed) ) {
+    sum += region[page(gen) * pagesize];
+    touched->fetch_add(1, memory_order_relaxed);
+  }
+
+  if ( sum == 1 )   // Keep the reads from being optimized away
+    cout << "";
+}
+
+static double percentile(const vector<uint64_t>& sorted, double p)
+{
+  if ( sorted.empty() )
+    return 0.0;
+  return sorted[(size_t)((sorted.size() - 1) * p)] / 1000.0;
+}
+
+int main(int argc, char** argv)
+{
+  Options opts;
+  int c;
+
+  opts.filename = "/tmp/service_jitter.dat";
+  opts.numpages = 65536;
+  opts.bufpages = 0;
+  opts.seconds = 10;
+  opts.quantum = 100000;
+  opts.pagers = 2;
+
+  while ( (c = getopt(argc, argv, "c:P:w:s:q:p:b:f:h")) != -1 ) {
+    switch (c) {
+      case 'c': opts.compute_cpus = parse_cpus(optarg); break;
+      case 'P': opts.pager_cpus = parse_cpus(optarg); break;
+      case 'w': opts.pagers = strtoull(optarg, nullptr, 0); break;
+      case 's': opts.seconds = strtoull(optarg, nullptr, 0); break;
+      case 'q': opts.quantum = strtoull(optarg, nullptr, 0); break;
+      case 'p': opts.numpages = strtoull(optarg, nullptr, 0); break;
+      case 'b': opts.bufpages = strtoull(optarg, nullptr, 0); break;
+      case 'f': opts.filename = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if ( opts.compute_cpus.empty() )
+    for ( int i = 0; i < (int)thread::hardware_concurrency(); ++i )
+      opts.compute_cpus.push_back(i);
+
+  if ( opts.bufpages == 0 )
+    opts.bufpages = opts.numpages / 16 ? opts.numpages / 16 : 1;
+
+  uint64_t pagesize = umapcfg_get_umap_page_size();
+  uint64_t length = opts.numpages * pagesize;
+
+  umapcfg_set_max_pages_in_buffer(opts.bufpages);
+
+  int fd = open(opts.filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if ( fd == -1 || ftruncate(fd, length) != 0 ) {
+    cerr << "Unable to create " << opts.filename << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  char* region = (char*)umap(NULL, length, PROT_READ, UMAP_PRIVATE, fd, 0);
+  if ( region == UMAP_FAILED ) {
+    cerr << "umap failed: " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  atomic<bool> done(false);
+  atomic<uint64_t> touched(0);
+  vector<vector<uint64_t>> samples(opts.compute_cpus.size());
+  vector<thread> threads;
+
+  for ( size_t i = 0; i < opts.compute_cpus.size(); ++i ) {
+    samples[i].reserve(1 << 20);
+    threads.push_back(thread(compute, opts.compute_cpus[i], opts.quantum, &done, &samples[i]));
+  }
+
+  for ( uint64_t i = 0; i < opts.pagers; ++i )
+    threads.push_back(thread(pager, &opts, region, pagesize, (int)i, &done, &touched));
+
+  this_thread::sleep_for(chrono::seconds(opts.seconds));
+  done = true;
+
+  for ( auto& t : threads )
+    t.join();
+
+  uunmap(region, length);
+  close(fd);
+
+  vector<uint64_t> all;
+  for ( auto& s : samples )
+    all.insert(all.end(), s.begin(), s.end());
+  sort(all.begin(), all.end());
+
+  printf("compute threads:  %zu\n", opts.compute_cpus.size());
+  printf("pager threads:    %llu (%.0f pages/s)\n", (unsigned long long)opts.pagers,
+      touched.load() / (double)opts.seconds);
+  printf("fillers/evictors: %llu/%llu\n", (unsigned long long)umapcfg_get_num_fillers(),
+      (unsigned long long)umapcfg_get_num_evictors());
+  printf("quanta:           %zu\n", all.size());
+  printf("quantum (us):     min %.1f  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+      percentile(all, 0.0), percentile(all, 0.5), percentile(all, 0.99),
+      percentile(all, 0.999), percentile(all, 1.0));
+
+  if ( ! all.empty() && all[0] != 0 )
+    printf("p99.9 / min:      %.2f\n", (double)all[(size_t)((all.size() - 1) * 0.999)] / all[0]);
+
+  return 0;
+}
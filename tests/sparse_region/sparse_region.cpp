@@ -0,0 +1,209 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Maps a sparse file far larger than memory (16TiB by default) and reads
+ * and writes random pages of it, checking that the resident memory of the
+ * process stays bounded by the umap buffer rather than growing with the
+ * size of the region or with the number of distinct pages touched.
+ *
+ * Each touched page gets a tag written at its start.  A second pass reads
+ * every tagged page back, by then long since evicted and written to the
+ * file, and checks the tag; untouched pages of the sparse file read as
+ * zeros.
+ *
+ * The page tables of the process are reported as well but not checked:
+ * the kernel keeps a page table for every 2MiB of the region that has been
+ * touched, even after umap evicts the page, and does not count them in the
+ * RSS.  Regions mapped with umap_variable() and 2MiB pages need none.
+ *
+ *   sparse_region -s 16384 -t 50000 -b 1024
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "umap/umap.h"
+
+using namespace std;
+
+struct Options {
+  const char*  filename;
+  uint64_t     gigabytes;
+  uint64_t     touches;
+  uint64_t     bufpages;
+  uint64_t     slack_mb;
+};
+
+static void usage(const char* pname)
+{
+  cerr
+    << "Usage: " << pname << " [-s #] [-t #] [-b #] [-r #] [-f name]\n\n"
+    << " -s #       - Size of the region in GiB, default: 16384 (16TiB)\n"
+    << " -t #       - Random pages to touch, default: 20000\n"
+    << " -b #       - Pages in the umap buffer, default: 1024\n"
+    << " -r #       - MiB of RSS growth allowed beyond the buffer, default: 64\n"
+    << " -f name    - Backing file, default: /tmp/sparse_region.dat\n\n"
+    << " Filesystems that cap the file size (ext4 at 16TiB less a block)\n"
+    << " get the largest file they allow.\n";
+  exit(1);
+}
+
+//
+// A field of /proc/self/status, in KiB
+//
+static uint64_t status_kb(const string& field)
+{
+  ifstream status("/proc/self/status");
+  string line;
+
+  while ( getline(status, line) )
+    if ( line.compare(0, field.size() + 1, field + ":") == 0 )
+      return strtoull(line.c_str() + field.size() + 1, nullptr, 10);
+  return 0;
+}
+
+static uint64_t tag(uint64_t page)
+{
+  return page * 0x9e3779b97f4a7c15ULL | 1;
+}
+
+int main(int argc, char** argv)
+{
+  Options opts = { "/tmp/sparse_region.dat", 16384, 20000, 1024, 64 };
+  int c;
+
+  while ( (c = getopt(argc, argv, "s:t:b:r:f:h")) != -1 ) {
+    switch (c) {
+      case 's': opts.gigabytes = strtoull(optarg, nullptr, 0); break;
+      case 't': opts.touches = strtoull(optarg, nullptr, 0); break;
+      case 'b': opts.bufpages = strtoull(optarg, nullptr, 0); break;
+      case 'r': opts.slack_mb = strtoull(optarg, nullptr, 0); break;
+      case 'f': opts.filename = optarg; break;
+      default:  usage(argv[0]);
+    }
+  }
+
+  if ( opts.gigabytes == 0 || opts.touches == 0 || opts.bufpages == 0 )
+    usage(argv[0]);
+
+  //
+  // The buffer size is read when umap starts up with the first region
+  //
+  if ( getenv("UMAP_BUFSIZE") == nullptr )
+    setenv("UMAP_BUFSIZE", to_string(opts.bufpages).c_str(), 1);
+
+  uint64_t psize = umapcfg_get_umap_page_size();
+  uint64_t bufpages = umapcfg_get_max_pages_in_buffer();
+  uint64_t size = opts.gigabytes << 30;
+
+  unlink(opts.filename);
+  int fd = open(opts.filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+  if ( fd == -1 ) {
+    cerr << "Unable to create " << opts.filename << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  if ( ftruncate(fd, size) == -1 && errno == EFBIG )
+    size -= psize;
+
+  if ( ftruncate(fd, size) == -1 ) {
+    cerr << "Unable to size " << opts.filename << " to " << size << " bytes: " << strerror(errno) << "\n";
+    unlink(opts.filename);
+    return 1;
+  }
+
+  uint64_t rss_before = status_kb("VmRSS");
+  uint64_t pte_before = status_kb("VmPTE");
+
+  char* base = (char*)umap(nullptr, size, PROT_READ | PROT_WRITE, UMAP_PRIVATE, fd, 0);
+
+  if ( base == UMAP_FAILED ) {
+    cerr << "umap of " << size << " bytes failed: " << strerror(errno) << "\n";
+    unlink(opts.filename);
+    return 1;
+  }
+
+  //
+  // The buffer, a few of the prefetcher's and fillers' staging pages, and
+  // whatever the allocator keeps around
+  //
+  uint64_t rss_limit = rss_before + bufpages * psize / 1024 + opts.slack_mb * 1024;
+  uint64_t rss_max = status_kb("VmRSS");
+  uint64_t num_pages = size / psize;
+  mt19937_64 rng(12345);
+  uniform_int_distribution<uint64_t> pick(0, num_pages - 1);
+  vector<uint64_t> touched;
+  int errors = 0;
+
+  cout << "Region: " << (size >> 30) << " GiB, " << num_pages << " pages of " << psize
+       << " bytes, buffer: " << bufpages << " pages\n";
+
+  for ( uint64_t i = 0; i < opts.touches; ++i ) {
+    uint64_t page = pick(rng);
+    uint64_t* p = (uint64_t*)(base + page * psize);
+
+    if ( i & 1 ) {
+      if ( *p != 0 && *p != tag(page) ) {
+        cerr << "Page " << page << " reads " << *p << " before being written\n";
+        ++errors;
+      }
+    }
+    else {
+      *p = tag(page);
+      touched.push_back(page);
+    }
+
+    if ( (i & 1023) == 0 )
+      rss_max = max(rss_max, status_kb("VmRSS"));
+  }
+
+  for ( auto page : touched ) {
+    if ( *(uint64_t*)(base + page * psize) != tag(page) ) {
+      cerr << "Page " << page << " lost its tag\n";
+      ++errors;
+    }
+  }
+  rss_max = max(rss_max, status_kb("VmRSS"));
+
+  uint64_t pte_after = status_kb("VmPTE");
+
+  if ( uunmap(base, size) < 0 ) {
+    cerr << "uunmap failed\n";
+    ++errors;
+  }
+
+  close(fd);
+  unlink(opts.filename);
+
+  cout << "RSS: " << rss_before << " KiB before, " << rss_max << " KiB at most, limit "
+       << rss_limit << " KiB\n"
+       << "Page tables: " << pte_before << " KiB before, " << pte_after << " KiB after "
+       << opts.touches << " touches\n";
+
+  if ( rss_max > rss_limit ) {
+    cerr << "RSS grew beyond the buffer\n";
+    ++errors;
+  }
+
+  cout << (errors ? "FAILED" : "PASSED") << "\n";
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,276 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Measures what placing pages with one UFFDIO_COPY per run of adjacent
+ * pages, as the umap fill workers and prefetchers do, saves over one
+ * UFFDIO_COPY per page.
+ *
+ * For each run length, every page of a region registered with userfaultfd
+ * is placed once, run by run, and the region is emptied again with
+ * madvise() between rounds.  With -t, that many threads fault on the pages
+ * instead, each walking its own slice of the region, and a handler thread
+ * resolves each fault by copying in the run the page belongs to, waking
+ * all of the threads waiting on that run at once.  The ioctls issued, the
+ * time taken, and the throughput are reported per run length.
+ *
+ *   uffd_copy -p 65536 -r 64
+ *   uffd_copy -p 65536 -r 64 -t 4
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "umap/util/UffdCopy.hpp"
+
+using namespace std;
+
+struct Options {
+  uint64_t numpages;
+  uint64_t maxrun;
+  uint64_t rounds;
+  uint64_t threads;
+  bool     write_protect;
+};
+
+static void usage(const char* pname)
+{
+  cerr
+    << "Usage: " << pname << " [-p #] [-r #] [-n #] [-t #] [-w]\n\n"
+    << " -p #       - Pages in the region, default: 65536\n"
+    << " -r #       - Longest run to measure, in pages, default: 256;\n"
+    << "              runs of 1, 2, 4, ... pages up to it are measured\n"
+    << " -n #       - Rounds per run length, default: 4\n"
+    << " -t #       - Threads faulting on the pages, default: 0 (place\n"
+    << "              the pages without waiting for faults)\n"
+    << " -w         - Write protect the pages as they are copied in\n";
+  exit(1);
+}
+
+struct Result {
+  uint64_t ioctls;
+  double   seconds;
+};
+
+class CopyBench {
+  public:
+    CopyBench(const Options& opts) : m_opts(opts)
+    {
+      m_page_size = sysconf(_SC_PAGESIZE);
+      m_len = m_opts.numpages * m_page_size;
+
+      m_uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+      if ( m_uffd < 0 ) {
+        cerr << "userfaultfd: " << strerror(errno) << "\n";
+        exit(1);
+      }
+
+      struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+
+      if ( ioctl(m_uffd, UFFDIO_API, &api) == -1 ) {
+        cerr << "UFFDIO_API: " << strerror(errno) << "\n";
+        exit(1);
+      }
+
+      m_region = (char*)mmap(nullptr, m_len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      m_data = (char*)mmap(nullptr, m_opts.maxrun * m_page_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+      if ( m_region == MAP_FAILED || m_data == MAP_FAILED ) {
+        cerr << "mmap: " << strerror(errno) << "\n";
+        exit(1);
+      }
+      memset(m_data, 0x5a, m_opts.maxrun * m_page_size);
+
+      struct uffdio_register reg = {
+          .range = { .start = (uint64_t)m_region, .len = m_len }
+        , .mode = UFFDIO_REGISTER_MODE_MISSING
+      };
+
+#ifdef UFFDIO_REGISTER_MODE_WP
+      if ( m_opts.write_protect )
+        reg.mode |= UFFDIO_REGISTER_MODE_WP;
+#endif
+
+      if ( ioctl(m_uffd, UFFDIO_REGISTER, &reg) == -1 ) {
+        cerr << "UFFDIO_REGISTER: " << strerror(errno) << "\n";
+        exit(1);
+      }
+    }
+
+    ~CopyBench()
+    {
+      munmap(m_region, m_len);
+      munmap(m_data, m_opts.maxrun * m_page_size);
+      close(m_uffd);
+    }
+
+    Result run(uint64_t run_pages)
+    {
+      Result res = { 0, 0.0 };
+
+      for ( uint64_t round = 0; round < m_opts.rounds; ++round ) {
+        m_ioctls = 0;
+
+        auto start = chrono::steady_clock::now();
+
+        if ( m_opts.threads == 0 ) {
+          for ( uint64_t p = 0; p < m_opts.numpages; p += run_pages )
+            copy_run(p, run_pages);
+        }
+        else {
+          fault_in(run_pages);
+        }
+
+        res.seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        res.ioctls += m_ioctls;
+
+        madvise(m_region, m_len, MADV_DONTNEED);
+      }
+      return res;
+    }
+
+    uint64_t bytes() const { return m_len; }
+
+  private:
+    Options  m_opts;
+    uint64_t m_page_size;
+    uint64_t m_len;
+    int      m_uffd;
+    char*    m_region;
+    char*    m_data;
+    uint64_t m_ioctls;
+
+    //
+    // One UFFDIO_COPY for the run from page, with the loop the fill
+    // workers use, which goes on from where the kernel stopped and skips
+    // pages that turn out to be present
+    //
+    void copy_run(uint64_t page, uint64_t run_pages)
+    {
+      uint64_t npages = min(run_pages, m_opts.numpages - page);
+      uint64_t mode = 0;
+
+#ifdef UFFDIO_COPY_MODE_WP
+      if ( m_opts.write_protect )
+        mode = UFFDIO_COPY_MODE_WP;
+#endif
+
+      if ( Umap::uffd::copy_pages(m_uffd, (uint64_t)(m_region + page * m_page_size), (uint64_t)m_data,
+                                  npages * m_page_size, mode, m_page_size, [](uint64_t) {}, &m_ioctls) == -1 ) {
+        cerr << "UFFDIO_COPY: " << strerror(errno) << "\n";
+        exit(1);
+      }
+    }
+
+    //
+    // The faulting threads each read every page of their slice.  Faults
+    // on pages that a run has placed meanwhile are simply not taken.
+    //
+    void fault_in(uint64_t run_pages)
+    {
+      atomic<uint64_t> done(0);
+      vector<thread> threads;
+      uint64_t slice = (m_opts.numpages + m_opts.threads - 1) / m_opts.threads;
+
+      for ( uint64_t t = 0; t < m_opts.threads; ++t ) {
+        threads.push_back(thread([=, &done]() {
+          uint64_t first = t * slice;
+          uint64_t last = min(first + slice, m_opts.numpages);
+          volatile char sum = 0;
+
+          for ( uint64_t p = first; p < last; ++p )
+            sum += m_region[p * m_page_size];
+          done.fetch_add(1);
+        }));
+      }
+
+      struct pollfd pfd = { .fd = m_uffd, .events = POLLIN, .revents = 0 };
+      struct uffd_msg msgs[64];
+
+      while ( done.load() < m_opts.threads ) {
+        if ( poll(&pfd, 1, 10) <= 0 )
+          continue;
+
+        ssize_t n = read(m_uffd, msgs, sizeof(msgs));
+
+        if ( n <= 0 )
+          continue;
+
+        for ( uint64_t i = 0; i < (uint64_t)n / sizeof(msgs[0]); ++i ) {
+          if ( msgs[i].event != UFFD_EVENT_PAGEFAULT )
+            continue;
+
+          uint64_t page = (msgs[i].arg.pagefault.address - (uint64_t)m_region) / m_page_size;
+
+          copy_run(page - page % run_pages, run_pages);
+        }
+      }
+
+      for ( auto& t : threads )
+        t.join();
+    }
+};
+
+int main(int argc, char** argv)
+{
+  Options opts = { 65536, 256, 4, 0, false };
+  int c;
+
+  while ( (c = getopt(argc, argv, "p:r:n:t:wh")) != -1 ) {
+    switch (c) {
+      case 'p': opts.numpages = strtoull(optarg, nullptr, 0); break;
+      case 'r': opts.maxrun = strtoull(optarg, nullptr, 0); break;
+      case 'n': opts.rounds = strtoull(optarg, nullptr, 0); break;
+      case 't': opts.threads = strtoull(optarg, nullptr, 0); break;
+      case 'w': opts.write_protect = true; break;
+      default:  usage(argv[0]);
+    }
+  }
+
+  if ( opts.numpages == 0 || opts.maxrun == 0 || opts.rounds == 0 )
+    usage(argv[0]);
+
+#ifndef UFFDIO_COPY_MODE_WP
+  if ( opts.write_protect ) {
+    cerr << "This kernel's headers lack userfaultfd write protection\n";
+    return 1;
+  }
+#endif
+
+  CopyBench bench(opts);
+
+  printf("%8s %12s %12s %10s %10s %12s\n",
+         "run", "ioctls", "ioctls/page", "seconds", "GiB/s", "pages/s");
+
+  for ( uint64_t run = 1; run <= opts.maxrun; run *= 2 ) {
+    Result res = bench.run(run);
+    double pages = (double)opts.numpages * opts.rounds;
+
+    printf("%8lu %12lu %12.3f %10.3f %10.2f %12.0f\n",
+           (unsigned long)run, (unsigned long)res.ioctls, res.ioctls / pages, res.seconds,
+           bench.bytes() * opts.rounds / res.seconds / (1 << 30), pages / res.seconds);
+  }
+  return 0;
+}
@@ -0,0 +1,775 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2019 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Runs a set of named workloads over an array of 64 bit words held in a
+ * store, once through umap and once through plain mmap() of the same data,
+ * and reports each run as JSON (or CSV).
+ *
+ * The data is written afresh from the seed before every run, and dropped
+ * from the page cache, so that runs can be repeated and compared.  Each
+ * thread has a random number generator of its own, seeded from the seed and
+ * its number, and writes only to its own slice of the array.  So the
+ * checksum of a workload is the same for umap and mmap, and from run to run.
+ *
+ *   seq-read      each thread sums its slice
+ *   rand-read     words read at random from the whole array
+ *   seq-write     each thread overwrites its slice
+ *   rand-rmw      words of its slice incremented at random by each thread
+ *   zipf          words of pages chosen with a Zipf distribution, so that a
+ *                 hot set of pages takes most of the reads
+ *   stencil       a 5 point stencil over the first half of the array, as a
+ *                 grid, written to the second half
+ *   sort          each thread sorts its slice
+ *   multi-region  rand-read over the array split into several regions
+ *
+ * The umap buffer holds the given fraction of the data.  mmap() is given
+ * the page cache, which is not limited.  The store is either a file or,
+ * with -S memory, a copy of the data in memory that umap reads through a
+ * Umap::Store, optionally taking some time for each request as a remote
+ * store would.  The mmap() baseline for it is anonymous memory holding
+ * the data.
+ *
+ *   umap-bench -w all -t 4 -s 256 -r 0.25
+ *   umap-bench -w rand-read,zipf -S memory -L 100 -F csv
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "umap/umap.h"
+
+using namespace std;
+
+static const char* workload_names[] = {
+  "seq-read", "rand-read", "seq-write", "rand-rmw", "zipf", "stencil", "sort", "multi-region"
+};
+
+struct Options {
+  vector<string> workloads;
+  uint64_t       threads;
+  uint64_t       megabytes;
+  uint64_t       page_size;
+  double         buffer_ratio;
+  string         store;
+  uint64_t       latency_us;
+  uint64_t       ops;
+  uint64_t       regions;
+  double         zipf_skew;
+  uint64_t       seed;
+  bool           baseline;
+  string         format;
+  string         output;
+  string         dir;
+};
+
+static void usage(const char* pname)
+{
+  cerr
+    << "Usage: " << pname << " [-w list] [-t #] [-s #] [-P #] [-r #] [-S store] [-L #]\n"
+    << "       [-n #] [-m #] [-z #] [-R #] [-B] [-F json|csv] [-o file] [-d dir]\n\n"
+    << " -w list    - Workloads, separated by commas, or all, default: all\n"
+    << "              seq-read, rand-read, seq-write, rand-rmw, zipf, stencil,\n"
+    << "              sort, multi-region\n"
+    << " -t #       - Threads, default: 4\n"
+    << " -s #       - MiB of data, default: 256\n"
+    << " -P #       - Umap page size in bytes, default: UMAP_PAGESIZE\n"
+    << " -r #       - Fraction of the data the umap buffer holds, default: 0.25\n"
+    << " -S store   - file or memory, default: file\n"
+    << " -L #       - Microseconds each read or write of the memory store takes,\n"
+    << "              default: 0\n"
+    << " -n #       - Operations of the random workloads, default: 8 for every\n"
+    << "              page of the data\n"
+    << " -m #       - Regions of multi-region, default: 8\n"
+    << " -z #       - Skew of zipf, default: 0.99\n"
+    << " -R #       - Seed of the data and of the threads, default: 42\n"
+    << " -B         - Leave out the mmap() baseline\n"
+    << " -F format  - json or csv, default: json\n"
+    << " -o file    - Write the results to file, default: stdout\n"
+    << " -d dir     - Directory of the data file, default: /tmp\n";
+  exit(1);
+}
+
+static uint64_t splitmix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static uint64_t initial_value(uint64_t seed, uint64_t i)
+{
+  return splitmix64(seed ^ (i * 0x2545f4914f6cdd1dULL));
+}
+
+//
+// A store kept in memory, standing in for a remote one when given a
+// latency
+//
+class MemoryStore : public Umap::Store {
+  public:
+    MemoryStore(char* data, uint64_t latency_us) : m_data(data), m_latency_us(latency_us) {}
+
+    ssize_t read_from_store(char* buf, size_t nb, off_t off)
+    {
+      delay();
+      memcpy(buf, m_data + off, nb);
+      return nb;
+    }
+
+    ssize_t write_to_store(char* buf, size_t nb, off_t off)
+    {
+      delay();
+      memcpy(m_data + off, buf, nb);
+      return nb;
+    }
+
+    ssize_t read_from_store_v(const struct iovec* iov, int iovcnt, off_t off)
+    {
+      ssize_t total = 0;
+
+      delay();
+      for ( int i = 0; i < iovcnt; ++i ) {
+        memcpy(iov[i].iov_base, m_data + off + total, iov[i].iov_len);
+        total += iov[i].iov_len;
+      }
+      return total;
+    }
+
+  private:
+    char*    m_data;
+    uint64_t m_latency_us;
+
+    void delay()
+    {
+      if ( m_latency_us )
+        this_thread::sleep_for(chrono::microseconds(m_latency_us));
+    }
+};
+
+//
+// The array as the workloads see it: one or more regions of equal size
+//
+struct Data {
+  vector<uint64_t*> regions;
+  uint64_t          words_per_region;
+  uint64_t          words;
+
+  uint64_t& at(uint64_t i)
+  {
+    return regions[i / words_per_region][i % words_per_region];
+  }
+};
+
+struct Result {
+  string   workload;
+  string   engine;
+  double   seconds;
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t checksum;
+  uint64_t faults;
+  uint64_t fills;
+  uint64_t evictions;
+  uint64_t write_backs;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t stalls;
+  double   speedup;     // mmap seconds over umap seconds, umap runs only
+};
+
+class Bench {
+  public:
+    Bench(const Options& opts) : m_opts(opts), m_fd(-1)
+    {
+      m_bytes = m_opts.megabytes << 20;
+      m_words = m_bytes / sizeof(uint64_t);
+      m_path = m_opts.dir + "/umap_bench." + to_string(getpid()) + ".dat";
+
+      if ( m_opts.store == "memory" ) {
+        m_memory = (char*)mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if ( m_memory == MAP_FAILED ) {
+          cerr << "mmap of " << m_bytes << " bytes failed: " << strerror(errno) << "\n";
+          exit(1);
+        }
+      }
+    }
+
+    ~Bench()
+    {
+      if ( m_opts.store == "memory" )
+        munmap(m_memory, m_bytes);
+      else
+        unlink(m_path.c_str());
+    }
+
+    Result run(const string& workload, const string& engine)
+    {
+      Result res = Result();
+      uint64_t nregions = workload == "multi-region" ? m_opts.regions : 1;
+      bool use_umap = engine == "umap";
+
+      res.workload = workload;
+      res.engine = engine;
+
+      init_store();
+
+      if ( use_umap ) {
+        uint64_t psize = umapcfg_get_umap_page_size();
+        uint64_t pages = max((uint64_t)1, (uint64_t)(m_bytes * m_opts.buffer_ratio) / psize);
+
+        umapcfg_set_max_pages_in_buffer(pages);
+      }
+
+      Data data = map(nregions, use_umap);
+      struct rusage before, after;
+      umap_region_stats stats_before = region_stats(data);
+
+      getrusage(RUSAGE_SELF, &before);
+      auto start = chrono::steady_clock::now();
+
+      run_workload(workload, data, res);
+
+      //
+      // Written pages count once they have reached the store
+      //
+      if ( use_umap )
+        umap_flush();
+      else
+        for ( auto r : data.regions )
+          msync(r, data.words_per_region * sizeof(uint64_t), MS_SYNC);
+
+      res.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      getrusage(RUSAGE_SELF, &after);
+
+      if ( use_umap ) {
+        umap_region_stats stats = region_stats(data);
+
+        res.faults = stats.faults - stats_before.faults;
+        res.fills = stats.fills - stats_before.fills;
+        res.evictions = stats.evictions - stats_before.evictions;
+        res.write_backs = stats.write_backs - stats_before.write_backs;
+        res.bytes_read = stats.bytes_read - stats_before.bytes_read;
+        res.bytes_written = stats.bytes_written - stats_before.bytes_written;
+        res.stalls = stats.stalls - stats_before.stalls;
+      }
+      else {
+        res.faults = (after.ru_majflt - before.ru_majflt) + (after.ru_minflt - before.ru_minflt);
+      }
+
+      //
+      // What the writing workloads leave behind, for comparing engines
+      //
+      if ( workload == "seq-write" || workload == "rand-rmw" || workload == "stencil" || workload == "sort" ) {
+        res.checksum = 0;
+        for ( uint64_t i = 0; i < data.words; ++i )
+          res.checksum += data.at(i) * (i | 1);
+      }
+
+      unmap(data, use_umap);
+      return res;
+    }
+
+  private:
+    Options           m_opts;
+    uint64_t          m_bytes;
+    uint64_t          m_words;
+    string            m_path;
+    int               m_fd;
+    char*             m_memory;
+    vector<MemoryStore*> m_stores;
+
+    //
+    // The same data before every run, and none of it in the page cache
+    //
+    void init_store()
+    {
+      const uint64_t chunk_words = (1 << 20) / sizeof(uint64_t);
+      vector<uint64_t> chunk(chunk_words);
+
+      if ( m_opts.store == "memory" ) {
+        uint64_t* p = (uint64_t*)m_memory;
+
+        for ( uint64_t i = 0; i < m_words; ++i )
+          p[i] = initial_value(m_opts.seed, i);
+        return;
+      }
+
+      m_fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+      if ( m_fd == -1 ) {
+        cerr << "Unable to create " << m_path << ": " << strerror(errno) << "\n";
+        exit(1);
+      }
+
+      for ( uint64_t w = 0; w < m_words; w += chunk_words ) {
+        uint64_t n = min(chunk_words, m_words - w);
+
+        for ( uint64_t i = 0; i < n; ++i )
+          chunk[i] = initial_value(m_opts.seed, w + i);
+
+        if ( pwrite(m_fd, &chunk[0], n * sizeof(uint64_t), w * sizeof(uint64_t)) != (ssize_t)(n * sizeof(uint64_t)) ) {
+          cerr << "Unable to write " << m_path << ": " << strerror(errno) << "\n";
+          exit(1);
+        }
+      }
+
+      fsync(m_fd);
+      posix_fadvise(m_fd, 0, m_bytes, POSIX_FADV_DONTNEED);
+    }
+
+    Data map(uint64_t nregions, bool use_umap)
+    {
+      Data data;
+      uint64_t psize = m_opts.page_size;
+      uint64_t region_bytes = m_bytes / nregions / psize * psize;
+
+      if ( region_bytes == 0 ) {
+        cerr << "Too many regions for " << m_bytes << " bytes of " << psize << " byte pages\n";
+        exit(1);
+      }
+
+      data.words_per_region = region_bytes / sizeof(uint64_t);
+      data.words = data.words_per_region * nregions;
+
+      for ( uint64_t r = 0; r < nregions; ++r ) {
+        off_t offset = r * region_bytes;
+        void* p;
+
+        if ( use_umap && m_opts.store == "memory" ) {
+          auto store = new MemoryStore(m_memory + offset, m_opts.latency_us);
+
+          m_stores.push_back(store);
+          p = Umap::umap_ex(nullptr, region_bytes, PROT_READ | PROT_WRITE, UMAP_PRIVATE,
+                            -1, 0, store, psize);
+        }
+        else if ( use_umap ) {
+          p = umap_variable(nullptr, region_bytes, PROT_READ | PROT_WRITE, UMAP_PRIVATE,
+                            m_fd, offset, psize);
+        }
+        else if ( m_opts.store == "memory" ) {
+          p = mmap(nullptr, region_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if ( p != MAP_FAILED )
+            memcpy(p, m_memory + offset, region_bytes);
+        }
+        else {
+          p = mmap(nullptr, region_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset);
+        }
+
+        if ( p == UMAP_FAILED || p == MAP_FAILED ) {
+          cerr << (use_umap ? "umap" : "mmap") << " of " << region_bytes << " bytes failed: "
+               << strerror(errno) << "\n";
+          exit(1);
+        }
+        data.regions.push_back((uint64_t*)p);
+      }
+      return data;
+    }
+
+    void unmap(Data& data, bool use_umap)
+    {
+      for ( auto r : data.regions ) {
+        if ( use_umap )
+          uunmap(r, data.words_per_region * sizeof(uint64_t));
+        else
+          munmap(r, data.words_per_region * sizeof(uint64_t));
+      }
+
+      for ( auto s : m_stores )
+        delete s;
+      m_stores.clear();
+
+      if ( m_fd != -1 ) {
+        close(m_fd);
+        m_fd = -1;
+      }
+    }
+
+    static umap_region_stats region_stats(Data& data)
+    {
+      umap_region_stats total;
+
+      memset(&total, 0, sizeof(total));
+      for ( auto r : data.regions ) {
+        umap_region_stats s;
+
+        if ( umap_get_region_stats(r, &s) != 0 )
+          continue;
+        total.faults += s.faults;
+        total.fills += s.fills;
+        total.evictions += s.evictions;
+        total.write_backs += s.write_backs;
+        total.bytes_read += s.bytes_read;
+        total.bytes_written += s.bytes_written;
+        total.stalls += s.stalls;
+      }
+      return total;
+    }
+
+    //
+    // Runs fn(thread, first, last) on every thread, each with its own
+    // slice [first, last) of n, and returns the sum of what they return
+    //
+    template <typename Fn>
+    uint64_t parallel(uint64_t n, Fn fn)
+    {
+      vector<thread> threads;
+      vector<uint64_t> sums(m_opts.threads);
+      uint64_t slice = (n + m_opts.threads - 1) / m_opts.threads;
+
+      for ( uint64_t t = 0; t < m_opts.threads; ++t ) {
+        threads.push_back(thread([=, &sums, &fn]() {
+          uint64_t first = min(n, t * slice);
+          uint64_t last = min(n, first + slice);
+
+          sums[t] = fn(t, first, last);
+        }));
+      }
+
+      uint64_t sum = 0;
+      for ( uint64_t t = 0; t < m_opts.threads; ++t ) {
+        threads[t].join();
+        sum += sums[t];
+      }
+      return sum;
+    }
+
+    uint64_t random_ops(const Data& data)
+    {
+      if ( m_opts.ops )
+        return m_opts.ops;
+      return data.words / (m_opts.page_size / sizeof(uint64_t)) * 8;
+    }
+
+    void run_workload(const string& workload, Data& data, Result& res)
+    {
+      uint64_t seed = m_opts.seed;
+
+      if ( workload == "seq-read" ) {
+        res.ops = data.words;
+        res.checksum = parallel(data.words, [&](uint64_t, uint64_t first, uint64_t last) {
+          uint64_t sum = 0;
+
+          for ( uint64_t i = first; i < last; ++i )
+            sum += data.at(i);
+          return sum;
+        });
+        res.bytes = data.words * sizeof(uint64_t);
+      }
+      else if ( workload == "rand-read" || workload == "multi-region" ) {
+        res.ops = random_ops(data);
+        res.checksum = parallel(res.ops, [&](uint64_t t, uint64_t first, uint64_t last) {
+          mt19937_64 rng(seed + t);
+          uniform_int_distribution<uint64_t> pick(0, data.words - 1);
+          uint64_t sum = 0;
+
+          for ( uint64_t i = first; i < last; ++i )
+            sum += data.at(pick(rng));
+          return sum;
+        });
+        res.bytes = res.ops * sizeof(uint64_t);
+      }
+      else if ( workload == "seq-write" ) {
+        res.ops = data.words;
+        parallel(data.words, [&](uint64_t, uint64_t first, uint64_t last) {
+          for ( uint64_t i = first; i < last; ++i )
+            data.at(i) = i;
+          return (uint64_t)0;
+        });
+        res.bytes = data.words * sizeof(uint64_t);
+      }
+      else if ( workload == "rand-rmw" ) {
+        uint64_t ops = random_ops(data);
+        uint64_t per_thread = ops / m_opts.threads;
+
+        res.ops = per_thread * m_opts.threads;
+        parallel(data.words, [&](uint64_t t, uint64_t first, uint64_t last) {
+          mt19937_64 rng(seed + t);
+
+          if ( first == last )
+            return (uint64_t)0;
+
+          uniform_int_distribution<uint64_t> pick(first, last - 1);
+
+          for ( uint64_t i = 0; i < per_thread; ++i )
+            data.at(pick(rng)) += 1;
+          return (uint64_t)0;
+        });
+        res.bytes = res.ops * sizeof(uint64_t);
+      }
+      else if ( workload == "zipf" ) {
+        res.ops = random_ops(data);
+        res.checksum = zipf(data, res.ops);
+        res.bytes = res.ops * sizeof(uint64_t);
+      }
+      else if ( workload == "stencil" ) {
+        res.ops = stencil(data);
+        res.bytes = res.ops * sizeof(uint64_t);
+      }
+      else if ( workload == "sort" ) {
+        uint64_t* a = data.regions[0];
+
+        res.ops = data.words;
+        parallel(data.words, [&](uint64_t, uint64_t first, uint64_t last) {
+          std::sort(a + first, a + last);
+          return (uint64_t)0;
+        });
+        res.bytes = data.words * sizeof(uint64_t);
+      }
+    }
+
+    //
+    // Pages are ranked by a shuffle of the seed, and page k of the ranking
+    // is read with a probability proportional to 1 / (k + 1)^skew
+    //
+    uint64_t zipf(Data& data, uint64_t ops)
+    {
+      uint64_t words_per_page = m_opts.page_size / sizeof(uint64_t);
+      uint64_t npages = data.words / words_per_page;
+      vector<double> cdf(npages);
+      vector<uint64_t> rank(npages);
+      double total = 0.0;
+
+      for ( uint64_t k = 0; k < npages; ++k ) {
+        total += 1.0 / pow((double)(k + 1), m_opts.zipf_skew);
+        cdf[k] = total;
+        rank[k] = k;
+      }
+      shuffle(rank.begin(), rank.end(), mt19937_64(m_opts.seed));
+
+      return parallel(ops, [&](uint64_t t, uint64_t first, uint64_t last) {
+        mt19937_64 rng(m_opts.seed + t);
+        uniform_real_distribution<double> u(0.0, total);
+        uniform_int_distribution<uint64_t> word(0, words_per_page - 1);
+        uint64_t sum = 0;
+
+        for ( uint64_t i = first; i < last; ++i ) {
+          uint64_t k = lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin();
+
+          k = min(k, npages - 1);
+          sum += data.at(rank[k] * words_per_page + word(rng));
+        }
+        return sum;
+      });
+    }
+
+    //
+    // The first half of the array is a grid of rows a page long, and the
+    // second half receives the sum of each point and its four neighbors
+    //
+    uint64_t stencil(Data& data)
+    {
+      uint64_t cols = m_opts.page_size / sizeof(uint64_t);
+      uint64_t rows = data.words / 2 / cols;
+      uint64_t* in = data.regions[0];
+      uint64_t* out = in + rows * cols;
+
+      parallel(rows, [&](uint64_t, uint64_t first, uint64_t last) {
+        for ( uint64_t r = first; r < last; ++r ) {
+          uint64_t up = r ? r - 1 : r;
+          uint64_t down = r + 1 < rows ? r + 1 : r;
+
+          for ( uint64_t c = 0; c < cols; ++c ) {
+            uint64_t left = c ? c - 1 : c;
+            uint64_t right = c + 1 < cols ? c + 1 : c;
+
+            out[r * cols + c] = in[r * cols + c] + in[up * cols + c] + in[down * cols + c]
+                              + in[r * cols + left] + in[r * cols + right];
+          }
+        }
+        return (uint64_t)0;
+      });
+      return rows * cols;
+    }
+};
+
+static vector<string> split(const string& s)
+{
+  vector<string> parts;
+  stringstream ss(s);
+  string part;
+
+  while ( getline(ss, part, ',') )
+    if ( ! part.empty() )
+      parts.push_back(part);
+  return parts;
+}
+
+static void print_json(FILE* f, const Options& opts, const vector<Result>& results)
+{
+  fprintf(f, "{\n  \"config\": {\n");
+  fprintf(f, "    \"threads\": %lu,\n", (unsigned long)opts.threads);
+  fprintf(f, "    \"data_bytes\": %lu,\n", (unsigned long)(opts.megabytes << 20));
+  fprintf(f, "    \"page_size\": %lu,\n", (unsigned long)opts.page_size);
+  fprintf(f, "    \"buffer_ratio\": %g,\n", opts.buffer_ratio);
+  fprintf(f, "    \"store\": \"%s\",\n", opts.store.c_str());
+  fprintf(f, "    \"store_latency_us\": %lu,\n", (unsigned long)opts.latency_us);
+  fprintf(f, "    \"regions\": %lu,\n", (unsigned long)opts.regions);
+  fprintf(f, "    \"zipf_skew\": %g,\n", opts.zipf_skew);
+  fprintf(f, "    \"seed\": %lu\n", (unsigned long)opts.seed);
+  fprintf(f, "  },\n  \"results\": [\n");
+
+  for ( uint64_t i = 0; i < results.size(); ++i ) {
+    const Result& r = results[i];
+
+    fprintf(f, "    { \"workload\": \"%s\", \"engine\": \"%s\", \"seconds\": %.6f, "
+               "\"ops\": %lu, \"ops_per_sec\": %.0f, \"mib_per_sec\": %.1f, "
+               "\"checksum\": \"%016lx\", \"faults\": %lu, \"fills\": %lu, "
+               "\"evictions\": %lu, \"write_backs\": %lu, \"bytes_read\": %lu, "
+               "\"bytes_written\": %lu, \"stalls\": %lu",
+            r.workload.c_str(), r.engine.c_str(), r.seconds,
+            (unsigned long)r.ops, r.ops / r.seconds, r.bytes / r.seconds / (1 << 20),
+            (unsigned long)r.checksum, (unsigned long)r.faults, (unsigned long)r.fills,
+            (unsigned long)r.evictions, (unsigned long)r.write_backs, (unsigned long)r.bytes_read,
+            (unsigned long)r.bytes_written, (unsigned long)r.stalls);
+    if ( r.speedup > 0.0 )
+      fprintf(f, ", \"speedup_vs_mmap\": %.3f", r.speedup);
+    fprintf(f, " }%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+static void print_csv(FILE* f, const vector<Result>& results)
+{
+  fprintf(f, "workload,engine,seconds,ops,ops_per_sec,mib_per_sec,checksum,faults,fills,"
+             "evictions,write_backs,bytes_read,bytes_written,stalls,speedup_vs_mmap\n");
+
+  for ( auto& r : results ) {
+    fprintf(f, "%s,%s,%.6f,%lu,%.0f,%.1f,%016lx,%lu,%lu,%lu,%lu,%lu,%lu,%lu,",
+            r.workload.c_str(), r.engine.c_str(), r.seconds,
+            (unsigned long)r.ops, r.ops / r.seconds, r.bytes / r.seconds / (1 << 20),
+            (unsigned long)r.checksum, (unsigned long)r.faults, (unsigned long)r.fills,
+            (unsigned long)r.evictions, (unsigned long)r.write_backs, (unsigned long)r.bytes_read,
+            (unsigned long)r.bytes_written, (unsigned long)r.stalls);
+    if ( r.speedup > 0.0 )
+      fprintf(f, "%.3f", r.speedup);
+    fprintf(f, "\n");
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Options opts;
+  int c;
+
+  opts.threads = 4;
+  opts.megabytes = 256;
+  opts.page_size = 0;
+  opts.buffer_ratio = 0.25;
+  opts.store = "file";
+  opts.latency_us = 0;
+  opts.ops = 0;
+  opts.regions = 8;
+  opts.zipf_skew = 0.99;
+  opts.seed = 42;
+  opts.baseline = true;
+  opts.format = "json";
+  opts.dir = "/tmp";
+
+  while ( (c = getopt(argc, argv, "w:t:s:P:r:S:L:n:m:z:R:BF:o:d:h")) != -1 ) {
+    switch (c) {
+      case 'w': opts.workloads = split(optarg); break;
+      case 't': opts.threads = strtoull(optarg, nullptr, 0); break;
+      case 's': opts.megabytes = strtoull(optarg, nullptr, 0); break;
+      case 'P': opts.page_size = strtoull(optarg, nullptr, 0); break;
+      case 'r': opts.buffer_ratio = strtod(optarg, nullptr); break;
+      case 'S': opts.store = optarg; break;
+      case 'L': opts.latency_us = strtoull(optarg, nullptr, 0); break;
+      case 'n': opts.ops = strtoull(optarg, nullptr, 0); break;
+      case 'm': opts.regions = strtoull(optarg, nullptr, 0); break;
+      case 'z': opts.zipf_skew = strtod(optarg, nullptr); break;
+      case 'R': opts.seed = strtoull(optarg, nullptr, 0); break;
+      case 'B': opts.baseline = false; break;
+      case 'F': opts.format = optarg; break;
+      case 'o': opts.output = optarg; break;
+      case 'd': opts.dir = optarg; break;
+      default:  usage(argv[0]);
+    }
+  }
+
+  if ( opts.workloads.empty() || (opts.workloads.size() == 1 && opts.workloads[0] == "all") )
+    opts.workloads.assign(begin(workload_names), end(workload_names));
+
+  for ( auto& w : opts.workloads ) {
+    if ( find(begin(workload_names), end(workload_names), w) == end(workload_names) ) {
+      cerr << "Unknown workload: " << w << "\n";
+      usage(argv[0]);
+    }
+  }
+
+  if ( opts.page_size == 0 )
+    opts.page_size = umapcfg_get_umap_page_size();
+
+  if (   opts.threads == 0 || opts.megabytes == 0 || opts.regions == 0
+      || opts.buffer_ratio <= 0.0 || opts.page_size < sizeof(uint64_t)
+      || (opts.store != "file" && opts.store != "memory")
+      || (opts.format != "json" && opts.format != "csv") )
+    usage(argv[0]);
+
+  if ( (opts.megabytes << 20) < 2 * opts.page_size ) {
+    cerr << "Need at least two pages of data\n";
+    return 1;
+  }
+
+  Bench bench(opts);
+  vector<Result> results;
+
+  for ( auto& w : opts.workloads ) {
+    cerr << w << ": umap" << flush;
+    Result u = bench.run(w, "umap");
+
+    if ( opts.baseline ) {
+      cerr << ", mmap" << flush;
+      Result m = bench.run(w, "mmap");
+
+      u.speedup = m.seconds / u.seconds;
+      if ( u.checksum != m.checksum )
+        cerr << " (checksums differ: " << hex << u.checksum << " " << m.checksum << dec << ")";
+      results.push_back(u);
+      results.push_back(m);
+    }
+    else {
+      results.push_back(u);
+    }
+    cerr << "\n";
+  }
+
+  FILE* f = stdout;
+
+  if ( ! opts.output.empty() && (f = fopen(opts.output.c_str(), "w")) == nullptr ) {
+    cerr << "Unable to open " << opts.output << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  if ( opts.format == "json" )
+    print_json(f, opts, results);
+  else
+    print_csv(f, results);
+
+  if ( f != stdout )
+    fclose(f);
+  return 0;
+}